@@ -313,6 +313,23 @@ lp2:
     return 0;
 }
 
+/** check if any event of the (possibly ringed) event ev occurred */
+static int
+EventOccurred (pth_event_t ev)
+{
+    pth_event_t e = ev;
+    if (!ev)
+        return 0;
+    do
+    {
+        if (pth_event_status (e) == PTH_STATUS_OCCURRED)
+            return 1;
+        e = pth_event_walk (e, PTH_WALK_NEXT);
+    }
+    while (e && e != ev);
+    return 0;
+}
+
 static int
 CheckRequest (EIBConnection * con)
 {
@@ -322,7 +339,7 @@ CheckRequest (EIBConnection * con)
         uchar head[2];
         head[0] = (con->size >> 8) & 0xff;
         i = pth_read_ev (con->fd, &head + con->readlen, 2 - con->readlen, con->ev);
-        if (i == -1 && errno == EINTR && (pth_event_status (con->ev) != PTH_STATUS_OCCURRED))
+        if (i == -1 && errno == EINTR && !EventOccurred (con->ev))
             return 0;
         if (i == -1)
             return -1;
@@ -358,7 +375,7 @@ CheckRequest (EIBConnection * con)
         i =
             pth_read_ev (con->fd, con->buf + (con->readlen - 2),
                          con->size - (con->readlen - 2), con->ev);
-        if (i == -1 && errno == EINTR)
+        if (i == -1 && errno == EINTR && !EventOccurred (con->ev))
             return 0;
         if (i == -1)
             return -1;
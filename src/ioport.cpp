@@ -843,8 +843,6 @@ void TxAction::exportXml(ticpp::Element* pConfig)
 
 void TxAction::Run (pth_sem_t * stop)
 {
-    if (sleep(delay_m, stop))
-        return;
     try
     {
         IOPort* port = IOPortManager::instance()->getPort(port_m);
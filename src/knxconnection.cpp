@@ -22,13 +22,43 @@
 
 #include <iostream>
 #include <iomanip>
+#include <cerrno>
+#include <cstring>
+#include <sys/time.h>
 #include "objectcontroller.h"
 #include "knxconnection.h"
+#include "ruleserver.h"
+#include "timermanager.h"
 
 Logger& KnxConnection::logger_m(Logger::getInstance("KnxConnection"));
 
-KnxConnection::KnxConnection() : con_m(0), isRunning_m(false), stop_m(0), listener_m(0), isReady_m(false)
-{}
+// Notifies a thread blocked in KnxConnection::awaitRead()
+class ReadRequestWaiter : public ReadRequestListener
+{
+public:
+    ReadRequestWaiter() : done_m(false), success_m(false) { pth_sem_init(&sem_m); };
+    virtual void onReadCompleted(eibaddr_t gad, bool success)
+    {
+        done_m = true;
+        success_m = success;
+        pth_sem_inc(&sem_m, FALSE);
+    };
+    pth_sem_t sem_m;
+    bool done_m;
+    bool success_m;
+};
+
+KnxConnection::KnxConnection() : con_m(0), isRunning_m(false), stop_m(0), inputEv_m(0), listener_m(0), isReady_m(false), batchSize_m(1), ring_m(1), ringHead_m(0), ringCount_m(0), readTimeout_m(1000), readRate_m(20), maxPendingReads_m(4),
+    txQueueSize_m(0), maxTxQueue_m(256), txRate_m(0), txCoalesce_m(false), txSent_m(0), txCoalesced_m(0), txDropped_m(0),
+    sender_m(PTH_PRIO_STD, this, static_cast<THREADENTRY>(&KnxConnection::SendRun))
+{
+    pth_sem_init(&readRequested_m);
+    pth_sem_init(&txQueued_m);
+    nextQueuedRead_m.tv_sec = 0;
+    nextQueuedRead_m.tv_usec = 0;
+    nextTx_m.tv_sec = 0;
+    nextTx_m.tv_usec = 0;
+}
 
 KnxConnection::~KnxConnection()
 {
@@ -38,7 +68,36 @@ KnxConnection::~KnxConnection()
 
 void KnxConnection::importXml(ticpp::Element* pConfig)
 {
+    id_m = pConfig->GetAttribute("id");
     url_m = pConfig->GetAttribute("url");
+    routes_m.clear();
+    ticpp::Iterator< ticpp::Element > child("route");
+    for ( child = pConfig->FirstChildElement("route", false); child != child.end(); child++ )
+    {
+        Route route;
+        route.from = Object::ReadGroupAddr(child->GetAttribute("from"));
+        std::string to = child->GetAttribute("to");
+        route.to = (to == "") ? route.from : Object::ReadGroupAddr(to);
+        if (route.to < route.from)
+            throw ticpp::Exception("Invalid route, 'to' address lower than 'from' address");
+        routes_m.push_back(route);
+    }
+    pConfig->GetAttributeOrDefault("batch-size", &batchSize_m, 1);
+    if (batchSize_m < 1)
+        batchSize_m = 1;
+    if (ringCount_m == 0)
+    {
+        ring_m.resize(batchSize_m);
+        ringHead_m = 0;
+    }
+    readTimeout_m = RuleServer::parseDuration(pConfig->GetAttributeOrDefault("read-timeout", "1000ms"), false, true);
+    if (readTimeout_m <= 0)
+        readTimeout_m = 1000;
+    pConfig->GetAttributeOrDefault("read-rate", &readRate_m, 20);
+    pConfig->GetAttributeOrDefault("max-pending-reads", &maxPendingReads_m, 4);
+    pConfig->GetAttributeOrDefault("tx-queue-size", &maxTxQueue_m, 256);
+    pConfig->GetAttributeOrDefault("tx-rate", &txRate_m, 0);
+    txCoalesce_m = pConfig->GetAttribute("tx-coalesce") == "true";
     if (isRunning_m)
     {
         Stop();
@@ -48,7 +107,56 @@ void KnxConnection::importXml(ticpp::Element* pConfig)
 
 void KnxConnection::exportXml(ticpp::Element* pConfig)
 {
+    if (id_m != "")
+        pConfig->SetAttribute("id", id_m);
     pConfig->SetAttribute("url", url_m);
+    if (batchSize_m > 1)
+        pConfig->SetAttribute("batch-size", batchSize_m);
+    if (readTimeout_m != 1000)
+        pConfig->SetAttribute("read-timeout", RuleServer::formatDuration(readTimeout_m, true));
+    if (readRate_m != 20)
+        pConfig->SetAttribute("read-rate", readRate_m);
+    if (maxPendingReads_m != 4)
+        pConfig->SetAttribute("max-pending-reads", maxPendingReads_m);
+    if (maxTxQueue_m != 256)
+        pConfig->SetAttribute("tx-queue-size", maxTxQueue_m);
+    if (txRate_m != 0)
+        pConfig->SetAttribute("tx-rate", txRate_m);
+    if (txCoalesce_m)
+        pConfig->SetAttribute("tx-coalesce", "true");
+    RouteList_t::iterator it;
+    for (it = routes_m.begin(); it != routes_m.end(); it++)
+    {
+        ticpp::Element pElem("route");
+        pElem.SetAttribute("from", Object::WriteGroupAddr((*it).from));
+        if ((*it).to != (*it).from)
+            pElem.SetAttribute("to", Object::WriteGroupAddr((*it).to));
+        pConfig->LinkEndChild(&pElem);
+    }
+}
+
+void KnxConnection::statusXml(ticpp::Element* pStatus)
+{
+    if (id_m != "")
+        pStatus->SetAttribute("id", id_m);
+    pStatus->SetAttribute("connected", con_m ? "true" : "false");
+    pStatus->SetAttribute("tx-queue", txQueueSize_m);
+    pStatus->SetAttribute("tx-sent", txSent_m);
+    pStatus->SetAttribute("tx-coalesced", txCoalesced_m);
+    pStatus->SetAttribute("tx-dropped", txDropped_m);
+    pStatus->SetAttribute("pending-reads", pendingReads_m.size());
+    pStatus->SetAttribute("queued-reads", readQueue_m.size());
+}
+
+bool KnxConnection::routes(eibaddr_t gad)
+{
+    RouteList_t::iterator it;
+    for (it = routes_m.begin(); it != routes_m.end(); it++)
+    {
+        if (gad >= (*it).from && gad <= (*it).to)
+            return true;
+    }
+    return false;
 }
 
 void KnxConnection::addTelegramListener(TelegramListener *listener)
@@ -66,23 +174,139 @@ bool KnxConnection::removeTelegramListener(TelegramListener *listener)
     return true;
 }
 
-void KnxConnection::write(eibaddr_t gad, uint8_t* buf, int len)
+void KnxConnection::write(eibaddr_t gad, uint8_t* buf, int len, Priority priority)
 {
-    if(gad == 0)
+    if (len < 2 || len > TelegramFrame::MaxLength)
+    {
+        logger_m.errorStream() << "Invalid telegram length (gad=" << Object::WriteGroupAddr(gad) << ", buf, len=" << len << ")" << endlog;
         return;
-    logger_m.infoStream() << "write(gad=" << Object::WriteGroupAddr(gad) << ", buf, len=" << len << ")" << endlog;
-    if (con_m)
+    }
+    TelegramFrame frame;
+    frame.assign(buf, len);
+    write(gad, frame, priority);
+}
+
+void KnxConnection::write(eibaddr_t gad, const TelegramFrame& frame, Priority priority)
+{
+    if(gad == 0 || !con_m)
+        return;
+    logger_m.infoStream() << "write(gad=" << Object::WriteGroupAddr(gad) << ", buf, len=" << frame.getLength() << ")" << endlog;
+    if (maxTxQueue_m <= 0 || !isRunning_m)
     {
-        len = EIBSendGroup (con_m, gad, len, buf);
-        if (len == -1)
+        send(gad, frame.getBuffer(), frame.getLength(), stop_m);
+        return;
+    }
+    // Another device is waiting for responses
+    if (frame.isResponse() && priority < High)
+        priority = High;
+
+    TxQueue_t& queue = txQueue_m[priority];
+    if (txCoalesce_m && frame.isWrite() && listener_m && listener_m->canCoalesce(gad))
+    {
+        // Replace the value of a write to the same address still waiting to
+        // be sent, unless a read or response was queued after it
+        TxQueue_t::reverse_iterator it;
+        for (it = queue.rbegin(); it != queue.rend(); ++it)
         {
-            logger_m.errorStream() << "Write request failed (gad=" << Object::WriteGroupAddr(gad) << ", buf, len=" << len << ")" << endlog;
+            if ((*it).gad != gad)
+                continue;
+            if ((*it).frame.isWrite())
+            {
+                (*it).frame = frame;
+                ++txCoalesced_m;
+                logger_m.debugStream() << "Superseded pending write to " << Object::WriteGroupAddr(gad) << endlog;
+                return;
+            }
+            break;
         }
-        else
+    }
+    if (txQueueSize_m >= maxTxQueue_m)
+    {
+        // Make room by dropping the oldest telegram of the lowest priority
+        // class, unless the new one has an even lower priority
+        int lowest = Low;
+        while (txQueue_m[lowest].empty())
+            ++lowest;
+        ++txDropped_m;
+        if (lowest > priority)
         {
-            logger_m.debugStream() << "Write request sent" << endlog;
+            logger_m.warnStream() << "Transmit queue full, dropping telegram to " << Object::WriteGroupAddr(gad) << endlog;
+            return;
         }
+        logger_m.warnStream() << "Transmit queue full, dropping telegram to " << Object::WriteGroupAddr(txQueue_m[lowest].front().gad) << endlog;
+        txQueue_m[lowest].pop_front();
+        --txQueueSize_m;
     }
+    queue.push_back(OutgoingTelegram());
+    OutgoingTelegram& telegram = queue.back();
+    telegram.gad = gad;
+    telegram.frame = frame;
+    ++txQueueSize_m;
+    pth_sem_inc(&txQueued_m, FALSE);
+}
+
+void KnxConnection::send(eibaddr_t gad, const uint8_t* buf, int len, pth_event_t ev)
+{
+    // A send blocked on a full socket must not wait on the ring of the
+    // connection thread: it would consume its wakeups, and some of its
+    // events are freed as soon as its read returns
+    EIBSetEvent (con_m, ev);
+    len = EIBSendGroup (con_m, gad, len, const_cast<uint8_t*>(buf));
+    EIBSetEvent (con_m, inputEv_m ? inputEv_m : stop_m);
+    if (len == -1)
+    {
+        logger_m.errorStream() << "Write request failed (gad=" << Object::WriteGroupAddr(gad) << ", buf, len=" << len << ")" << endlog;
+    }
+    else
+    {
+        ++txSent_m;
+        logger_m.debugStream() << "Write request sent" << endlog;
+    }
+}
+
+void KnxConnection::SendRun (pth_sem_t * stop1)
+{
+    pth_event_t stop = pth_event (PTH_EVENT_SEM, stop1);
+    pth_event_t queued = pth_event (PTH_EVENT_SEM|PTH_UNTIL_DECREMENT, &txQueued_m);
+    pth_event_concat (stop, queued, NULL);
+    // Outside of the ring above, so that a blocked send doesn't consume
+    // the queued_m increments
+    pth_event_t sendStop = pth_event (PTH_EVENT_SEM, stop1);
+    while (pth_event_status (stop) != PTH_STATUS_OCCURRED)
+    {
+        if (txQueueSize_m == 0 || !con_m)
+        {
+            pth_wait (stop);
+            continue;
+        }
+        if (txRate_m > 0)
+        {
+            struct timeval now;
+            gettimeofday(&now, 0);
+            if (isBefore(now, nextTx_m))
+            {
+                pth_event_t tmout = pth_event (PTH_EVENT_TIME, nextTx_m);
+                pth_event_concat (stop, tmout, NULL);
+                pth_wait (stop);
+                pth_event_isolate (tmout);
+                pth_event_free (tmout, PTH_FREE_THIS);
+                continue;
+            }
+            nextTx_m = now;
+            addMilliseconds(nextTx_m, 1000 / txRate_m);
+        }
+        int priority = Alarm;
+        while (txQueue_m[priority].empty())
+            --priority;
+        OutgoingTelegram telegram = txQueue_m[priority].front();
+        txQueue_m[priority].pop_front();
+        --txQueueSize_m;
+        send(telegram.gad, telegram.frame.getBuffer(), telegram.frame.getLength(), sendStop);
+    }
+    pth_event_free (sendStop, PTH_FREE_THIS);
+    pth_event_isolate (queued);
+    pth_event_free (queued, PTH_FREE_THIS);
+    pth_event_free (stop, PTH_FREE_THIS);
 }
 
 void KnxConnection::Run (pth_sem_t * stop1)
@@ -90,6 +314,11 @@ void KnxConnection::Run (pth_sem_t * stop1)
     if (url_m == "")
         return;
     stop_m = pth_event (PTH_EVENT_SEM, stop1);
+    // Ring of events interrupting the wait for input: stop request, new
+    // read request and (added in the loop) expiry of the oldest read request
+    pth_event_t input = pth_event (PTH_EVENT_SEM, stop1);
+    pth_event_t wakeup = pth_event (PTH_EVENT_SEM|PTH_UNTIL_DECREMENT, &readRequested_m);
+    pth_event_concat (input, wakeup, NULL);
     bool retry = true;
     while (retry)
     {
@@ -104,16 +333,28 @@ void KnxConnection::Run (pth_sem_t * stop1)
                 // If scope reached this point, there is no doubt that the
                 // connection with the bus is up and ready.
                 isReady_m = true;
+                // Telegrams queued before the connection was lost are still
+                // waiting, wake up the sender
+                pth_sem_inc(&txQueued_m, FALSE);
 
-                int retval;
-                while ((retval = checkInput()) > 0)
+                int retval = 1;
+                while (retval > 0)
                 {
-                    /*        TODO: find another way to check if event occured
-                              struct timeval tv;
-                              tv.tv_sec = 1;
-                              tv.tv_usec = 0;
-                              pth_select_ev(0,0,0,0,&tv,stop);
-                    */
+                    sendQueuedReads();
+                    pth_event_t tmout = 0;
+                    struct timeval wakeup;
+                    if (getNextWakeup(wakeup))
+                    {
+                        tmout = pth_event (PTH_EVENT_TIME, wakeup);
+                        pth_event_concat (input, tmout, NULL);
+                    }
+                    retval = checkInput(input);
+                    if (tmout)
+                    {
+                        pth_event_isolate (tmout);
+                        pth_event_free (tmout, PTH_FREE_THIS);
+                    }
+                    expireReads();
                 }
                 if (retval == -1)
                     retry = false;
@@ -127,6 +368,11 @@ void KnxConnection::Run (pth_sem_t * stop1)
         }
         else
             logger_m.errorStream() << "Failed to open knxConnection url." << endlog;
+        // No response can be received anymore for outstanding requests,
+        // and queued ones would only be sent after the retry delay
+        while (!pendingReads_m.empty())
+            completeRead(pendingReads_m.begin()->first, false);
+        failQueuedReads();
         if (retry)
         {
             struct timeval tv;
@@ -138,29 +384,295 @@ void KnxConnection::Run (pth_sem_t * stop1)
         }
     }
     logger_m.infoStream() << "Out of KnxConnection loop." << endlog;
+    failQueuedReads();
+    pth_event_isolate (wakeup);
+    pth_event_free (wakeup, PTH_FREE_THIS);
+    pth_event_free (input, PTH_FREE_THIS);
     pth_event_free (stop_m, PTH_FREE_THIS);
     stop_m = 0;
 }
 
+void KnxConnection::requestRead(eibaddr_t gad, ReadRequestListener *listener)
+{
+    if (!con_m || gad == 0)
+    {
+        if (listener)
+            listener->onReadCompleted(gad, false);
+        return;
+    }
+    PendingReadMap_t::iterator it = pendingReads_m.find(gad);
+    if (it == pendingReads_m.end())
+    {
+        PendingRead& pending = pendingReads_m[gad];
+        gettimeofday(&pending.deadline, 0);
+        addMilliseconds(pending.deadline, readTimeout_m);
+        if (listener)
+            pending.listeners.push_back(listener);
+        // Requests still queued for the same address are served by this one
+        ReadQueue_t::iterator it2 = readQueue_m.begin();
+        while (it2 != readQueue_m.end())
+        {
+            if (it2->second.gad == gad)
+            {
+                if (it2->second.listener)
+                    pending.listeners.push_back(it2->second.listener);
+                readQueue_m.erase(it2++);
+            }
+            else
+                ++it2;
+        }
+        // Sent ahead of the transmit queue: a backlog of writes could
+        // otherwise delay the request past its deadline or drop it. Reads
+        // are already paced by read-rate, but still use up a tx-rate slot.
+        logger_m.infoStream() << "read(gad=" << Object::WriteGroupAddr(gad) << ")" << endlog;
+        uint8_t buf[2] = { 0, 0 };
+        send(gad, buf, 2, stop_m);
+        if (txRate_m > 0)
+        {
+            struct timeval now;
+            gettimeofday(&now, 0);
+            if (isBefore(nextTx_m, now))
+                nextTx_m = now;
+            addMilliseconds(nextTx_m, 1000 / txRate_m);
+        }
+        // The timeout starts once the request is sent. The entry may have
+        // expired meanwhile if the send blocked.
+        it = pendingReads_m.find(gad);
+        if (it != pendingReads_m.end())
+        {
+            gettimeofday(&it->second.deadline, 0);
+            addMilliseconds(it->second.deadline, readTimeout_m);
+        }
+        // Let the connection thread take the new deadline into account
+        pth_sem_inc(&readRequested_m, FALSE);
+    }
+    else if (listener)
+        it->second.listeners.push_back(listener);
+}
+
+void KnxConnection::cancelRead(eibaddr_t gad, ReadRequestListener *listener)
+{
+    PendingReadMap_t::iterator it = pendingReads_m.find(gad);
+    if (it != pendingReads_m.end())
+        it->second.listeners.remove(listener);
+    ReadQueue_t::iterator it2 = readQueue_m.begin();
+    while (it2 != readQueue_m.end())
+    {
+        if (it2->second.gad == gad && it2->second.listener == listener)
+            readQueue_m.erase(it2++);
+        else
+            ++it2;
+    }
+}
+
+void KnxConnection::queueRead(eibaddr_t gad, int priority, ReadRequestListener *listener)
+{
+    if (isVoid() || gad == 0)
+    {
+        if (listener)
+            listener->onReadCompleted(gad, false);
+        return;
+    }
+    QueuedRead queued;
+    queued.gad = gad;
+    queued.listener = listener;
+    readQueue_m.insert(ReadQueue_t::value_type(priority, queued));
+    pth_sem_inc(&readRequested_m, FALSE);
+}
+
+void KnxConnection::sendQueuedReads()
+{
+    while (!readQueue_m.empty() && con_m)
+    {
+        if (maxPendingReads_m > 0 && (int)pendingReads_m.size() >= maxPendingReads_m)
+            return;
+        if (readRate_m > 0)
+        {
+            struct timeval now;
+            gettimeofday(&now, 0);
+            if (isBefore(now, nextQueuedRead_m))
+                return;
+            nextQueuedRead_m = now;
+            addMilliseconds(nextQueuedRead_m, 1000 / readRate_m);
+        }
+        QueuedRead queued = readQueue_m.begin()->second;
+        readQueue_m.erase(readQueue_m.begin());
+        requestRead(queued.gad, queued.listener);
+    }
+}
+
+void KnxConnection::failQueuedReads()
+{
+    while (!readQueue_m.empty())
+    {
+        QueuedRead queued = readQueue_m.begin()->second;
+        readQueue_m.erase(readQueue_m.begin());
+        if (queued.listener)
+            queued.listener->onReadCompleted(queued.gad, false);
+    }
+}
+
+// Returns the time at which the connection thread must wake up to expire
+// outstanding reads or send the next queued one, if any
+bool KnxConnection::getNextWakeup(struct timeval& time)
+{
+    bool found = false;
+    if (!readQueue_m.empty() && (maxPendingReads_m <= 0 || (int)pendingReads_m.size() < maxPendingReads_m))
+    {
+        time = nextQueuedRead_m;
+        found = true;
+    }
+    PendingReadMap_t::iterator it;
+    for (it = pendingReads_m.begin(); it != pendingReads_m.end(); it++)
+    {
+        if (!found || isBefore(it->second.deadline, time))
+        {
+            time = it->second.deadline;
+            found = true;
+        }
+    }
+    return found;
+}
+
+bool KnxConnection::awaitRead(eibaddr_t gad)
+{
+    PendingReadMap_t::iterator it = pendingReads_m.find(gad);
+    if (it == pendingReads_m.end())
+        return false;
+    ReadRequestWaiter waiter;
+    it->second.listeners.push_back(&waiter);
+    pth_event_t tmout = pth_event (PTH_EVENT_TIME, it->second.deadline);
+    if (isRunning())
+    {
+        // Called from the connection thread itself (e.g. a condition
+        // evaluated while dispatching a telegram), so we have to pump the
+        // bus here or the response would never be processed.
+        while (!waiter.done_m && checkInput(tmout) > 0)
+            ;
+    }
+    else
+    {
+        pth_event_t done = pth_event (PTH_EVENT_SEM, &waiter.sem_m);
+        pth_event_concat (done, tmout, NULL);
+        pth_wait (done);
+        pth_event_isolate (tmout);
+        pth_event_free (done, PTH_FREE_THIS);
+    }
+    pth_event_free (tmout, PTH_FREE_THIS);
+    if (!waiter.done_m)
+        expireReads();
+    // The waiter is about to go out of scope, make sure it is unregistered
+    cancelRead(gad, &waiter);
+    return waiter.success_m;
+}
+
+void KnxConnection::completeRead(eibaddr_t gad, bool success)
+{
+    PendingReadMap_t::iterator it = pendingReads_m.find(gad);
+    if (it == pendingReads_m.end())
+        return;
+    // Listeners may issue new requests, so detach the entry first
+    std::list<ReadRequestListener*> listeners;
+    listeners.swap(it->second.listeners);
+    pendingReads_m.erase(it);
+    if (!success)
+        logger_m.infoStream() << "No response to read request for " << Object::WriteGroupAddr(gad) << endlog;
+    std::list<ReadRequestListener*>::iterator it2;
+    for (it2 = listeners.begin(); it2 != listeners.end(); it2++)
+        (*it2)->onReadCompleted(gad, success);
+}
+
+void KnxConnection::expireReads()
+{
+    struct timeval now;
+    gettimeofday(&now, 0);
+    std::list<eibaddr_t> expired;
+    PendingReadMap_t::iterator it;
+    for (it = pendingReads_m.begin(); it != pendingReads_m.end(); it++)
+    {
+        if (!isBefore(now, it->second.deadline))
+            expired.push_back(it->first);
+    }
+    std::list<eibaddr_t>::iterator it2;
+    for (it2 = expired.begin(); it2 != expired.end(); it2++)
+        completeRead(*it2, false);
+}
+
+// Pumps the bus: if no telegram is pending, waits for one and, in batch
+// mode, also drains every telegram already available on the socket before
+// dispatching them in order. Telegrams still pending from an interrupted
+// batch (e.g. checkInput() called from Object::read() while dispatching)
+// are delivered first to preserve ordering.
 int KnxConnection::checkInput(pth_event_t ev)
+{
+    if (!con_m)
+        return 0;
+    int retval = 1;
+    if (ringCount_m == 0)
+    {
+        retval = readTelegram(ev);
+        while (retval > 0 && ringCount_m < batchSize_m && isInputAvailable())
+            retval = readTelegram(0);
+    }
+    // Rules fed by several telegrams of the batch are evaluated only once
+    RuleEvaluationCycle cycle;
+    while (ringCount_m > 0)
+    {
+        // Copy the telegram since a listener may call checkInput() again
+        Telegram telegram = ring_m[ringHead_m];
+        ringHead_m = (ringHead_m + 1) % ring_m.size();
+        --ringCount_m;
+        if (!telegram.superseded)
+            dispatchTelegram(telegram);
+    }
+    cycle.end();
+    if (ring_m.size() != (unsigned int)batchSize_m)
+    {
+        ring_m.resize(batchSize_m);
+        ringHead_m = 0;
+    }
+    return retval;
+}
+
+bool KnxConnection::isInputAvailable()
+{
+    int fd = EIB_Poll_FD(con_m);
+    if (fd == -1)
+        return false;
+    fd_set set;
+    FD_ZERO(&set);
+    FD_SET(fd, &set);
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+    return select(fd + 1, &set, 0, 0, &tv) > 0;
+}
+
+int KnxConnection::readTelegram(pth_event_t ev)
 {
     int len;
     eibaddr_t dest;
     eibaddr_t src;
-    uint8_t buf[200];
-    if (!con_m)
-        return 0;
+    Telegram& telegram = ring_m[(ringHead_m + ringCount_m) % ring_m.size()];
     if (ev)
+    {
+        inputEv_m = ev;
         EIBSetEvent (con_m, ev);
-    len = EIBGetGroup_Src (con_m, sizeof (buf), buf, &src, &dest);
+    }
+    len = EIBGetGroup_Src (con_m, sizeof (telegram.buf), telegram.buf, &src, &dest);
+    int err = errno;
     if (ev)
     {
+        inputEv_m = 0;
         EIBSetEvent (con_m, stop_m);
         if (pth_event_status (ev) == PTH_STATUS_OCCURRED)
             return -1;
     }
     if (pth_event_status (stop_m) == PTH_STATUS_OCCURRED)
         return -1;
+    // Interrupted by another event of the ring, nothing received
+    if (len == -1 && err == EINTR)
+        return 1;
     if (len == -1)
     {
         logger_m.errorStream() << "Read failed" << endlog;
@@ -171,56 +683,89 @@ int KnxConnection::checkInput(pth_event_t ev)
         logger_m.warnStream() << "Invalid Packet (too short)" << endlog;
         return 0;
     }
-    if (buf[0] & 0x3 || (buf[1] & 0xC0) == 0xC0)
+    if (telegram.buf[0] & 0x3 || (telegram.buf[1] & 0xC0) == 0xC0)
     {
         logger_m.warnStream() << "Unknown APDU from "<< src << " to " << dest << endlog;
+        return 1;
     }
-    else
+    telegram.src = src;
+    telegram.dest = dest;
+    telegram.len = len;
+    telegram.superseded = false;
+    if ((telegram.buf[1] & 0xC0) == 0x80 && ringCount_m > 0 && listener_m && listener_m->canCoalesce(dest))
     {
-        if (logger_m.isDebugEnabled())
+        // Only the most recent telegram for this address is considered, so
+        // a write is never dropped in favour of one preceding a read. The
+        // write kept is the last one, dispatched with its own source
+        // address: objects see the last writer (e.g. for conditions on the
+        // source), the senders of the superseded writes are not reported.
+        for (int i = ringCount_m - 1; i >= 0; --i)
         {
-            DbgStream dbg = logger_m.debugStream();
-            switch (buf[1] & 0xC0)
-            {
-            case 0x00:
-                dbg << "Read";
-                break;
-            case 0x40:
-                dbg << "Response";
-                break;
-            case 0x80:
-                dbg << "Write";
-                break;
-            }
-            dbg << " from " << Object::WriteAddr(src) << " to " << Object::WriteGroupAddr(dest);
-            if (buf[1] & 0xC0)
+            Telegram& previous = ring_m[(ringHead_m + i) % ring_m.size()];
+            if (previous.dest != dest || previous.superseded)
+                continue;
+            if ((previous.buf[1] & 0xC0) == 0x80)
             {
-                dbg << ": " << std::hex << std::setfill ('0') << std::setw (2);
-                if (len == 2)
-                    dbg << (int)(buf[1] & 0x3F);
-                else
-                {
-                    for (uint8_t *p = buf+2; p < buf+len; p++)
-                        dbg << (int)*p << " ";
-                }
+                logger_m.debugStream() << "Coalescing write to " << Object::WriteGroupAddr(dest) << endlog;
+                previous.superseded = true;
             }
-            dbg << std::dec << endlog;
+            break;
+        }
+    }
+    ++ringCount_m;
+    return 1;
+}
+
+void KnxConnection::dispatchTelegram(const Telegram& telegram)
+{
+    const uint8_t *buf = telegram.buf;
+    int len = telegram.len;
+    eibaddr_t src = telegram.src;
+    eibaddr_t dest = telegram.dest;
+    if (logger_m.isDebugEnabled())
+    {
+        DbgStream dbg = logger_m.debugStream();
+        switch (buf[1] & 0xC0)
+        {
+        case 0x00:
+            dbg << "Read";
+            break;
+        case 0x40:
+            dbg << "Response";
+            break;
+        case 0x80:
+            dbg << "Write";
+            break;
         }
-        if (listener_m)
+        dbg << " from " << Object::WriteAddr(src) << " to " << Object::WriteGroupAddr(dest);
+        if (buf[1] & 0xC0)
         {
-            switch (buf[1] & 0xC0)
+            dbg << ": " << std::hex << std::setfill ('0') << std::setw (2);
+            if (len == 2)
+                dbg << (int)(buf[1] & 0x3F);
+            else
             {
-            case 0x00:
-                listener_m->onRead(src, dest, buf, len);
-                break;
-            case 0x40:
-                listener_m->onResponse(src, dest, buf, len);
-                break;
-            case 0x80:
-                listener_m->onWrite(src, dest, buf, len);
-                break;
+                for (const uint8_t *p = buf+2; p < buf+len; p++)
+                    dbg << (int)*p << " ";
             }
         }
+        dbg << std::dec << endlog;
     }
-    return 1;
+    if (listener_m)
+    {
+        switch (buf[1] & 0xC0)
+        {
+        case 0x00:
+            listener_m->onRead(src, dest, buf, len);
+            break;
+        case 0x40:
+            listener_m->onResponse(src, dest, buf, len);
+            break;
+        case 0x80:
+            listener_m->onWrite(src, dest, buf, len);
+            break;
+        }
+    }
+    if ((buf[1] & 0xC0) == 0x40)
+        completeRead(dest, true);
 }
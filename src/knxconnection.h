@@ -27,10 +27,70 @@
 #include "logger.h"
 #include "threads.h"
 #include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <deque>
+#include <functional>
+#include <cstring>
 #include "ticpp.h"
 #include "eibclient.h"
 
 
+// Group telegram payload (TPCI, APCI and value) built in place without any
+// heap allocation. Bytes appended beyond the capacity are dropped.
+class TelegramFrame
+{
+public:
+    enum { MaxLength = 256 };
+
+    TelegramFrame() : len_m(0) {};
+    // Starts a write or response frame, optionally carrying 6 bits of data
+    // in the APCI byte (DPTs shorter than one byte)
+    explicit TelegramFrame(bool isWrite, uint8_t shortData = 0) : len_m(2)
+    {
+        buf_m[0] = 0;
+        buf_m[1] = (isWrite ? 0x80 : 0x40) | (shortData & 0x3F);
+    };
+
+    TelegramFrame& operator<<(uint8_t value)
+    {
+        if (len_m < MaxLength)
+            buf_m[len_m++] = value;
+        return *this;
+    };
+    // Appends the 'bytes' least significant bytes of 'value', MSB first
+    template <class T> TelegramFrame& append(T value, int bytes)
+    {
+        while (bytes-- > 0)
+            *this << static_cast<uint8_t>(value >> (8 * bytes));
+        return *this;
+    };
+    void assign(const uint8_t* buf, int len)
+    {
+        len_m = len > MaxLength ? MaxLength : len;
+        memcpy(buf_m, buf, len_m);
+    };
+    // Zero-fills the frame up to 'len' bytes
+    void pad(int len)
+    {
+        if (len > MaxLength)
+            len = MaxLength;
+        while (len_m < len)
+            buf_m[len_m++] = 0;
+    };
+
+    uint8_t* getBuffer() { return buf_m; };
+    const uint8_t* getBuffer() const { return buf_m; };
+    int getLength() const { return len_m; };
+    bool isWrite() const { return len_m >= 2 && (buf_m[1] & 0xC0) == 0x80; };
+    bool isResponse() const { return len_m >= 2 && (buf_m[1] & 0xC0) == 0x40; };
+
+private:
+    int len_m;
+    uint8_t buf_m[MaxLength];
+};
+
 class TelegramListener
 {
 public:
@@ -38,37 +98,171 @@ public:
     virtual void onWrite(eibaddr_t src, eibaddr_t dest, const uint8_t* buf, int len) = 0;
     virtual void onRead(eibaddr_t src, eibaddr_t dest, const uint8_t* buf, int len) = 0;
     virtual void onResponse(eibaddr_t src, eibaddr_t dest, const uint8_t* buf, int len) = 0;
+    // Returns true if only the latest of several pending writes to 'dest'
+    // needs to be delivered (i.e. no stateless object listens to it). The
+    // write delivered then carries the source address of the last sender.
+    virtual bool canCoalesce(eibaddr_t dest) { return false; };
+};
+
+class ReadRequestListener
+{
+public:
+    virtual ~ReadRequestListener() {};
+    // Called when a response was received for 'gad' (success=true) or
+    // when the read request timed out or could not be sent (success=false)
+    virtual void onReadCompleted(eibaddr_t gad, bool success) = 0;
 };
 
-class KnxConnection : public Thread
+class KnxConnection : public Thread, public Runable
 {
 public:
+    // Transmit priority classes, higher values are sent first
+    enum Priority
+    {
+        Low = 0,
+        Normal,
+        High,
+        Alarm
+    };
+
     KnxConnection();
     virtual ~KnxConnection();
 
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
+    void statusXml(ticpp::Element* pStatus);
 
-    void startConnection() { isRunning_m = true; Start(); };
-    void stopConnection() { isRunning_m = false; Stop(); };
+    void startConnection() { isRunning_m = true; Start(); sender_m.Start(); };
+    void stopConnection() { isRunning_m = false; sender_m.Stop(); Stop(); };
 	bool isVoid() { return url_m == "";}
+    const std::string& getID() { return id_m; };
+    // Returns true if writes to 'gad' must go through this connection
+    bool routes(eibaddr_t gad);
 
     void addTelegramListener(TelegramListener *listener);
     bool removeTelegramListener(TelegramListener *listener);
-    void write(eibaddr_t gad, uint8_t* buf, int len);
+    // Queues a telegram for the sender thread (or sends it immediately if
+    // the transmit queue is disabled with tx-queue-size="0"). Telegrams
+    // shorter than 2 bytes or longer than TelegramFrame::MaxLength are
+    // rejected.
+    void write(eibaddr_t gad, const TelegramFrame& frame, Priority priority = Normal);
+    void write(eibaddr_t gad, uint8_t* buf, int len, Priority priority = Normal);
     int checkInput(pth_event_t ev = 0);
 
+    // Sends a read request for 'gad' unless one is already outstanding and
+    // registers 'listener' (if any) to be notified of its completion.
+    void requestRead(eibaddr_t gad, ReadRequestListener *listener = 0);
+    void cancelRead(eibaddr_t gad, ReadRequestListener *listener);
+    bool isReadPending(eibaddr_t gad) { return pendingReads_m.find(gad) != pendingReads_m.end(); };
+    // Waits until the outstanding read request for 'gad' completes.
+    // Returns true if a response was received.
+    bool awaitRead(eibaddr_t gad);
+    // Queues a read request to be sent later by the connection thread,
+    // paced according to 'read-rate' and 'max-pending-reads'. Requests
+    // with a higher priority are sent first. A read requested directly
+    // with requestRead() also completes the queued ones for its address.
+    void queueRead(eibaddr_t gad, int priority, ReadRequestListener *listener);
+
     bool isReady() const { return isReady_m; }
 
 private:
+    struct Telegram
+    {
+        eibaddr_t src;
+        eibaddr_t dest;
+        int len;
+        bool superseded;
+        uint8_t buf[200];
+    };
+    typedef std::vector<Telegram> TelegramRing_t;
+
+    struct PendingRead
+    {
+        struct timeval deadline;
+        std::list<ReadRequestListener*> listeners;
+    };
+    typedef std::map<eibaddr_t, PendingRead> PendingReadMap_t;
+
+    struct QueuedRead
+    {
+        eibaddr_t gad;
+        ReadRequestListener *listener;
+    };
+    typedef std::multimap<int, QueuedRead, std::greater<int> > ReadQueue_t;
+
+    struct Route
+    {
+        eibaddr_t from;
+        eibaddr_t to;
+    };
+    typedef std::vector<Route> RouteList_t;
+
+    struct OutgoingTelegram
+    {
+        eibaddr_t gad;
+        TelegramFrame frame;
+    };
+    typedef std::deque<OutgoingTelegram> TxQueue_t;
+
     EIBConnection *con_m;
     bool isRunning_m;
     pth_event_t stop_m;
+    // Event ring installed on con_m by a read in progress, if any. Sends
+    // use their own event and put this one back afterwards.
+    pth_event_t inputEv_m;
+    std::string id_m;
     std::string url_m;
+    // Group address ranges routed to this connection
+    RouteList_t routes_m;
     TelegramListener *listener_m;
     bool isReady_m;
+    int batchSize_m;
+    // Telegrams received but not yet dispatched. Holds a single entry unless
+    // batching is enabled with the 'batch-size' attribute.
+    TelegramRing_t ring_m;
+    int ringHead_m;
+    int ringCount_m;
+    // Outstanding read requests by group address
+    PendingReadMap_t pendingReads_m;
+    // Time to wait for a read response (ms)
+    int readTimeout_m;
+    // Read requests waiting to be sent, by priority
+    ReadQueue_t readQueue_m;
+    // Max number of queued read requests sent per second (0 = unlimited)
+    int readRate_m;
+    // Max number of outstanding requests before sending queued ones
+    int maxPendingReads_m;
+    struct timeval nextQueuedRead_m;
+    // Telegrams waiting to be sent, one queue per priority class
+    TxQueue_t txQueue_m[Alarm+1];
+    int txQueueSize_m;
+    int maxTxQueue_m;
+    // Max number of telegrams sent per second (0 = unlimited)
+    int txRate_m;
+    // Replace queued writes to the same address instead of sending each of
+    // them ('tx-coalesce' attribute, off by default)
+    bool txCoalesce_m;
+    struct timeval nextTx_m;
+    unsigned long txSent_m;
+    unsigned long txCoalesced_m;
+    unsigned long txDropped_m;
+    // Incremented when a telegram is added to the transmit queue
+    pth_sem_t txQueued_m;
+    Thread sender_m;
+    // Incremented to wake up the connection thread when a read is requested
+    pth_sem_t readRequested_m;
 
     void Run (pth_sem_t * stop);
+    int readTelegram(pth_event_t ev);
+    bool isInputAvailable();
+    void dispatchTelegram(const Telegram& telegram);
+    void completeRead(eibaddr_t gad, bool success);
+    void expireReads();
+    void sendQueuedReads();
+    void failQueuedReads();
+    void SendRun(pth_sem_t * stop);
+    void send(eibaddr_t gad, const uint8_t* buf, int len, pth_event_t ev);
+    bool getNextWakeup(struct timeval& time);
     static Logger& logger_m;
 };
 
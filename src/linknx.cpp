@@ -259,7 +259,7 @@ main (int ac, char *ag[])
     signal (SIGTERM, SIG_IGN);
 
     services->setConfigFile(arg.writeconfig);
-    services->getKnxConnection()->addTelegramListener(objects);
+    services->addTelegramListener(objects);
     services->start();
     RuleInitializer initializer;
     initializer.Start();
@@ -206,8 +206,6 @@ void LuaScriptAction::exportXml(ticpp::Element* pConfig)
 
 void LuaScriptAction::Run (pth_sem_t * stop)
 {
-    if (Action::sleep(delay_m, stop))
-        return;
     logger_m.infoStream() << "Execute LuaScriptAction" << endlog;
     LuaMain::lock();
     lua_pushlightuserdata(l_m, stop);
@@ -56,6 +56,8 @@ public:
     virtual ~LuaCondition();
 
     virtual bool evaluate();
+    // Scripts may write objects, they are never reordered
+    virtual bool hasSideEffects() { return true; };
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
@@ -29,7 +29,7 @@ ObjectController* ObjectController::instance_m;
 
 Logger& Object::logger_m(Logger::getInstance("Object"));
 
-Object::Object() : init_m(false), flags_m(Default), refCount_m(0), gad_m(0), readRequestGad_m(0), persist_m(false), writeLog_m(false), readPending_m(false)
+Object::Object() : init_m(false), flags_m(Default), refCount_m(0), gad_m(0), readRequestGad_m(0), persist_m(false), writeLog_m(false), priority_m(KnxConnection::Normal), currentValueResolved_m(false), renderedValueValid_m(false), changeCount_m(0)
 {}
 
 Object::~Object()
@@ -38,164 +38,197 @@ Object::~Object()
         logger_m.errorStream() << "Object (id=" << getID() << "): deleted object still has " << refCount_m << " references" << endlog;
 }
 
-Object* Object::create(const std::string& type)
-{
-    if (type == "" || type == "EIS1" || type == "1.001")
-        return new SwitchingSwitchObject();
-    else if (type.compare(0, 2, "1.") == 0)
-    {    
-        if (type == "1.002")
-            return new SwitchingObjectImpl<SwitchingImplObjectValue<2> >();
-        else if (type == "1.003")
-            return new SwitchingObjectImpl<SwitchingImplObjectValue<3> >();
-        else if (type == "1.004")
-            return new SwitchingObjectImpl<SwitchingImplObjectValue<4> >();
-        else if (type == "1.005")
-            return new SwitchingObjectImpl<SwitchingImplObjectValue<5> >();
-        else if (type == "1.006")
-            return new SwitchingObjectImpl<SwitchingImplObjectValue<6> >();
-        else if (type == "1.007")
-            return new SwitchingObjectImpl<SwitchingImplObjectValue<7> >();
-        else if (type == "1.008")
-            return new SwitchingObjectImpl<SwitchingImplObjectValue<8> >();
-        else if (type == "1.009")
-            return new SwitchingObjectImpl<SwitchingImplObjectValue<9> >();
-        else if (type == "1.010")
-            return new SwitchingObjectImpl<SwitchingImplObjectValue<10> >();
-        else if (type == "1.011")
-            return new SwitchingObjectImpl<SwitchingImplObjectValue<11> >();
-        else if (type == "1.012")
-            return new SwitchingObjectImpl<SwitchingImplObjectValue<12> >();
-        else if (type == "1.013")
-            return new SwitchingObjectImpl<SwitchingImplObjectValue<13> >();
-        else if (type == "1.014")
-            return new SwitchingObjectImpl<SwitchingImplObjectValue<14> >();
-        else return 0;
-    }
-    else if (type.compare(0, 2, "2.") == 0)
-    {
-        if (type == "2.xxx")
-            return new SwitchingControlObject<SwitchingControlImplObjectValue<0> >();
-        else if (type == "2.001")
-            return new SwitchingControlObject<SwitchingControlImplObjectValue<1> >();
-        else if (type == "2.002")
-            return new SwitchingControlObject<SwitchingControlImplObjectValue<2> >();
-        else if (type == "2.003")
-            return new SwitchingControlObject<SwitchingControlImplObjectValue<3> >();
-        else if (type == "2.004")
-            return new SwitchingControlObject<SwitchingControlImplObjectValue<4> >();
-        else if (type == "2.005")
-            return new SwitchingControlObject<SwitchingControlImplObjectValue<5> >();
-        else if (type == "2.006")
-            return new SwitchingControlObject<SwitchingControlImplObjectValue<6> >();
-        else if (type == "2.007")
-            return new SwitchingControlObject<SwitchingControlImplObjectValue<7> >();
-        else if (type == "2.008")
-            return new SwitchingControlObject<SwitchingControlImplObjectValue<8> >();
-        else if (type == "2.009")
-            return new SwitchingControlObject<SwitchingControlImplObjectValue<9> >();
-        else if (type == "2.010")
-            return new SwitchingControlObject<SwitchingControlImplObjectValue<10> >();
-        else if (type == "2.011")
-            return new SwitchingControlObject<SwitchingControlImplObjectValue<11> >();
-        else if (type == "2.012")
-            return new SwitchingControlObject<SwitchingControlImplObjectValue<12> >();
-        else return 0;
-    }
-    else if (type == "EIS2" || type == "3.007")
-        return new DimmingObject();
-    else if (type == "3.008")
-        return new BlindsObject();
-    else if (type == "4.001")
-        return new AsciiCharObject();
-    else if (type == "4.002")
-        return new Latin1CharObject();
-    else if (type == "EIS3" || type == "10.001")
-        return new TimeObject();
-    else if (type == "EIS4" || type == "11.001")
-        return new DateObject();
-    else if (type == "EIS5" || type == "9.xxx")
-        return new ValueObjectImpl<ValueImplObjectValue<0> >();
-    else if (type.compare(0, 2, "9.") == 0)
-    {    
-        if (type == "9.001")
-            return new ValueObjectImpl<ValueImplObjectValue<1> >();
-        else if (type == "9.002")
-            return new ValueObjectImpl<ValueImplObjectValue<2> >();
-        else if (type == "9.003")
-            return new ValueObjectImpl<ValueImplObjectValue<3> >();
-        else if (type == "9.004")
-            return new ValueObjectImpl<ValueImplObjectValue<4> >();
-        else if (type == "9.005")
-            return new ValueObjectImpl<ValueImplObjectValue<5> >();
-        else if (type == "9.006")
-            return new ValueObjectImpl<ValueImplObjectValue<6> >();
-        else if (type == "9.007")
-            return new ValueObjectImpl<ValueImplObjectValue<7> >();
-        else if (type == "9.008")
-            return new ValueObjectImpl<ValueImplObjectValue<8> >();
-        else if (type == "9.010")
-            return new ValueObjectImpl<ValueImplObjectValue<10> >();
-        else if (type == "9.011")
-            return new ValueObjectImpl<ValueImplObjectValue<11> >();
-        else if (type == "9.020")
-            return new ValueObjectImpl<ValueImplObjectValue<20> >();
-        else if (type == "9.021")
-            return new ValueObjectImpl<ValueImplObjectValue<21> >();
-        else if (type == "9.022")
-            return new ValueObjectImpl<ValueImplObjectValue<22> >();
-        else if (type == "9.023")
-            return new ValueObjectImpl<ValueImplObjectValue<23> >();
-        else if (type == "9.024")
-            return new ValueObjectImpl<ValueImplObjectValue<24> >();
-        else if (type == "9.025")
-            return new ValueObjectImpl<ValueImplObjectValue<25> >();
-        else if (type == "9.026")
-            return new ValueObjectImpl<ValueImplObjectValue<26> >();
-        else if (type == "9.027")
-            return new ValueObjectImpl<ValueImplObjectValue<27> >();
-        else if (type == "9.028")
-            return new ValueObjectImpl<ValueImplObjectValue<28> >();
-        else return 0;
-    }
-    else if (type == "14.xxx")
-        return new ValueObject32();
-    else if (type == "EIS6" || type == "5.xxx")
-        return new U8Object();
-    else if (type == "5.001")
-        return new ScalingObject();
-    else if (type == "5.003")
-        return new AngleObject();
-    else if (type == "5.010")
-        return new U8CountObject();
-    else if (type == "heat-mode" || type == "20.102")
-        return new HeatingModeObject();
-    else if (type == "EIS10" || type == "7.xxx")
-        return new U16Object();
-    else if (type == "EIS11" || type == "12.xxx")
-        return new U32Object();
-    else if (type == "EIS14" || type == "6.xxx")
-        return new S8Object();
-    else if (type == "8.xxx")
-        return new S16Object();
-    else if (type == "13.xxx")
-        return new S32Object();
+typedef Object* (*ObjectFactory)();
+
+template <class T> static Object* createObject()
+{
+    return new T();
+}
+
+struct ObjectTypeDef
+{
+    const char* type;
+    ObjectFactory factory;
+};
+
+// Supported object types. Entries after the first one using the same
+// factory are aliases.
+static const ObjectTypeDef ObjectTypeDefs[] = {
+    { "1.001", &createObject<SwitchingSwitchObject> },
+    { "", &createObject<SwitchingSwitchObject> },
+    { "EIS1", &createObject<SwitchingSwitchObject> },
+    { "1.002", &createObject<SwitchingObjectImpl<SwitchingImplObjectValue<2> > > },
+    { "1.003", &createObject<SwitchingObjectImpl<SwitchingImplObjectValue<3> > > },
+    { "1.004", &createObject<SwitchingObjectImpl<SwitchingImplObjectValue<4> > > },
+    { "1.005", &createObject<SwitchingObjectImpl<SwitchingImplObjectValue<5> > > },
+    { "1.006", &createObject<SwitchingObjectImpl<SwitchingImplObjectValue<6> > > },
+    { "1.007", &createObject<SwitchingObjectImpl<SwitchingImplObjectValue<7> > > },
+    { "1.008", &createObject<SwitchingObjectImpl<SwitchingImplObjectValue<8> > > },
+    { "1.009", &createObject<SwitchingObjectImpl<SwitchingImplObjectValue<9> > > },
+    { "1.010", &createObject<SwitchingObjectImpl<SwitchingImplObjectValue<10> > > },
+    { "1.011", &createObject<SwitchingObjectImpl<SwitchingImplObjectValue<11> > > },
+    { "1.012", &createObject<SwitchingObjectImpl<SwitchingImplObjectValue<12> > > },
+    { "1.013", &createObject<SwitchingObjectImpl<SwitchingImplObjectValue<13> > > },
+    { "1.014", &createObject<SwitchingObjectImpl<SwitchingImplObjectValue<14> > > },
+    { "2.xxx", &createObject<SwitchingControlObject<SwitchingControlImplObjectValue<0> > > },
+    { "2.001", &createObject<SwitchingControlObject<SwitchingControlImplObjectValue<1> > > },
+    { "2.002", &createObject<SwitchingControlObject<SwitchingControlImplObjectValue<2> > > },
+    { "2.003", &createObject<SwitchingControlObject<SwitchingControlImplObjectValue<3> > > },
+    { "2.004", &createObject<SwitchingControlObject<SwitchingControlImplObjectValue<4> > > },
+    { "2.005", &createObject<SwitchingControlObject<SwitchingControlImplObjectValue<5> > > },
+    { "2.006", &createObject<SwitchingControlObject<SwitchingControlImplObjectValue<6> > > },
+    { "2.007", &createObject<SwitchingControlObject<SwitchingControlImplObjectValue<7> > > },
+    { "2.008", &createObject<SwitchingControlObject<SwitchingControlImplObjectValue<8> > > },
+    { "2.009", &createObject<SwitchingControlObject<SwitchingControlImplObjectValue<9> > > },
+    { "2.010", &createObject<SwitchingControlObject<SwitchingControlImplObjectValue<10> > > },
+    { "2.011", &createObject<SwitchingControlObject<SwitchingControlImplObjectValue<11> > > },
+    { "2.012", &createObject<SwitchingControlObject<SwitchingControlImplObjectValue<12> > > },
+    { "3.007", &createObject<DimmingObject> },
+    { "EIS2", &createObject<DimmingObject> },
+    { "3.008", &createObject<BlindsObject> },
+    { "4.001", &createObject<AsciiCharObject> },
+    { "4.002", &createObject<Latin1CharObject> },
+    { "10.001", &createObject<TimeObject> },
+    { "EIS3", &createObject<TimeObject> },
+    { "11.001", &createObject<DateObject> },
+    { "EIS4", &createObject<DateObject> },
+    { "9.xxx", &createObject<ValueObjectImpl<ValueImplObjectValue<0> > > },
+    { "EIS5", &createObject<ValueObjectImpl<ValueImplObjectValue<0> > > },
+    { "9.001", &createObject<ValueObjectImpl<ValueImplObjectValue<1> > > },
+    { "9.002", &createObject<ValueObjectImpl<ValueImplObjectValue<2> > > },
+    { "9.003", &createObject<ValueObjectImpl<ValueImplObjectValue<3> > > },
+    { "9.004", &createObject<ValueObjectImpl<ValueImplObjectValue<4> > > },
+    { "9.005", &createObject<ValueObjectImpl<ValueImplObjectValue<5> > > },
+    { "9.006", &createObject<ValueObjectImpl<ValueImplObjectValue<6> > > },
+    { "9.007", &createObject<ValueObjectImpl<ValueImplObjectValue<7> > > },
+    { "9.008", &createObject<ValueObjectImpl<ValueImplObjectValue<8> > > },
+    { "9.010", &createObject<ValueObjectImpl<ValueImplObjectValue<10> > > },
+    { "9.011", &createObject<ValueObjectImpl<ValueImplObjectValue<11> > > },
+    { "9.020", &createObject<ValueObjectImpl<ValueImplObjectValue<20> > > },
+    { "9.021", &createObject<ValueObjectImpl<ValueImplObjectValue<21> > > },
+    { "9.022", &createObject<ValueObjectImpl<ValueImplObjectValue<22> > > },
+    { "9.023", &createObject<ValueObjectImpl<ValueImplObjectValue<23> > > },
+    { "9.024", &createObject<ValueObjectImpl<ValueImplObjectValue<24> > > },
+    { "9.025", &createObject<ValueObjectImpl<ValueImplObjectValue<25> > > },
+    { "9.026", &createObject<ValueObjectImpl<ValueImplObjectValue<26> > > },
+    { "9.027", &createObject<ValueObjectImpl<ValueImplObjectValue<27> > > },
+    { "9.028", &createObject<ValueObjectImpl<ValueImplObjectValue<28> > > },
+    { "14.xxx", &createObject<ValueObject32> },
+    { "5.xxx", &createObject<U8Object> },
+    { "EIS6", &createObject<U8Object> },
+    { "5.001", &createObject<ScalingObject> },
+    { "5.003", &createObject<AngleObject> },
+    { "5.010", &createObject<U8CountObject> },
+    { "20.102", &createObject<HeatingModeObject> },
+    { "heat-mode", &createObject<HeatingModeObject> },
+    { "7.xxx", &createObject<U16Object> },
+    { "EIS10", &createObject<U16Object> },
+    { "12.xxx", &createObject<U32Object> },
+    { "EIS11", &createObject<U32Object> },
+    { "6.xxx", &createObject<S8Object> },
+    { "EIS14", &createObject<S8Object> },
+    { "8.xxx", &createObject<S16Object> },
+    { "13.xxx", &createObject<S32Object> },
 #ifdef STL_STREAM_SUPPORT_INT64
-    else if (type == "29.xxx")
-        return new S64Object();
+    { "29.xxx", &createObject<S64Object> },
 #endif
-    else if (type == "16.001")
-        return new String14Object();
-    else if (type == "EIS15" || type == "16.000")
-        return new String14AsciiObject();
-    else if (type == "28.001")
-        return new StringObject();
-    else if (type == "232.600")
-        return new RGBObject();
-    else if (type == "251.600")
-        return new RGBWObject();
-    else
+    { "16.001", &createObject<String14Object> },
+    { "16.000", &createObject<String14AsciiObject> },
+    { "EIS15", &createObject<String14AsciiObject> },
+    { "28.001", &createObject<StringObject> },
+    { "232.600", &createObject<RGBObject> },
+    { "251.600", &createObject<RGBWObject> },
+    { 0, 0 }
+};
+
+// Resolves type names to factories with a single hashed lookup instead of
+// a chain of string comparisons. Built on first use from ObjectTypeDefs.
+class ObjectTypeRegistry
+{
+public:
+    struct Entry
+    {
+        const char* type;
+        ObjectFactory factory;
+        // Type reported by objects created with this entry
+        std::string canonical;
+    };
+
+    static ObjectTypeRegistry* instance()
+    {
+        static ObjectTypeRegistry registry;
+        return &registry;
+    };
+
+    const Entry* find(const std::string& type)
+    {
+        unsigned int i = hash(type) & (TableSize - 1);
+        while (table_m[i] >= 0)
+        {
+            const Entry& entry = entries_m[table_m[i]];
+            if (type == entry.type)
+                return &entry;
+            i = (i + 1) & (TableSize - 1);
+        }
         return 0;
+    };
+
+private:
+    // Must stay well above the number of type names to keep probe
+    // sequences short
+    enum { TableSize = 512 };
+    std::vector<Entry> entries_m;
+    int table_m[TableSize];
+
+    ObjectTypeRegistry()
+    {
+        for (int i = 0; i < TableSize; i++)
+            table_m[i] = -1;
+        for (const ObjectTypeDef* def = ObjectTypeDefs; def->type; def++)
+        {
+            Entry entry;
+            entry.type = def->type;
+            entry.factory = def->factory;
+            if (!entries_m.empty() && entries_m.back().factory == def->factory)
+                entry.canonical = entries_m.back().canonical;
+            else
+            {
+                Object* obj = def->factory();
+                entry.canonical = obj->getType();
+                delete obj;
+            }
+            entries_m.push_back(entry);
+
+            unsigned int i = hash(def->type) & (TableSize - 1);
+            while (table_m[i] >= 0)
+                i = (i + 1) & (TableSize - 1);
+            table_m[i] = entries_m.size() - 1;
+        }
+    };
+
+    // FNV-1a
+    static unsigned int hash(const std::string& str)
+    {
+        unsigned int h = 2166136261u;
+        for (std::string::const_iterator it = str.begin(); it != str.end(); ++it)
+        {
+            h ^= static_cast<unsigned char>(*it);
+            h *= 16777619u;
+        }
+        return h;
+    };
+};
+
+Object* Object::create(const std::string& type)
+{
+    const ObjectTypeRegistry::Entry* entry = ObjectTypeRegistry::instance()->find(type);
+    return entry ? entry->factory() : 0;
+}
+
+std::string Object::getCanonicalType(const std::string& type)
+{
+    const ObjectTypeRegistry::Entry* entry = ObjectTypeRegistry::instance()->find(type);
+    return entry ? entry->canonical : "";
 }
 
 Object* Object::create(ticpp::Element* pConfig)
@@ -214,6 +247,13 @@ Object* Object::create(ticpp::Element* pConfig)
 
 void Object::setValue(ObjectValue* value)
 {
+    // Unchanged simple values need neither the typed set() nor an update
+    if (!forceUpdate())
+    {
+        const ValueRef& current = getCurrentValueRef();
+        if (current.isComparable(value->getValueRef()) && current.compare(value->getValueRef()) == 0)
+            return;
+    }
     if (set(value) || forceUpdate())
         onInternalUpdate();
 }
@@ -232,19 +272,41 @@ ObjectValue* Object::get()
     return getObjectValue();
 }
 
-void Object::importXml(ticpp::Element* pConfig)
+std::string Object::getValue()
 {
-    std::string type = pConfig->GetAttribute("type");
-    if (type != getType())
+    // get() may read the value from the bus, which invalidates the cache
+    return renderValue(get());
+}
+
+std::string Object::getValueNoWait()
+{
+    if (!init_m)
+    {
+        // Without read address, read() wouldn't wait either
+        if (getReadRequestGad() == 0)
+            init_m = true;
+        else
+            requestRead();
+    }
+    return renderValue(getObjectValue());
+}
+
+std::string Object::renderValue(ObjectValue* value)
+{
+    if (!renderedValueValid_m)
     {
-        // sometimes, different type strings refer to the same type
-        // in that case, create a temporary object just to get the type string.
-        Object* obj = Object::create(type);
-        type = obj->getType();
-        delete obj;
-        if (type != getType())
-            throw ticpp::Exception("Changing type of existing object is not allowed");
+        renderedValue_m = value->toString();
+        renderedValueValid_m = true;
     }
+    return renderedValue_m;
+}
+
+void Object::importXml(ticpp::Element* pConfig)
+{
+    std::string type = pConfig->GetAttribute("type");
+    // sometimes, different type strings refer to the same type
+    if (type != getType() && getCanonicalType(type) != getType())
+        throw ticpp::Exception("Changing type of existing object is not allowed");
     std::string id = pConfig->GetAttribute("id");
     if (id == "")
         throw ticpp::Exception("Missing or empty object ID");
@@ -329,6 +391,22 @@ void Object::importXml(ticpp::Element* pConfig)
 
     writeLog_m = (pConfig->GetAttribute("log") == "true");
 
+    std::string priority = pConfig->GetAttribute("priority");
+    if (priority == "" || priority == "normal")
+        priority_m = KnxConnection::Normal;
+    else if (priority == "low")
+        priority_m = KnxConnection::Low;
+    else if (priority == "high")
+        priority_m = KnxConnection::High;
+    else if (priority == "alarm")
+        priority_m = KnxConnection::Alarm;
+    else
+    {
+        std::stringstream msg;
+        msg << "Invalid priority '" << priority << "' for object '" << id << "'" << std::endl;
+        throw ticpp::Exception(msg.str());
+    }
+
     std::string precision = pConfig->GetAttribute("precision");
     if (!precision.empty())
         getObjectValue()->setPrecision(precision);
@@ -363,6 +441,9 @@ void Object::importXml(ticpp::Element* pConfig)
         set(objval); // Here, we use set() instead of setValue() to avoid call to onInternalUpdate()
         delete objval;
     }
+    // Value or precision may have changed
+    renderedValueValid_m = false;
+    changeCount_m++;
 
     logger_m.infoStream() << "Configured object '" << id_m << "': gad=" << WriteGroupAddr(gad_m) << endlog;
 }
@@ -380,6 +461,13 @@ void Object::exportXml(ticpp::Element* pConfig)
 
     if (writeLog_m)
         pConfig->SetAttribute("log", "true");
+
+    if (priority_m == KnxConnection::Low)
+        pConfig->SetAttribute("priority", "low");
+    else if (priority_m == KnxConnection::High)
+        pConfig->SetAttribute("priority", "high");
+    else if (priority_m == KnxConnection::Alarm)
+        pConfig->SetAttribute("priority", "alarm");
         
     std::string precision = getObjectValue()->getPrecision();
     if (!precision.empty())
@@ -422,39 +510,33 @@ void Object::exportXml(ticpp::Element* pConfig)
 
 void Object::read()
 {
-    KnxConnection* con = Services::instance()->getKnxConnection();
+    KnxConnection* con = Services::instance()->getKnxConnection(getReadRequestGad());
 	if (con->isVoid())
 	{
 		init_m = true;
 		return;
 	}
 
-    if (!readPending_m)
-    {
-        uint8_t buf[2] = { 0, 0 };
-        con->write(getReadRequestGad(), buf, 2);
-    }
-    readPending_m = true;
-
-    pth_event_t tmout = pth_event (PTH_EVENT_TIME, pth_timeout(1,0));
-    int cnt = 0;
-    while (cnt < 100 && readPending_m)
-    {
-        if (con->isRunning())
-        {
-            if (con->checkInput(tmout) == -1)
-                cnt = 100;
-        }
-        else
-            pth_usleep(10000);
-        ++cnt;
-    }
-    pth_event_free (tmout, PTH_FREE_THIS);
+    con->requestRead(getReadRequestGad());
+    con->awaitRead(getReadRequestGad());
     // If the device didn't answer after 1 second, we consider the object's
     // default value as the current value to avoid waiting forever.
     init_m = true;
 }
 
+void Object::requestRead(ReadRequestListener* listener)
+{
+    KnxConnection* con = Services::instance()->getKnxConnection(getReadRequestGad());
+    if (con->isVoid())
+    {
+        init_m = true;
+        if (listener)
+            listener->onReadCompleted(getReadRequestGad(), false);
+        return;
+    }
+    con->requestRead(getReadRequestGad(), listener);
+}
+
 void Object::onInternalUpdate()
 {
     if ((flags_m & Transmit) && (flags_m & Comm))
@@ -465,6 +547,8 @@ void Object::onInternalUpdate()
 void Object::onUpdate()
 {
     init_m = true;
+    renderedValueValid_m = false;
+    changeCount_m++;
     logger_m.infoStream() << "New value " << getValue() << " for object " << getID() << " (type: " << getType() << ")" << endlog;
     
     ListenerList_t::iterator it;
@@ -505,7 +589,6 @@ void Object::onResponse(const uint8_t* buf, int len, eibaddr_t src)
 {
     if ((flags_m & Update) && (flags_m & Comm))
     {
-        readPending_m = false;
         lastTx_m = src;
         doWrite(buf, len, src);
     }
@@ -563,7 +646,7 @@ std::string Object::WriteAddr(eibaddr_t addr)
 
 KnxConnection* Object::getKnxConnection()
 {
-    return Services::instance()->getKnxConnection();
+    return Services::instance()->getKnxConnection(gad_m);
 }
 
 Logger& ObjectValue::logger_m(Logger::getInstance("ObjectValue"));
@@ -665,8 +748,8 @@ void SwitchingObject::doWrite(const uint8_t* buf, int len, eibaddr_t src)
 
 void SwitchingObject::doSend(bool isWrite)
 {
-    uint8_t buf[2] = { 0, (uint8_t)((isWrite ? 0x80 : 0x40) | (getBoolObjectValue() ? 1 : 0)) };
-    Services::instance()->getKnxConnection()->write(getGad(), buf, 2);
+    TelegramFrame frame(isWrite, getBoolObjectValue() ? 1 : 0);
+    getKnxConnection()->write(getGad(), frame, getPriority());
 }
 
 void SwitchingControlObjectValue::init(const std::string& value)
@@ -873,8 +956,8 @@ void StepDirObject::doWrite(const uint8_t* buf, int len, eibaddr_t src)
 
 void StepDirObject::doSend(bool isWrite)
 {
-    uint8_t buf[2] = { 0, (uint8_t)((isWrite ? 0x80 : 0x40) | (getDirection() ? 8 : 0) | (getStepCode() & 0x07)) };
-    Services::instance()->getKnxConnection()->write(getGad(), buf, 2);
+    TelegramFrame frame(isWrite, (getDirection() ? 8 : 0) | (getStepCode() & 0x07));
+    getKnxConnection()->write(getGad(), frame, getPriority());
 }
 
 DimmingObjectValue::DimmingObjectValue(const std::string& value)
@@ -1240,8 +1323,9 @@ void TimeObject::setTime(time_t time)
 
 void TimeObject::doSend(bool isWrite)
 {
-    uint8_t buf[5] = { 0, (uint8_t)(isWrite ? 0x80 : 0x40), (uint8_t)(((wday_m<<5) & 0xE0) | (hour_m & 0x1F)), (uint8_t)min_m, (uint8_t)sec_m };
-    Services::instance()->getKnxConnection()->write(getGad(), buf, 5);
+    TelegramFrame frame(isWrite);
+    frame << (((wday_m<<5) & 0xE0) | (hour_m & 0x1F)) << min_m << sec_m;
+    getKnxConnection()->write(getGad(), frame, getPriority());
 }
 
 void TimeObject::setTime(int wday, int hour, int min, int sec)
@@ -1453,11 +1537,11 @@ void DateObject::setDate(time_t time)
 
 void DateObject::doSend(bool isWrite)
 {
-	BufferBuilder builder(5, DateObject::logger_m);
-	builder << 0 << (isWrite ? 0x80 : 0x40) << day_m << month_m;
-	builder << ((year_m >= 100 && year_m < 190) ? year_m-100 : year_m);
+    TelegramFrame frame(isWrite);
+    frame << day_m << month_m;
+    frame << ((year_m >= 100 && year_m < 190) ? year_m-100 : year_m);
 
-    Services::instance()->getKnxConnection()->write(getGad(), builder.getBuffer(), 5);
+    getKnxConnection()->write(getGad(), frame, getPriority());
 }
 
 void DateObject::setDate(int day, int month, int year)
@@ -1663,8 +1747,7 @@ void ValueObject::doWrite(const uint8_t* buf, int len, eibaddr_t src)
 
 void ValueObject::doSend(bool isWrite)
 {
-	BufferBuilder builder(4, ValueObject::logger_m);
-	builder << 0 << (isWrite ? 0x80 : 0x40) << 0 << 0;
+    TelegramFrame frame(isWrite);
     int ex = 0;
     int m = (int)rint(getFloatValue() * 100);
     if (m < 0)
@@ -1676,7 +1759,7 @@ void ValueObject::doSend(bool isWrite)
             ex++;
         }
         m = -m;
-		builder.setValue(2, ((m >> 8) & 0x07) | ((ex << 3) & 0x78) | (1 << 7));
+        frame << (((m >> 8) & 0x07) | ((ex << 3) & 0x78) | (1 << 7));
     }
     else
     {
@@ -1685,11 +1768,11 @@ void ValueObject::doSend(bool isWrite)
             m = m >> 1;
             ex++;
         }
-        builder.setValue(2, ((m >> 8) & 0x07) | ((ex << 3) & 0x78));
+        frame << (((m >> 8) & 0x07) | ((ex << 3) & 0x78));
     }
-    builder.setValue(3, m & 0xff);
+    frame << (m & 0xff);
 
-    Services::instance()->getKnxConnection()->write(getGad(), builder.getBuffer(), 4);
+    getKnxConnection()->write(getGad(), frame, getPriority());
 }
 /*
 void ValueObjectImpl::setFloatValue(double value)
@@ -1754,20 +1837,17 @@ void ValueObject32::doWrite(const uint8_t* buf, int len, eibaddr_t src)
 
 void ValueObject32::doSend(bool isWrite)
 {
-	BufferBuilder builder(6, ValueObject32::logger_m);
-	builder << 0 << (isWrite ? 0x80 : 0x40) << 0 << 0 << 0 << 0;
     convfloat tmp;
     tmp.fl = static_cast<float>(value_m);
-    builder.setValue(5, (tmp.u32 & 0x000000FF));
-    builder.setValue(4, ((tmp.u32 & 0x0000FF00) >> 8));
-    builder.setValue(3, ((tmp.u32 & 0x00FF0000) >> 16));
-    builder.setValue(2, ((tmp.u32 & 0xFF000000) >> 24));
+    TelegramFrame frame(isWrite);
+    frame.append(tmp.u32, 4);
 
-    Services::instance()->getKnxConnection()->write(getGad(), builder.getBuffer(), 6);
+    getKnxConnection()->write(getGad(), frame, getPriority());
 }
 
 UIntObjectValue::UIntObjectValue(const std::string& value)
 {
+    valueRef_m = ValueRef(&value_m);
     std::istringstream val(value);
     val >> value_m;
 
@@ -1883,9 +1963,9 @@ void U8ImplObject::doWrite(const uint8_t* buf, int len, eibaddr_t src)
 
 void U8ImplObject::doSend(bool isWrite)
 {
-	BufferBuilder builder(3, U8ImplObject::logger_m);
-	builder << 0 << (isWrite ? 0x80 : 0x40) << (getInt() & 0xff);
-    Services::instance()->getKnxConnection()->write(getGad(), builder.getBuffer(), 3);
+    TelegramFrame frame(isWrite);
+    frame << (getInt() & 0xff);
+    getKnxConnection()->write(getGad(), frame, getPriority());
 }
 
 U8ObjectValue::U8ObjectValue(const std::string& value)
@@ -2216,9 +2296,9 @@ void U16Object::doWrite(const uint8_t* buf, int len, eibaddr_t src)
 
 void U16Object::doSend(bool isWrite)
 {
-	BufferBuilder builder(4, U16Object::logger_m);
-	builder << 0 << (isWrite ? 0x80 : 0x40) << ((value_m & 0xff00)>>8) << (value_m & 0xff);
-    Services::instance()->getKnxConnection()->write(getGad(), builder.getBuffer(), 4);
+    TelegramFrame frame(isWrite);
+    frame.append(value_m, 2);
+    getKnxConnection()->write(getGad(), frame, getPriority());
 }
 
 U32ObjectValue::U32ObjectValue(const std::string& value)
@@ -2274,9 +2354,9 @@ void U32Object::doWrite(const uint8_t* buf, int len, eibaddr_t src)
 
 void U32Object::doSend(bool isWrite)
 {
-	BufferBuilder builder(6, U32Object::logger_m);
-    builder << 0 << (isWrite ? 0x80 : 0x40) << ((value_m & 0xff000000)>>24) << ((value_m & 0xff0000)>>16) << ((value_m & 0xff00)>>8) << (value_m & 0xff);
-    Services::instance()->getKnxConnection()->write(getGad(), builder.getBuffer(), 6);
+    TelegramFrame frame(isWrite);
+    frame.append(value_m, 4);
+    getKnxConnection()->write(getGad(), frame, getPriority());
 }
 
 RGBObjectValue::RGBObjectValue(const std::string& value)
@@ -2335,9 +2415,9 @@ void RGBObject::doWrite(const uint8_t* buf, int len, eibaddr_t src)
 
 void RGBObject::doSend(bool isWrite)
 {
-	BufferBuilder builder(5, RGBObject::logger_m);
-    builder << 0 << (isWrite ? 0x80 : 0x40) << ((value_m & 0xff0000)>>16) << ((value_m & 0xff00)>>8) << (value_m & 0xff);
-    Services::instance()->getKnxConnection()->write(getGad(), builder.getBuffer(), 5);
+    TelegramFrame frame(isWrite);
+    frame.append(value_m, 3);
+    getKnxConnection()->write(getGad(), frame, getPriority());
 }
 
 #ifdef STL_STREAM_SUPPORT_INT64
@@ -2397,19 +2477,15 @@ void RGBWObject::doWrite(const uint8_t* buf, int len, eibaddr_t src)
 
 void RGBWObject::doSend(bool isWrite)
 {
-	BufferBuilder builder(8, RGBWObject::logger_m);
-    builder << 0 << (isWrite ? 0x80 : 0x40)
-    << ((RGBWObjectValue::value_m & 0xff000000)>>24)
-    << ((RGBWObjectValue::value_m & 0xff0000)>>16)
-    << ((RGBWObjectValue::value_m & 0xff00)>>8)
-    << (RGBWObjectValue::value_m & 0xff)
-    << 0x00 << 0x0f;
-    Services::instance()->getKnxConnection()->write(getGad(), builder.getBuffer(), 8);
+    TelegramFrame frame(isWrite);
+    frame.append(RGBWObjectValue::value_m, 4) << 0x00 << 0x0f;
+    getKnxConnection()->write(getGad(), frame, getPriority());
 }
 #endif
 
 IntObjectValue::IntObjectValue(const std::string& value)
 {
+    valueRef_m = ValueRef(&value_m);
     std::istringstream val(value);
     val >> value_m;
 
@@ -2564,9 +2640,9 @@ void S8Object::doWrite(const uint8_t* buf, int len, eibaddr_t src)
 
 void S8Object::doSend(bool isWrite)
 {
-	BufferBuilder builder(3, S8Object::logger_m);
-    builder << 0 << (isWrite ? 0x80 : 0x40) << (value_m & 0xff);
-    Services::instance()->getKnxConnection()->write(getGad(), builder.getBuffer(), 3);
+    TelegramFrame frame(isWrite);
+    frame.append(value_m, 1);
+    getKnxConnection()->write(getGad(), frame, getPriority());
 }
 
 S16ObjectValue::S16ObjectValue(const std::string& value)
@@ -2626,9 +2702,9 @@ void S16Object::doWrite(const uint8_t* buf, int len, eibaddr_t src)
 
 void S16Object::doSend(bool isWrite)
 {
-	BufferBuilder builder(4, S16Object::logger_m);
-    builder << 0 << (isWrite ? 0x80 : 0x40) << ((value_m & 0xff00)>>8) << (value_m & 0xff);
-    Services::instance()->getKnxConnection()->write(getGad(), builder.getBuffer(), 4);
+    TelegramFrame frame(isWrite);
+    frame.append(value_m, 2);
+    getKnxConnection()->write(getGad(), frame, getPriority());
 }
 
 S32ObjectValue::S32ObjectValue(const std::string& value)
@@ -2684,14 +2760,15 @@ void S32Object::doWrite(const uint8_t* buf, int len, eibaddr_t src)
 
 void S32Object::doSend(bool isWrite)
 {
-	BufferBuilder builder(6, S32Object::logger_m);
-    builder << 0 << (isWrite ? 0x80 : 0x40) << ((value_m & 0xff000000)>>24) << ((value_m & 0xff0000)>>16) << ((value_m & 0xff00)>>8) << (value_m & 0xff);
-    Services::instance()->getKnxConnection()->write(getGad(), builder.getBuffer(), 6);
+    TelegramFrame frame(isWrite);
+    frame.append(value_m, 4);
+    getKnxConnection()->write(getGad(), frame, getPriority());
 }
 
 #ifdef STL_STREAM_SUPPORT_INT64
 S64ObjectValue::S64ObjectValue(const std::string& value)
 {
+    valueRef_m = ValueRef(&value_m);
     std::istringstream val(value);
     val >> value_m;
 
@@ -2811,15 +2888,15 @@ void S64Object::doWrite(const uint8_t* buf, int len, eibaddr_t src)
 
 void S64Object::doSend(bool isWrite)
 {
-	BufferBuilder builder(10, S64Object::logger_m);
-    builder << 0 << (isWrite ? 0x80 : 0x40) << ((value_m & 0xff00000000000000LL)>>56) << ((value_m & 0xff000000000000LL)>>48) << ((value_m & 0xff0000000000LL)>>40) << ((value_m & 0xff00000000LL)>>32)
-                                                    << ((value_m & 0xff000000LL)>>24) << ((value_m & 0xff0000LL)>>16) << ((value_m & 0xff00LL)>>8) << (value_m & 0xffLL);
-    Services::instance()->getKnxConnection()->write(getGad(), builder.getBuffer(), 10);
+    TelegramFrame frame(isWrite);
+    frame.append(value_m, 8);
+    getKnxConnection()->write(getGad(), frame, getPriority());
 }
 #endif
 
 StringObjectValue::StringObjectValue(const std::string& value)
 {
+    valueRef_m = ValueRef(&value_m);
     value_m = value;
 //    logger_m.debugStream() << "StringObjectValue: Value: '" << value_m << "'" << endlog;
 }
@@ -2981,16 +3058,13 @@ void StringObject::doWrite(const uint8_t* buf, int len, eibaddr_t src)
 void StringObject::doSend(bool isWrite)
 {
     logger_m.debugStream() << "StringObject: Value: " << value_m << endlog;
-    uint bufsz = value_m.size()+3;
-    uint8_t *buf = new uint8_t[bufsz];
-    memset(buf,0,bufsz);
-    buf[1] = (isWrite ? 0x80 : 0x40);
-    // Convert to hex
-    for(uint j=2;j<bufsz;j++)
-        buf[j] = static_cast<uint8_t>(value_m[j-2]);
+    TelegramFrame frame(isWrite);
+    for(uint j=0;j<value_m.size();j++)
+        frame << static_cast<uint8_t>(value_m[j]);
+    // Null terminated
+    frame << 0;
 
-    Services::instance()->getKnxConnection()->write(getGad(), buf, bufsz);
-    delete buf;
+    getKnxConnection()->write(getGad(), frame, getPriority());
 }
 
 void StringObject::setStringValue(const std::string& value)
@@ -3070,15 +3144,13 @@ void String14Object::doWrite(const uint8_t* buf, int len, eibaddr_t src)
 void String14Object::doSend(bool isWrite)
 {
     logger_m.debugStream() << "String14Object: Value: " << value_m << endlog;
-    uint8_t buf[16];
-    memset(buf,0,sizeof(buf));
-    buf[1] = (isWrite ? 0x80 : 0x40);
-    // Convert to hex
+    TelegramFrame frame(isWrite);
 	std::string latin1Value = transcode(value_m, getUTF8Encoding(), getLatin1Encoding());
-    for(uint j=0;j<latin1Value.size();j++)
-        buf[j+2] = static_cast<uint8_t>(latin1Value[j]);
+    for(uint j=0;j<latin1Value.size() && j<14;j++)
+        frame << static_cast<uint8_t>(latin1Value[j]);
+    frame.pad(16);
 
-    Services::instance()->getKnxConnection()->write(getGad(), buf, sizeof(buf));
+    getKnxConnection()->write(getGad(), frame, getPriority());
 }
 
 void String14Object::setStringValue(const std::string& value)
@@ -3125,14 +3197,12 @@ void String14AsciiObject::doWrite(const uint8_t* buf, int len, eibaddr_t src)
 void String14AsciiObject::doSend(bool isWrite)
 {
     logger_m.debugStream() << "String14AsciiObject: Value: " << value_m << endlog;
-    uint8_t buf[16];
-    memset(buf,0,sizeof(buf));
-    buf[1] = (isWrite ? 0x80 : 0x40);
-    // Convert to hex
-    for(uint j=0;j<value_m.size();j++)
-        buf[j+2] = static_cast<uint8_t>(value_m[j]);
+    TelegramFrame frame(isWrite);
+    for(uint j=0;j<value_m.size() && j<14;j++)
+        frame << static_cast<uint8_t>(value_m[j]);
+    frame.pad(16);
 
-    Services::instance()->getKnxConnection()->write(getGad(), buf, sizeof(buf));
+    getKnxConnection()->write(getGad(), frame, getPriority());
 }
 
 void String14AsciiObject::setStringValue(const std::string& value)
@@ -3143,14 +3213,19 @@ void String14AsciiObject::setStringValue(const std::string& value)
 
 Logger& ObjectController::logger_m(Logger::getInstance("ObjectController"));
 
-ObjectController::ObjectController()
-{}
+ObjectController::ObjectController() : prefetchPending_m(0)
+{
+    for (int i = 0; i < 256; i++)
+        addressTable_m[i] = 0;
+}
 
 ObjectController::~ObjectController()
 {
     ObjectIdMap_t::iterator it;
     for (it = objectIdMap_m.begin(); it != objectIdMap_m.end(); it++)
         delete (*it).second;
+    for (int i = 0; i < 256; i++)
+        delete[] addressTable_m[i];
 }
 
 ObjectController* ObjectController::instance()
@@ -3160,43 +3235,61 @@ ObjectController* ObjectController::instance()
     return instance_m;
 }
 
+// The dispatch loops below index the list instead of using iterators since
+// an object callback may cause objects to be added to the same group address.
 void ObjectController::onWrite(eibaddr_t src, eibaddr_t dest, const uint8_t* buf, int len)
 {
-    std::pair<ObjectMap_t::iterator, ObjectMap_t::iterator> range;
-    range = objectMap_m.equal_range(dest);
-    ObjectMap_t::iterator it;
-    for (it = range.first; it != range.second; it++)
-        (*it).second->onWrite(buf, len, src);
-    if (range.first == range.second)
+    ObjectList_t* objects = findObjects(dest);
+    if (objects == 0)
+    {
         logger_m.debugStream() << "onWrite - dest eibaddr not found: "
             << Object::WriteGroupAddr(dest)
             << " sender=" << Object::WriteAddr( src ) << endlog;
+        return;
+    }
+    for (unsigned int i = 0; i < objects->size(); i++)
+        (*objects)[i]->onWrite(buf, len, src);
 }
 
 void ObjectController::onRead(eibaddr_t src, eibaddr_t dest, const uint8_t* buf, int len)
 {
-    std::pair<ObjectMap_t::iterator, ObjectMap_t::iterator> range;
-    range = objectMap_m.equal_range(dest);
-    ObjectMap_t::iterator it;
-    for (it = range.first; it != range.second; it++)
-        (*it).second->onRead(buf, len, src);
-    if (range.first == range.second)
+    ObjectList_t* objects = findObjects(dest);
+    if (objects == 0)
+    {
         logger_m.debugStream() << "onRead - dest eibaddr not found: "
             << Object::WriteGroupAddr(dest)
             << " sender=" << Object::WriteAddr( src ) << endlog;
+        return;
+    }
+    for (unsigned int i = 0; i < objects->size(); i++)
+        (*objects)[i]->onRead(buf, len, src);
 }
 
 void ObjectController::onResponse(eibaddr_t src, eibaddr_t dest, const uint8_t* buf, int len)
 {
-    std::pair<ObjectMap_t::iterator, ObjectMap_t::iterator> range;
-    range = objectMap_m.equal_range(dest);
-    ObjectMap_t::iterator it;
-    for (it = range.first; it != range.second; it++)
-        (*it).second->onResponse(buf, len, src);
-    if (range.first == range.second)
+    ObjectList_t* objects = findObjects(dest);
+    if (objects == 0)
+    {
         logger_m.debugStream() << "onResponse - dest eibaddr not found: "
             << Object::WriteGroupAddr(dest)
             << " sender=" << Object::WriteAddr( src ) << endlog;
+        return;
+    }
+    for (unsigned int i = 0; i < objects->size(); i++)
+        (*objects)[i]->onResponse(buf, len, src);
+}
+
+bool ObjectController::canCoalesce(eibaddr_t dest)
+{
+    ObjectList_t* objects = findObjects(dest);
+    if (objects == 0)
+        return true;
+    for (unsigned int i = 0; i < objects->size(); i++)
+    {
+        if ((*objects)[i]->isStateless())
+            return false;
+    }
+    return true;
 }
 
 Object* ObjectController::getObject(const std::string& id)
@@ -3216,41 +3309,60 @@ void ObjectController::addObject(Object* object)
 {
     if (!objectIdMap_m.insert(ObjectIdPair_t(object->getID(), object)).second)
         throw ticpp::Exception("Object ID already exists");
-    if (object->getGad())
-        objectMap_m.insert(ObjectPair_t(object->getGad(), object));
-    std::list<eibaddr_t>::iterator it2, it_end;
-    it_end = object->getListenerGadEnd();
-    for (it2=object->getListenerGad(); it2!=it_end; it2++)
-        objectMap_m.insert(ObjectPair_t((*it2), object));
+    mapObjectAddresses(object);
+}
+
+void ObjectController::addObjectToAddressMap(eibaddr_t gad, Object* object)
+{
+    if (gad == 0)
+        return;
+    ObjectList_t*& page = addressTable_m[gad >> 8];
+    if (page == 0)
+        page = new ObjectList_t[256];
+    page[gad & 0xFF].push_back(object);
 }
 
 void ObjectController::removeObjectFromAddressMap(eibaddr_t gad, Object* object)
 {
     if (gad == 0)
         return;
-    std::pair<ObjectMap_t::iterator, ObjectMap_t::iterator> range =
-        objectMap_m.equal_range(gad);
-    ObjectMap_t::iterator it = range.first;
-    while(it != range.second) {
-        if ((*it).second == object)
-            objectMap_m.erase(it++);
+    ObjectList_t* page = addressTable_m[gad >> 8];
+    if (page == 0)
+        return;
+    ObjectList_t& objects = page[gad & 0xFF];
+    ObjectList_t::iterator it = objects.begin();
+    while (it != objects.end()) {
+        if ((*it) == object)
+            it = objects.erase(it);
         else
             ++it;
     }
 }
 
+void ObjectController::mapObjectAddresses(Object* object)
+{
+    addObjectToAddressMap(object->getGad(), object);
+    std::list<eibaddr_t>::iterator it, it_end;
+    it_end = object->getListenerGadEnd();
+    for (it=object->getListenerGad(); it!=it_end; it++)
+        addObjectToAddressMap((*it), object);
+}
+
+void ObjectController::unmapObjectAddresses(Object* object)
+{
+    removeObjectFromAddressMap(object->getGad(), object);
+    std::list<eibaddr_t>::iterator it, it_end;
+    it_end = object->getListenerGadEnd();
+    for (it=object->getListenerGad(); it!=it_end; it++)
+        removeObjectFromAddressMap((*it), object);
+}
+
 void ObjectController::removeObject(Object* object)
 {
     ObjectIdMap_t::iterator it = objectIdMap_m.find(object->getID());
     if (it != objectIdMap_m.end())
     {
-        eibaddr_t gad = it->second->getGad();
-        removeObjectFromAddressMap(gad, object);
-
-        std::list<eibaddr_t>::iterator it2, it_end;
-        it_end = object->getListenerGadEnd();
-        for (it2=object->getListenerGad(); it2!=it_end; it2++)
-            removeObjectFromAddressMap((*it2), object);
+        unmapObjectAddresses(object);
 
         if (it->second->inUse())
             throw ticpp::Exception("Delete failed! Object still in use.");
@@ -3271,11 +3383,7 @@ void ObjectController::importXml(ticpp::Element* pConfig)
         {
             Object* object = it->second;
 
-            removeObjectFromAddressMap(object->getGad(), object);
-            std::list<eibaddr_t>::iterator it2, it_end;
-            it_end = object->getListenerGadEnd();
-            for (it2=object->getListenerGad(); it2!=it_end; it2++)
-                removeObjectFromAddressMap((*it2), object);
+            unmapObjectAddresses(object);
 
             if (del)
             {
@@ -3287,12 +3395,7 @@ void ObjectController::importXml(ticpp::Element* pConfig)
             else
             {
                 object->importXml(&(*child));
-                if (object->getGad())
-                    objectMap_m.insert(ObjectPair_t(object->getGad(), object));
-                std::list<eibaddr_t>::iterator it2, it_end;
-                it_end = object->getListenerGadEnd();
-                for (it2=object->getListenerGad(); it2!=it_end; it2++)
-                    objectMap_m.insert(ObjectPair_t((*it2), object));
+                mapObjectAddresses(object);
                 objectIdMap_m.insert(ObjectIdPair_t(id, object));
             }
         }
@@ -3301,12 +3404,7 @@ void ObjectController::importXml(ticpp::Element* pConfig)
             if (del)
                 throw ticpp::Exception("Object not found");
             Object* object = Object::create(&(*child));
-            if (object->getGad())
-                objectMap_m.insert(ObjectPair_t(object->getGad(), object));
-            std::list<eibaddr_t>::iterator it2, it_end;
-            it_end = object->getListenerGadEnd();
-            for (it2=object->getListenerGad(); it2!=it_end; it2++)
-                objectMap_m.insert(ObjectPair_t((*it2), object));
+            mapObjectAddresses(object);
             objectIdMap_m.insert(ObjectIdPair_t(id, object));
         }
     }
@@ -3324,18 +3422,63 @@ void ObjectController::exportXml(ticpp::Element* pConfig)
     }
 }
 
-void ObjectController::exportObjectValues(ticpp::Element* pObjects)
+void ObjectController::exportObjectValues(XmlWriter& writer, bool wait)
 {
     ObjectIdMap_t::iterator it;
     for (it = objectIdMap_m.begin(); it != objectIdMap_m.end(); it++)
     {
-        ticpp::Element pElem("object");
-        pElem.SetAttribute("id", (*it).second->getID());
-        pElem.SetAttribute("value", (*it).second->getValue());
-        pObjects->LinkEndChild(&pElem);
+        Object* obj = (*it).second;
+        writer.startElement("object").attribute("id", obj->getID()).attribute("value", wait ? obj->getValue() : obj->getValueNoWait()).endElement();
     }
 }
 
+void ObjectController::prefetchObjectValues()
+{
+    // Collect read request addresses. Objects referenced by rules, actions
+    // or clients are requested first, so this must be called once the
+    // rules are loaded.
+    std::map<eibaddr_t, int> requests;
+    ObjectIdMap_t::iterator it;
+    for (it = objectIdMap_m.begin(); it != objectIdMap_m.end(); it++)
+    {
+        Object* object = it->second;
+        if (!object->needsInitRead() || object->getReadRequestGad() == 0)
+            continue;
+        int priority = (object->inUse() || object->hasChangeListeners()) ? 1 : 0;
+        int& current = requests[object->getReadRequestGad()];
+        if (priority > current)
+            current = priority;
+    }
+    if (requests.empty())
+        return;
+
+    logger_m.infoStream() << "Requesting initial value of " << requests.size() << " group addresses" << endlog;
+    prefetchPending_m = requests.size();
+    std::map<eibaddr_t, int>::iterator it2;
+    for (it2 = requests.begin(); it2 != requests.end(); it2++)
+    {
+        // Each line paces its own read requests
+        KnxConnection* con = Services::instance()->getKnxConnection(it2->first);
+        con->queueRead(it2->first, it2->second, this);
+    }
+}
+
+void ObjectController::onReadCompleted(eibaddr_t gad, bool success)
+{
+    // Without response, objects keep their default value like Object::read()
+    ObjectList_t* objects = findObjects(gad);
+    if (objects)
+    {
+        for (unsigned int i = 0; i < objects->size(); i++)
+        {
+            if ((*objects)[i]->getReadRequestGad() == gad)
+                (*objects)[i]->markInitialized();
+        }
+    }
+    if (prefetchPending_m > 0 && --prefetchPending_m == 0)
+        logger_m.infoStream() << "Initial values requested" << endlog;
+}
+
 // Delivers all objects
 std::list<Object*> ObjectController::getObjects()
 {
@@ -3349,13 +3492,3 @@ std::list<Object*> ObjectController::getObjects()
     return objects;
 }
 
-Object::BufferBuilder::BufferBuilder(int size, Logger &logger)
- : buffer_m(NULL), index_m(0), size_m(size), logger_m(logger)
-{
-	buffer_m = new uint8_t[size];
-}
-
-Object::BufferBuilder::~BufferBuilder()
-{
-	delete[] buffer_m;
-}
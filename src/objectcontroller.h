@@ -23,11 +23,13 @@
 #include <list>
 #include <string>
 #include <map>
+#include <vector>
 #include <cfloat>
 #include <stdint.h>
 #include "config.h"
 #include "logger.h"
 #include "ticpp.h"
+#include "xmlwriter.h"
 #include "knxconnection.h"
 
 class Object;
@@ -40,9 +42,67 @@ public:
     virtual const char* getID() { return "?"; };
 };
 
+// Reference to the storage of a simple object value (boolean, integer,
+// floating point or string). Two references of the same kind are compared
+// inline, without virtual calls, casts or string conversions. Values of
+// other types have kind None and are compared with ObjectValue::compare().
+class ValueRef
+{
+public:
+    enum Kind { None, Bool, Int, UInt, Int64, Double, String };
+
+    ValueRef() : kind_m(None) { ptr_m.b = 0; };
+    ValueRef(const bool* value) : kind_m(Bool) { ptr_m.b = value; };
+    ValueRef(const int32_t* value) : kind_m(Int) { ptr_m.i = value; };
+    ValueRef(const uint32_t* value) : kind_m(UInt) { ptr_m.u = value; };
+    ValueRef(const int64_t* value) : kind_m(Int64) { ptr_m.l = value; };
+    ValueRef(const double* value) : kind_m(Double) { ptr_m.d = value; };
+    ValueRef(const std::string* value) : kind_m(String) { ptr_m.s = value; };
+
+    Kind getKind() const { return kind_m; };
+    bool isComparable(const ValueRef& other) const { return kind_m != None && kind_m == other.kind_m; };
+    // Same result as ObjectValue::compare(). Only valid if isComparable()
+    int compare(const ValueRef& other) const
+    {
+        switch (kind_m)
+        {
+        case Bool: return compareValues(*ptr_m.b, *other.ptr_m.b);
+        case Int: return compareValues(*ptr_m.i, *other.ptr_m.i);
+        case UInt: return compareValues(*ptr_m.u, *other.ptr_m.u);
+        case Int64: return compareValues(*ptr_m.l, *other.ptr_m.l);
+        case Double: return compareValues(*ptr_m.d, *other.ptr_m.d);
+        case String: return compareValues(*ptr_m.s, *other.ptr_m.s);
+        default: return 0;
+        }
+    };
+
+private:
+    template <class T> static int compareValues(const T& a, const T& b)
+    {
+        if (a == b)
+            return 0;
+        return (a > b) ? 1 : -1;
+    };
+
+    Kind kind_m;
+    union
+    {
+        const bool* b;
+        const int32_t* i;
+        const uint32_t* u;
+        const int64_t* l;
+        const double* d;
+        const std::string* s;
+    } ptr_m;
+};
+
 class ObjectValue
 {
 public:
+    ObjectValue() {};
+    // The reference is bound to this instance's storage, so it is not copied
+    ObjectValue(const ObjectValue&) {};
+    ObjectValue& operator=(const ObjectValue&) { return *this; };
     virtual ~ObjectValue() {};
     virtual std::string toString() = 0;
     virtual bool equals(ObjectValue* value) = 0;
@@ -51,64 +111,48 @@ public:
     virtual double toNumber() = 0;
     virtual void setPrecision(std::string precision) {};
     virtual std::string getPrecision() { return ""; };
+    const ValueRef& getValueRef() const { return valueRef_m; };
 protected:
+    // Set by value types having a simple representation
+    ValueRef valueRef_m;
     static Logger& logger_m;
 };
 
 class Object
 {
-protected:
-	class BufferBuilder
-	{
-		public:
-			BufferBuilder(int size, Logger &logger);
-			~BufferBuilder();
-
-		public:
-			template <class T> BufferBuilder &operator<<(const T &value)
-			{
-				setValue(index_m, value);
-				++index_m;
-				return *this;
-			}
-
-			uint8_t *getBuffer() {return buffer_m;}
-			template <class T> void setValue(int index, const T &value)
-			{
-				if (index >= size_m)
-				{
-					logger_m.errorStream() << "Buffer size is exceeded." << endlog;
-					return;
-				}
-
-				if ((value & 0xFF) != value)
-				{
-					logger_m.errorStream() << "Value must be one significant byte in length." << endlog;
-				}
-
-				buffer_m[index] = (uint8_t)value;
-			}
-
-		private:
-			uint8_t *buffer_m;
-			int index_m;
-			int size_m;
-			Logger &logger_m;
-	};
-
 public:
     Object();
     virtual ~Object();
 
     static Object* create(ticpp::Element* pConfig);
     static Object* create(const std::string& type);
+    // Returns the type reported by objects created for 'type' (which may be
+    // an alias like "EIS1"), or "" if the type is not supported
+    static std::string getCanonicalType(const std::string& type);
 
     virtual ObjectValue* createObjectValue(const std::string& value) = 0;
     virtual void setValue(ObjectValue* value);
     virtual void setValue(const std::string& value) = 0;
     virtual void setFloatValue(double value);
     virtual ObjectValue* get();
-    virtual std::string getValue() { return get()->toString(); };
+    // Direct reference to the current value, see ValueRef. Unlike get(), it
+    // does not read an uninitialized object from the bus.
+    const ValueRef& getCurrentValueRef()
+    {
+        if (!currentValueResolved_m)
+        {
+            currentValue_m = getObjectValue()->getValueRef();
+            currentValueResolved_m = true;
+        }
+        return currentValue_m;
+    };
+    // Value rendered as string, cached until the next update
+    virtual std::string getValue();
+    // Same as getValue() without waiting for the bus: an object not read
+    // yet is sent a read request and its current value is returned
+    std::string getValueNoWait();
+    // Incremented on every update, lets dependents detect changes cheaply
+    unsigned long getChangeCount() { return changeCount_m; };
     virtual double getFloatValue() { return get()->toNumber(); };
     virtual std::string getType() = 0;
 
@@ -124,10 +168,19 @@ public:
     std::list<eibaddr_t>::iterator getListenerGadEnd() { return listenerGadList_m.end(); };
     //    eibaddr_t getListenerGad(int idx) { return listenerGadList_m[idx]; };
     const eibaddr_t getLastTx() { return lastTx_m; };
+    KnxConnection::Priority getPriority() { return priority_m; };
     void read();
+    // Sends a read request without waiting for the response
+    void requestRead(ReadRequestListener* listener = 0);
+    // True if the initial value still has to be read from the bus (init="request")
+    bool needsInitRead() { return !init_m && initValue_m == "request"; };
+    bool isInitialized() { return init_m; };
+    void markInitialized() { init_m = true; };
+    bool hasChangeListeners() { return !listenerList_m.empty(); };
     virtual void onUpdate();
     void onInternalUpdate();
     bool forceUpdate() { return (!init_m || (flags_m & Stateless)); };
+    bool isStateless() { return (flags_m & Stateless) != 0; };
     void addChangeListener(ChangeListener* listener);
     void removeChangeListener(ChangeListener* listener);
     void onWrite(const uint8_t* buf, int len, eibaddr_t src);
@@ -150,6 +203,7 @@ protected:
     virtual bool set(double value) = 0;
     virtual ObjectValue* getObjectValue() = 0;
     KnxConnection* getKnxConnection();
+    std::string renderValue(ObjectValue* value);
     bool init_m;
     enum Flags
     {
@@ -174,7 +228,12 @@ private:
     eibaddr_t lastTx_m;
     bool persist_m;
     bool writeLog_m;
-    bool readPending_m;
+    KnxConnection::Priority priority_m;
+    ValueRef currentValue_m;
+    bool currentValueResolved_m;
+    std::string renderedValue_m;
+    bool renderedValueValid_m;
+    unsigned long changeCount_m;
     typedef std::list<ChangeListener*> ListenerList_t;
     ListenerList_t listenerList_m;
     typedef std::list<eibaddr_t> ListenerGadList_t;
@@ -234,8 +293,8 @@ protected:
 class SwitchingObjectValue : public ObjectValue
 {
 public:
-    SwitchingObjectValue(const std::string& value) { init(value); };
-    SwitchingObjectValue(bool value) : value_m(value) {};
+    SwitchingObjectValue(const std::string& value) { valueRef_m = ValueRef(&value_m); init(value); };
+    SwitchingObjectValue(bool value) : value_m(value) { valueRef_m = ValueRef(&value_m); };
     virtual ~SwitchingObjectValue() {};
     void init (const std::string& value);
     virtual bool equals(ObjectValue* value);
@@ -245,7 +304,7 @@ public:
     virtual std::string getType() { return "1.001"; };
     virtual std::string getValueString(bool value) { return value ? "on" : "off"; };
 protected:
-    SwitchingObjectValue() : value_m(false) {};
+    SwitchingObjectValue() : value_m(false) { valueRef_m = ValueRef(&value_m); };
     virtual bool set(bool value);
     virtual bool set(ObjectValue* value);
     virtual bool set(double value);
@@ -311,9 +370,8 @@ public:
             onUpdate();
     };
     virtual void doSend(bool isWrite) {
-		BufferBuilder builder(2, Object::logger_m);
-        builder << 0 << ((isWrite ? 0x80 : 0x40) | (TObjectValue::control_m ? 2 : 0) | (TObjectValue::value_m ? 1 : 0));
-        getKnxConnection()->write(getGad(), builder.getBuffer(), 2);
+        TelegramFrame frame(isWrite, (TObjectValue::control_m ? 2 : 0) | (TObjectValue::value_m ? 1 : 0));
+        getKnxConnection()->write(getGad(), frame, getPriority());
     };
     void setBoolValue(bool value) {
         TObjectValue val(value, true);
@@ -569,7 +627,7 @@ protected:
 class ValueObjectValue : public ObjectValue
 {
 public:
-    ValueObjectValue(const std::string& value) { init(value); };
+    ValueObjectValue(const std::string& value) { valueRef_m = ValueRef(&value_m); init(value); };
     virtual ~ValueObjectValue() {};
     void init(const std::string& value);
     virtual bool equals(ObjectValue* value);
@@ -587,8 +645,8 @@ protected:
     double value_m;
     double precision_m;
     friend class ValueObject;
-    ValueObjectValue(double value) : value_m(value), precision_m(0) {};
-    ValueObjectValue() : value_m(0), precision_m(0) {};
+    ValueObjectValue(double value) : value_m(value), precision_m(0) { valueRef_m = ValueRef(&value_m); };
+    ValueObjectValue() : value_m(0), precision_m(0) { valueRef_m = ValueRef(&value_m); };
 };
 
 class ValueObject : public Object
@@ -740,8 +798,8 @@ public:
 protected:
     virtual bool set(ObjectValue* value);
     uint32_t value_m;
-    UIntObjectValue(uint32_t value) : value_m(value) {};
-    UIntObjectValue() : value_m(0) {};
+    UIntObjectValue(uint32_t value) : value_m(value) { valueRef_m = ValueRef(&value_m); };
+    UIntObjectValue() : value_m(0) { valueRef_m = ValueRef(&value_m); };
 };
 
 class UIntObject : public Object
@@ -1058,8 +1116,8 @@ public:
 protected:
     virtual bool set(ObjectValue* value);
     int32_t value_m;
-    IntObjectValue(int32_t value) : value_m(value) {};
-    IntObjectValue() {};
+    IntObjectValue(int32_t value) : value_m(value) { valueRef_m = ValueRef(&value_m); };
+    IntObjectValue() { valueRef_m = ValueRef(&value_m); };
 };
 
 class IntObject : public Object
@@ -1190,8 +1248,8 @@ public:
 protected:
     virtual bool set(ObjectValue* value);
     int64_t value_m;
-    S64ObjectValue(int64_t value) : value_m(value) {};
-    S64ObjectValue() {};
+    S64ObjectValue(int64_t value) : value_m(value) { valueRef_m = ValueRef(&value_m); };
+    S64ObjectValue() { valueRef_m = ValueRef(&value_m); };
 };
 
 class S64Object : public Object, public S64ObjectValue
@@ -1266,7 +1324,7 @@ protected:
     virtual bool set(ObjectValue* value);
     virtual bool set(double value);
     std::string value_m;
-    StringObjectValue() {};
+    StringObjectValue() { valueRef_m = ValueRef(&value_m); };
 };
 
 class StringObject : public Object, public StringObjectValue
@@ -1351,7 +1409,7 @@ protected:
     static Logger& logger_m;
 };
 
-class ObjectController : public TelegramListener
+class ObjectController : public TelegramListener, public ReadRequestListener
 {
 public:
     static ObjectController* instance();
@@ -1369,24 +1427,49 @@ public:
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
 
-    virtual void exportObjectValues(ticpp::Element* pObjects);
+    // If wait is false, objects not read yet are not waited for, see
+    // Object::getValueNoWait()
+    virtual void exportObjectValues(XmlWriter& writer, bool wait = true);
+
+    // Requests the value of all objects with init="request" through the
+    // paced read queue of the KnxConnection, without waiting for the
+    // responses. Reading an object still queued sends its request at once.
+    void prefetchObjectValues();
+    virtual void onReadCompleted(eibaddr_t gad, bool success);
 
     virtual void onWrite(eibaddr_t src, eibaddr_t dest, const uint8_t* buf, int len);
     virtual void onRead(eibaddr_t src, eibaddr_t dest, const uint8_t* buf, int len);
     virtual void onResponse(eibaddr_t src, eibaddr_t dest, const uint8_t* buf, int len);
+    virtual bool canCoalesce(eibaddr_t dest);
     virtual std::list<Object*> getObjects();
 
 private:
     ObjectController();
     virtual ~ObjectController();
 
+    typedef std::vector<Object*> ObjectList_t;
+
+    void addObjectToAddressMap(eibaddr_t gad, Object* object);
     void removeObjectFromAddressMap(eibaddr_t gad, Object* object);
+    void mapObjectAddresses(Object* object);
+    void unmapObjectAddresses(Object* object);
+    // Returns the objects subscribed to a group address, or 0 if none
+    ObjectList_t* findObjects(eibaddr_t gad)
+    {
+        ObjectList_t* page = addressTable_m[gad >> 8];
+        if (page == 0 || page[gad & 0xFF].empty())
+            return 0;
+        return &page[gad & 0xFF];
+    };
 
-    typedef std::pair<eibaddr_t ,Object*> ObjectPair_t;
-    typedef std::multimap<eibaddr_t ,Object*> ObjectMap_t;
+    // Group address index: 256 pages (main/middle group) of 256 entries
+    // (sub group). Pages are allocated on first use, so a lookup is a
+    // pointer check and an array access.
+    ObjectList_t* addressTable_m[256];
+    // Prefetch requests not completed yet
+    int prefetchPending_m;
     typedef std::pair<std::string ,Object*> ObjectIdPair_t;
     typedef std::map<std::string ,Object*> ObjectIdMap_t;
-    ObjectMap_t objectMap_m;
     ObjectIdMap_t objectIdMap_m;
     static ObjectController* instance_m;
     static Logger& logger_m;
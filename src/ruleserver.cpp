@@ -23,8 +23,11 @@
 #include "luacondition.h"
 #include "ioport.h"
 #include <cmath>
+#include <algorithm>
+#include <sys/time.h>
 
 RuleServer* RuleServer::instance_m;
+RuleServer::CycleMap_t RuleServer::cycles_m;
 
 RuleServer::RuleServer()
 {}
@@ -34,6 +37,7 @@ RuleServer::~RuleServer()
     RuleIdMap_t::iterator it;
     for (it = rulesMap_m.begin(); it != rulesMap_m.end(); it++)
         delete (*it).second;
+    ActionExecutor::reset();
 }
 
 RuleServer* RuleServer::instance()
@@ -43,6 +47,77 @@ RuleServer* RuleServer::instance()
     return instance_m;
 }
 
+void RuleServer::beginCycle()
+{
+    cycles_m[pth_self()].depth++;
+}
+
+void RuleServer::endCycle()
+{
+    evaluateDirtyRules(false);
+}
+
+void RuleServer::abortCycle()
+{
+    evaluateDirtyRules(true);
+}
+
+void RuleServer::evaluateDirtyRules(bool catchExceptions)
+{
+    pth_t self = pth_self();
+    CycleMap_t::iterator it = cycles_m.find(self);
+    if (it == cycles_m.end() || --it->second.depth > 0)
+        return;
+    // Rules are popped one at a time, as evaluation may yield to another
+    // thread deleting some of them. The entry is looked up again after
+    // each evaluation, a nested cycle may have ended and removed it.
+    while (it != cycles_m.end() && !it->second.dirtyRules.empty())
+    {
+        Rule* rule = it->second.dirtyRules.front();
+        it->second.dirtyRules.pop_front();
+        if (!catchExceptions)
+            rule->evaluate();
+        else
+        {
+            // Left by an exception: the objects were modified nonetheless,
+            // but nothing may be thrown from here
+            try
+            {
+                rule->evaluate();
+            }
+            catch (ticpp::Exception& ex)
+            {
+                errorStream("RuleServer") << "Rule evaluation failed: " << ex.m_details << endlog;
+            }
+            catch (...)
+            {
+                errorStream("RuleServer") << "Rule evaluation failed" << endlog;
+            }
+        }
+        it = cycles_m.find(self);
+    }
+    if (it != cycles_m.end() && it->second.depth == 0)
+        cycles_m.erase(it);
+}
+
+bool RuleServer::deferEvaluation(Rule* rule)
+{
+    CycleMap_t::iterator it = cycles_m.find(pth_self());
+    if (it == cycles_m.end() || it->second.depth == 0)
+        return false;
+    RuleList_t& dirtyRules = it->second.dirtyRules;
+    if (std::find(dirtyRules.begin(), dirtyRules.end(), rule) == dirtyRules.end())
+        dirtyRules.push_back(rule);
+    return true;
+}
+
+void RuleServer::cancelEvaluation(Rule* rule)
+{
+    CycleMap_t::iterator it;
+    for (it = cycles_m.begin(); it != cycles_m.end(); it++)
+        it->second.dirtyRules.remove(rule);
+}
+
 void RuleServer::importXml(ticpp::Element* pConfig)
 {
     ticpp::Iterator< ticpp::Element > child("rule");
@@ -93,13 +168,19 @@ void RuleServer::statusXml(ticpp::Element* pStatus)
 
 void RuleServer::initialize()
 {
-    // Wait for knxconnection to be ready.
+    // Wait for the main knxconnection to be ready. Additional lines are
+    // not waited for, one of them being unreachable must not hold back
+    // the initialization of every rule.
     KnxConnection *conn = Services::instance()->getKnxConnection();
     while(!conn->isReady())
     {
         pth_sleep(1);
     }
 
+    // Read objects with init="request" in the background. A condition
+    // needing one of them only waits for that object's response.
+    ObjectController::instance()->prefetchObjectValues();
+
     for (RuleIdMap_t::iterator it = rulesMap_m.begin(); it != rulesMap_m.end(); it++)
     {
         Rule *rule = it->second;
@@ -185,13 +266,14 @@ std::string RuleServer::formatDuration(int duration, bool useMilliseconds)
 
 Logger& Rule::logger_m(Logger::getInstance("Rule"));
 
-Rule::Rule() : condition_m(0), prevValue_m(false), flags_m(Active),
+Rule::Rule() : condition_m(0), prevValue_m(false), flags_m(Active | Coalesce),
 	actionsOnTrue_m(ActionList::OnTrue), actionsIfTrue_m(ActionList::IfTrue),
 	actionsOnFalse_m(ActionList::OnFalse), actionsIfFalse_m(ActionList::IfFalse)
 {}
 
 Rule::~Rule()
 {
+	RuleServer::cancelEvaluation(this);
 	delete condition_m;
 }
 
@@ -221,6 +303,7 @@ void Rule::setCondition(Condition* condition)
 {
 	delete condition_m;
 	condition_m = condition;
+	setCompile((flags_m & Compile) != 0);
 }	
 
 void Rule::importXml(ticpp::Element* pConfig)
@@ -232,6 +315,11 @@ void Rule::importXml(ticpp::Element* pConfig)
 
     pConfig->GetAttribute("description", &descr_m, false);
 
+    value = pConfig->GetAttribute("coalesce");
+    setCoalesce(value != "off" && value != "false" && value != "no");
+
+    setCompile(pConfig->GetAttribute("compile") == "true");
+
     std::string init = pConfig->GetAttributeOrDefault("init", "");
     flags_m &= ~(InitEval|InitTrue);
     if (init != "")
@@ -292,6 +380,14 @@ void Rule::updateXml(ticpp::Element* pConfig)
 
     pConfig->GetAttribute("description", &descr_m, false);
 
+    value = pConfig->GetAttribute("coalesce");
+    if (value != "")
+        setCoalesce(value != "off" && value != "false" && value != "no");
+
+    value = pConfig->GetAttribute("compile");
+    if (value != "")
+        setCompile(value == "true");
+
     std::string init = pConfig->GetAttributeOrDefault("init", "");
     if (init != "")
     {
@@ -366,6 +462,10 @@ void Rule::exportXml(ticpp::Element* pConfig)
         pConfig->SetAttribute("active", "no");
     if (descr_m != "")
         pConfig->SetAttribute("description", descr_m);
+    if (!(flags_m & Coalesce))
+        pConfig->SetAttribute("coalesce", "false");
+    if (flags_m & Compile)
+        pConfig->SetAttribute("compile", "true");
     if (flags_m & InitEval)
         pConfig->SetAttribute("init", "eval");
     else if (flags_m & InitTrue)
@@ -411,7 +511,7 @@ void Rule::statusXml(ticpp::Element* pStatus)
 void Rule::initialize()
 {
     if(flags_m & InitEval)
-        prevValue_m = condition_m->evaluate();
+        prevValue_m = evaluateCondition();
     else
         prevValue_m = (flags_m & InitTrue);
 
@@ -426,6 +526,8 @@ void Rule::initialize()
 
 void Rule::onChange(Object* object)
 {
+    if ((flags_m & Coalesce) && RuleServer::deferEvaluation(this))
+        return;
     evaluate();
 }
 
@@ -434,7 +536,7 @@ void Rule::evaluate()
     if (flags_m & Active)
     {
         logger_m.infoStream() << "Evaluate rule " << id_m << endlog;
-        bool curValue = condition_m->evaluate();
+        bool curValue = evaluateCondition();
         logger_m.infoStream() << "Rule " << id_m << " evaluated as " << curValue << ", prev value was " << prevValue_m << endlog;
         if (curValue)
 		{
@@ -459,6 +561,32 @@ void Rule::setActive(bool active)
         flags_m &= (~Active);
 }
 
+bool Rule::evaluateCondition()
+{
+    if (flags_m & Compile)
+        return program_m.evaluate();
+    return condition_m->evaluate();
+}
+
+void Rule::setCompile(bool compile)
+{
+    if (compile)
+        flags_m |= Compile;
+    else
+        flags_m &= (~Compile);
+    program_m.clear();
+    if ((flags_m & Compile) && condition_m)
+        program_m.compile(condition_m);
+}
+
+void Rule::setCoalesce(bool coalesce)
+{
+    if (coalesce)
+        flags_m |= Coalesce;
+    else
+        flags_m &= (~Coalesce);
+}
+
 void Rule::cancel()
 {
     if (flags_m & Active)
@@ -560,6 +688,288 @@ bool Action::usleep(int delay, pth_sem_t * stop)
     return (pth_event_status (stop_ev) == PTH_STATUS_OCCURRED);
 }
 
+Action::~Action()
+{
+    // Too late to wait for Run() here, derived members are already
+    // destroyed. Owners call stop() before deleting the action.
+    cancel();
+}
+
+void Action::execute()
+{
+    ActionExecutor::instance()->execute(this);
+}
+
+void Action::cancel()
+{
+    if (pending_m > 0 || running_m > 0)
+        ActionExecutor::instance()->cancel(this);
+}
+
+void Action::stop()
+{
+    cancel();
+    if (running_m == 0)
+        return;
+    pth_mutex_acquire(&finishedMutex_m, FALSE, NULL);
+    while (running_m > 0)
+        pth_cond_await(&finished_m, &finishedMutex_m, NULL);
+    pth_mutex_release(&finishedMutex_m);
+}
+
+ActionExecutor* ActionExecutor::instance_m;
+
+Logger& ActionExecutor::logger_m(Logger::getInstance("ActionExecutor"));
+
+ActionExecutor::ActionExecutor()
+    : wheelPos_m(0),
+      wheelCount_m(0),
+      wheelThread_m(PTH_PRIO_STD, this, static_cast<THREADENTRY>(&ActionExecutor::WheelRun)),
+      idleWorkers_m(0)
+{
+    pth_sem_init(&wheelChanged_m);
+    pth_sem_init(&queued_m);
+}
+
+ActionExecutor::~ActionExecutor()
+{
+    wheelThread_m.Stop();
+    for (int i = 0; i < WheelSize; i++)
+    {
+        WheelSlot_t::iterator it;
+        for (it = wheel_m[i].begin(); it != wheel_m[i].end(); ++it)
+            it->action->pending_m--;
+        wheel_m[i].clear();
+    }
+    RunQueue_t::iterator it;
+    for (it = runQueue_m.begin(); it != runQueue_m.end(); ++it)
+        (*it)->pending_m--;
+    runQueue_m.clear();
+    // Rules are deleted first, so workers are normally idle by now
+    while (!workers_m.empty())
+    {
+        delete workers_m.front();
+        workers_m.pop_front();
+    }
+    std::set<Action*>::iterator it2;
+    for (it2 = disposed_m.begin(); it2 != disposed_m.end(); ++it2)
+        delete (*it2);
+    disposed_m.clear();
+}
+
+ActionExecutor* ActionExecutor::instance()
+{
+    if (instance_m == 0)
+        instance_m = new ActionExecutor();
+    return instance_m;
+}
+
+void ActionExecutor::execute(Action* action)
+{
+    action->pending_m++;
+    if (action->delay_m > 0)
+        schedule(action, action->delay_m);
+    else
+        enqueue(action);
+}
+
+void ActionExecutor::cancel(Action* action)
+{
+    for (int i = 0; i < WheelSize; i++)
+    {
+        WheelSlot_t::iterator it = wheel_m[i].begin();
+        while (it != wheel_m[i].end())
+        {
+            if (it->action == action)
+            {
+                it = wheel_m[i].erase(it);
+                wheelCount_m--;
+                action->pending_m--;
+            }
+            else
+                ++it;
+        }
+    }
+    // queued_m is not decremented, workers just find the queue empty
+    RunQueue_t::iterator it = runQueue_m.begin();
+    while (it != runQueue_m.end())
+    {
+        if (*it == action)
+        {
+            it = runQueue_m.erase(it);
+            action->pending_m--;
+        }
+        else
+            ++it;
+    }
+    std::list<pth_sem_t*>::iterator it2;
+    for (it2 = action->stops_m.begin(); it2 != action->stops_m.end(); ++it2)
+        pth_sem_inc(*it2, FALSE);
+}
+
+void ActionExecutor::dispose(Action* action)
+{
+    cancel(action);
+    if (action->running_m == 0)
+        delete action;
+    else
+        disposed_m.insert(action);
+}
+
+void ActionExecutor::enqueue(Action* action)
+{
+    runQueue_m.push_back(action);
+    pth_sem_inc(&queued_m, FALSE);
+    if (idleWorkers_m == 0)
+        spawnWorker();
+}
+
+void ActionExecutor::spawnWorker()
+{
+    // Reclaim workers that exited because too many were idle
+    WorkerList_t::iterator it = workers_m.begin();
+    while (it != workers_m.end())
+    {
+        if ((*it)->isFinished())
+        {
+            delete (*it);
+            it = workers_m.erase(it);
+        }
+        else
+            ++it;
+    }
+    Thread* worker = new Thread(PTH_PRIO_STD, this, static_cast<THREADENTRY>(&ActionExecutor::WorkerRun));
+    workers_m.push_back(worker);
+    idleWorkers_m++;
+    worker->Start();
+    logger_m.debugStream() << "Started worker, " << workers_m.size() << " in pool" << endlog;
+}
+
+void ActionExecutor::schedule(Action* action, int delay)
+{
+    struct timeval now;
+    gettimeofday(&now, 0);
+    if (wheelCount_m == 0)
+    {
+        nextTick_m = now;
+        addMilliseconds(nextTick_m, TickLength);
+        wheelThread_m.Start();
+        pth_sem_inc(&wheelChanged_m, FALSE);
+    }
+    // Whole ticks needed after the next one, so that the delay is never
+    // shorter than requested
+    long remaining = delay * 1000L - ((nextTick_m.tv_sec - now.tv_sec) * 1000000L + (nextTick_m.tv_usec - now.tv_usec));
+    int ticks = 1;
+    if (remaining > 0)
+        ticks += (remaining + TickLength * 1000L - 1) / (TickLength * 1000L);
+    DelayedAction delayed;
+    delayed.action = action;
+    delayed.rounds = (ticks - 1) / WheelSize;
+    wheel_m[(wheelPos_m + ticks) % WheelSize].push_back(delayed);
+    wheelCount_m++;
+}
+
+void ActionExecutor::advanceWheel()
+{
+    wheelPos_m = (wheelPos_m + 1) % WheelSize;
+    addMilliseconds(nextTick_m, TickLength);
+    WheelSlot_t& slot = wheel_m[wheelPos_m];
+    WheelSlot_t::iterator it = slot.begin();
+    while (it != slot.end())
+    {
+        if (it->rounds > 0)
+        {
+            it->rounds--;
+            ++it;
+        }
+        else
+        {
+            Action* action = it->action;
+            it = slot.erase(it);
+            wheelCount_m--;
+            enqueue(action);
+        }
+    }
+}
+
+void ActionExecutor::WheelRun(pth_sem_t * stop1)
+{
+    pth_event_t stop = pth_event (PTH_EVENT_SEM, stop1);
+    pth_event_t changed = pth_event (PTH_EVENT_SEM|PTH_UNTIL_DECREMENT, &wheelChanged_m);
+    pth_event_concat (stop, changed, NULL);
+    while (pth_event_status (stop) != PTH_STATUS_OCCURRED)
+    {
+        if (wheelCount_m == 0)
+        {
+            pth_wait (stop);
+            continue;
+        }
+        struct timeval now;
+        gettimeofday(&now, 0);
+        if (isBefore(now, nextTick_m))
+        {
+            pth_event_t tmout = pth_event (PTH_EVENT_TIME, nextTick_m);
+            pth_event_concat (stop, tmout, NULL);
+            pth_wait (stop);
+            pth_event_isolate (tmout);
+            pth_event_free (tmout, PTH_FREE_THIS);
+            continue;
+        }
+        advanceWheel();
+    }
+    pth_event_isolate (changed);
+    pth_event_free (changed, PTH_FREE_THIS);
+    pth_event_free (stop, PTH_FREE_THIS);
+}
+
+void ActionExecutor::WorkerRun(pth_sem_t * stop1)
+{
+    pth_event_t stop = pth_event (PTH_EVENT_SEM, stop1);
+    pth_event_t queued = pth_event (PTH_EVENT_SEM|PTH_UNTIL_DECREMENT, &queued_m);
+    pth_event_concat (stop, queued, NULL);
+    bool idle = true;
+    while (true)
+    {
+        pth_wait (stop);
+        if (pth_event_status (stop) == PTH_STATUS_OCCURRED)
+            break;
+        if (runQueue_m.empty())
+            continue;
+        Action* action = runQueue_m.front();
+        runQueue_m.pop_front();
+        idleWorkers_m--;
+        idle = false;
+        // Keep someone available for the next actions in case this one blocks
+        if (!runQueue_m.empty() && idleWorkers_m == 0)
+            spawnWorker();
+        action->pending_m--;
+        action->running_m++;
+        // Each run has its own stop semaphore, like each had its own
+        // thread before, so a cancel never reaches runs triggered later
+        pth_sem_t runStop;
+        pth_sem_init(&runStop);
+        action->stops_m.push_back(&runStop);
+        action->Run(&runStop);
+        action->stops_m.remove(&runStop);
+        action->running_m--;
+        if (action->running_m == 0)
+        {
+            pth_cond_notify(&action->finished_m, TRUE);
+            if (disposed_m.erase(action) > 0)
+                delete action;
+        }
+        if (idleWorkers_m >= MaxIdleWorkers)
+            break;
+        idleWorkers_m++;
+        idle = true;
+    }
+    if (idle)
+        idleWorkers_m--;
+    pth_event_isolate (queued);
+    pth_event_free (queued, PTH_FREE_THIS);
+    pth_event_free (stop, PTH_FREE_THIS);
+}
+
 bool Action::parseVarString(std::string &str, bool checkOnly)
 {
     bool modified = false;
@@ -639,8 +1049,6 @@ void DimUpAction::exportXml(ticpp::Element* pConfig)
 
 void DimUpAction::Run (pth_sem_t * stop)
 {
-    if (sleep(delay_m, stop))
-        return;
     if (stop_m > start_m)
     {
         logger_m.infoStream() << "Execute DimUpAction" << endlog;
@@ -721,8 +1129,6 @@ void SetValueAction::exportXml(ticpp::Element* pConfig)
 
 void SetValueAction::Run (pth_sem_t * stop)
 {
-    if (sleep(delay_m, stop))
-        return;
     if (object_m)
     {
         logger_m.infoStream() << "Execute SetValueAction: set " << object_m->getID() << " with value " << value_m->toString() << endlog;
@@ -770,8 +1176,6 @@ void CopyValueAction::Run (pth_sem_t * stop)
 {
     if (from_m && to_m)
     {
-        if (sleep(delay_m, stop))
-            return;
         try
         {
             std::string value = from_m->getValue();
@@ -823,8 +1227,6 @@ void ToggleValueAction::exportXml(ticpp::Element* pConfig)
 
 void ToggleValueAction::Run (pth_sem_t * stop)
 {
-    if (sleep(delay_m, stop))
-        return;
     if (object_m)
     {
         logger_m.infoStream() << "Execute ToggleValueAction on object " << object_m->getID() << endlog;
@@ -901,8 +1303,6 @@ void FormulaAction::exportXml(ticpp::Element* pConfig)
 
 void FormulaAction::Run (pth_sem_t * stop)
 {
-    if (sleep(delay_m, stop))
-        return;
     if (object_m)
     {
         logger_m.infoStream() << "Execute FormulaAction: set " << object_m->getID() << endlog;
@@ -950,8 +1350,6 @@ void SetStringAction::exportXml(ticpp::Element* pConfig)
 
 void SetStringAction::Run (pth_sem_t * stop)
 {
-    if (sleep(delay_m, stop))
-        return;
     std::string value = value_m;
     parseVarString(value);
     if (object_m)
@@ -991,12 +1389,10 @@ void SendReadRequestAction::exportXml(ticpp::Element* pConfig)
 
 void SendReadRequestAction::Run (pth_sem_t * stop)
 {
-    if (sleep(delay_m, stop))
-        return;
     if (object_m)
     {
         logger_m.infoStream() << "Execute SendReadRequestAction for object " << object_m->getID() << endlog;
-        object_m->read();
+        object_m->requestRead();
     }
 }
 
@@ -1071,13 +1467,17 @@ void CycleOnOffAction::onChange(Object* object)
         running_m = false;
 }
 
+void CycleOnOffAction::execute()
+{
+    // Set before the delay, so that the stop condition also applies to it
+    running_m = true;
+    Action::execute();
+}
+
 void CycleOnOffAction::Run (pth_sem_t * stop)
 {
     if (!object_m)
         return;
-    running_m = true;
-    if (sleep(delay_m, stop))
-        return;
     logger_m.infoStream() << "Execute CycleOnOffAction" << endlog;
     for (int i=0; i<count_m; i++)
     {
@@ -1104,9 +1504,10 @@ RepeatListAction::RepeatListAction()
 
 RepeatListAction::~RepeatListAction()
 {
-    Stop();
+    stop();
     while (!actionsList_m.empty())
     {
+        actionsList_m.front()->stop();
         delete actionsList_m.front();
         actionsList_m.pop_front();
     }
@@ -1150,8 +1551,6 @@ void RepeatListAction::exportXml(ticpp::Element* pConfig)
 void RepeatListAction::Run (pth_sem_t * stop)
 {
     bool running = true;
-    if (sleep(delay_m, stop))
-        return;
     logger_m.infoStream() << "Execute RepeatListAction" << endlog;
     for (int i=0; i<count_m; i++)
     {
@@ -1194,11 +1593,12 @@ ConditionalAction::ConditionalAction()
 
 ConditionalAction::~ConditionalAction()
 {
-    Stop();
+    stop();
     if (condition_m)
         delete condition_m;
     while (!actionsList_m.empty())
     {
+        actionsList_m.front()->stop();
         delete actionsList_m.front();
         actionsList_m.pop_front();
     }
@@ -1243,8 +1643,6 @@ void ConditionalAction::exportXml(ticpp::Element* pConfig)
 void ConditionalAction::Run (pth_sem_t * stop)
 {
     bool running = true;
-    if (sleep(delay_m, stop))
-        return;
     logger_m.infoStream() << "Execute ConditionalAction" << endlog;
     bool curValue = condition_m->evaluate();
     logger_m.infoStream() << "ConditionalAction evaluated as " << curValue << endlog;
@@ -1316,8 +1714,6 @@ void SendSmsAction::exportXml(ticpp::Element* pConfig)
 
 void SendSmsAction::Run (pth_sem_t * stop)
 {
-    if (sleep(delay_m, stop))
-        return;
 
     std::string id = id_m;
     if (varFlags_m & VarId)
@@ -1380,8 +1776,6 @@ void SendEmailAction::exportXml(ticpp::Element* pConfig)
 
 void SendEmailAction::Run (pth_sem_t * stop)
 {
-    if (sleep(delay_m, stop))
-        return;
 
     std::string to = to_m;
     if (varFlags_m & VarTo)
@@ -1432,8 +1826,6 @@ void ShellCommandAction::exportXml(ticpp::Element* pConfig)
 
 void ShellCommandAction::Run (pth_sem_t * stop)
 {
-    if (sleep(delay_m, stop))
-        return;
     std::string cmd = cmd_m;
     if (varFlags_m & VarCmd)
         parseVarString(cmd);
@@ -1468,8 +1860,6 @@ void StartActionlistAction::exportXml(ticpp::Element* pConfig)
 
 void StartActionlistAction::Run (pth_sem_t * stop)
 {
-    if (sleep(delay_m, stop))
-        return;
     logger_m.infoStream() << "Execute StartActionlistAction for rule ID: " << ruleId_m << endlog;
 
     Rule* rule = RuleServer::instance()->getRule(ruleId_m.c_str());
@@ -1512,8 +1902,6 @@ void CancelAction::exportXml(ticpp::Element* pConfig)
 
 void CancelAction::Run (pth_sem_t * stop)
 {
-    if (sleep(delay_m, stop))
-        return;
     logger_m.infoStream() << "Execute CancelAction for rule ID: " << ruleId_m << endlog;
 
     Rule* rule = RuleServer::instance()->getRule(ruleId_m.c_str());
@@ -1549,8 +1937,6 @@ void SetRuleActiveAction::exportXml(ticpp::Element* pConfig)
 
 void SetRuleActiveAction::Run (pth_sem_t * stop)
 {
-    if (sleep(delay_m, stop))
-        return;
     logger_m.infoStream() << "Execute SetRuleActiveAction for rule ID: " << ruleId_m << endlog;
 
     Rule* rule = RuleServer::instance()->getRule(ruleId_m.c_str());
@@ -1609,7 +1995,249 @@ Condition* Condition::create(ticpp::Element* pConfig, ChangeListener* cl)
     return condition;
 }
 
-AndCondition::AndCondition(ChangeListener* cl) : cl_m(cl)
+bool Condition::evaluateWithStats()
+{
+    if (evalCount_m % CostSampleInterval != 0)
+    {
+        bool val = evaluate();
+        recordResult(val);
+        return val;
+    }
+    struct timeval start, end;
+    gettimeofday(&start, 0);
+    bool val = evaluate();
+    gettimeofday(&end, 0);
+    recordResult(val);
+    timedCount_m++;
+    totalCost_m += (end.tv_sec - start.tv_sec) * 1000000.0 + (end.tv_usec - start.tv_usec);
+    return val;
+}
+
+void Condition::recordResult(bool value)
+{
+    evalCount_m++;
+    if (value)
+        trueCount_m++;
+}
+
+void Condition::compile(ConditionProgram& program)
+{
+    program.emitCall(this);
+}
+
+void Condition::statsXml(ticpp::Element* pStatus)
+{
+    pStatus->SetAttribute("evaluations", evalCount_m);
+    if (evalCount_m)
+    {
+        pStatus->SetAttribute("true-ratio", static_cast<double>(trueCount_m) / evalCount_m);
+        pStatus->SetAttribute("average-cost", getAverageCost());
+    }
+}
+
+bool ConditionProgram::evaluate()
+{
+    bool result = false;
+    int size = code_m.size();
+    for (int pc = 0; pc < size; pc++)
+    {
+        const Instruction& ins = code_m[pc];
+        switch (ins.opcode)
+        {
+        case Constant:
+            result = (ins.arg != 0);
+            break;
+        case Call:
+            result = ins.condition->evaluate();
+            break;
+        case CallWithStats:
+            result = ins.condition->evaluateWithStats();
+            break;
+        case Record:
+            ins.condition->recordResult(result);
+            break;
+        case UpdateOrder:
+            if (ins.condition->updateOrder())
+                outdated_m = true;
+            break;
+        case CompareValue:
+        {
+            int res;
+            const ValueRef& current = ins.object->getCurrentValueRef();
+            if (ins.object->isInitialized() && current.isComparable(ins.value->getValueRef()))
+                res = current.compare(ins.value->getValueRef());
+            else
+                res = ins.object->get()->compare(ins.value);
+            result = ObjectCondition::matches(ins.arg, res);
+            break;
+        }
+        case CompareObjects:
+        {
+            int res;
+            const ValueRef& value1 = ins.object->getCurrentValueRef();
+            const ValueRef& value2 = ins.object2->getCurrentValueRef();
+            if (ins.object->isInitialized() && ins.object2->isInitialized() && value1.isComparable(value2))
+                res = value1.compare(value2);
+            else
+                res = ins.object->get()->compare(ins.object2->get());
+            result = ObjectCondition::matches(ins.arg, res);
+            break;
+        }
+        case Not:
+            result = !result;
+            break;
+        case JumpIfTrue:
+            if (result)
+                pc = ins.arg - 1;
+            break;
+        case JumpIfFalse:
+            if (!result)
+                pc = ins.arg - 1;
+            break;
+        }
+    }
+    // The new order only applies to the next evaluations
+    if (outdated_m && root_m)
+        compile(root_m);
+    return result;
+}
+
+void ConditionProgram::compile(Condition* condition)
+{
+    clear();
+    root_m = condition;
+    condition->compile(*this);
+}
+
+void ConditionProgram::emit(OpCode opcode, int arg)
+{
+    Instruction ins;
+    ins.opcode = opcode;
+    ins.arg = arg;
+    ins.object = 0;
+    ins.value = 0;
+    code_m.push_back(ins);
+}
+
+void ConditionProgram::emitConstant(bool value)
+{
+    emit(Constant, value);
+}
+
+void ConditionProgram::emitCall(Condition* condition)
+{
+    emit(Call, 0);
+    code_m.back().condition = condition;
+}
+
+void ConditionProgram::emitOperand(Condition* condition)
+{
+    size_t start = code_m.size();
+    condition->compile(*this);
+    // Inline comparisons are too cheap to be timed, only their results
+    // are recorded
+    if (code_m.size() == start + 1 && code_m[start].opcode == Call && code_m[start].condition == condition)
+        code_m[start].opcode = CallWithStats;
+    else
+    {
+        emit(Record, 0);
+        code_m.back().condition = condition;
+    }
+}
+
+void ConditionProgram::emitUpdateOrder(Condition* condition)
+{
+    emit(UpdateOrder, 0);
+    code_m.back().condition = condition;
+}
+
+void ConditionProgram::emitCompareValue(Object* object, ObjectValue* value, int op)
+{
+    emit(CompareValue, op);
+    code_m.back().object = object;
+    code_m.back().value = value;
+}
+
+void ConditionProgram::emitCompareObjects(Object* object, Object* object2, int op)
+{
+    emit(CompareObjects, op);
+    code_m.back().object = object;
+    code_m.back().object2 = object2;
+}
+
+void ConditionProgram::emitNot()
+{
+    emit(Not, 0);
+}
+
+int ConditionProgram::emitJumpIf(bool value)
+{
+    emit(value ? JumpIfTrue : JumpIfFalse, 0);
+    return code_m.size() - 1;
+}
+
+void ConditionProgram::setJumpTarget(int jump)
+{
+    code_m[jump].arg = code_m.size();
+}
+
+// Orders the children of an and/or condition by expected cost per
+// short-circuit, i.e. average cost divided by the probability to return
+// the value that ends the evaluation. One microsecond is added to the cost
+// so that selectivity still matters for conditions too cheap to measure,
+// and probabilities are smoothed so that new conditions are not penalized.
+class ShortCircuitOrder
+{
+public:
+    ShortCircuitOrder(bool shortCircuitValue) : shortCircuitValue_m(shortCircuitValue) {}
+
+    bool operator()(Condition* a, Condition* b) const { return rank(a) < rank(b); }
+
+    double rank(Condition* condition) const
+    {
+        unsigned long count = condition->getEvalCount();
+        unsigned long hits = shortCircuitValue_m ? condition->getTrueCount() : count - condition->getTrueCount();
+        return (condition->getAverageCost() + 1) * (count + 2) / (hits + 1);
+    }
+
+    // Sorts conditions, keeping those with side effects in place and never
+    // moving a condition across them
+    void apply(std::vector<Condition*>& conditions) const
+    {
+        std::vector<Condition*>::iterator begin = conditions.begin();
+        std::vector<Condition*>::iterator it;
+        for (it = conditions.begin(); it != conditions.end(); ++it)
+        {
+            if ((*it)->hasSideEffects())
+            {
+                std::stable_sort(begin, it, *this);
+                begin = it + 1;
+            }
+        }
+        std::stable_sort(begin, conditions.end(), *this);
+    }
+
+    // Number of full evaluations between two reorderings
+    static const int ReorderInterval = 32;
+
+private:
+    bool shortCircuitValue_m;
+};
+
+static void conditionsStatusXml(ticpp::Element* pStatus, Condition::ConditionsList_t& conditions, std::vector<Condition*>& evalOrder)
+{
+    Condition::ConditionsList_t::iterator it;
+    for (it = conditions.begin(); it != conditions.end(); it++)
+    {
+        ticpp::Element pElem("condition");
+        (*it)->statusXml(&pElem);
+        (*it)->statsXml(&pElem);
+        pElem.SetAttribute("order", std::find(evalOrder.begin(), evalOrder.end(), *it) - evalOrder.begin());
+        pStatus->LinkEndChild(&pElem);
+    }
+}
+
+AndCondition::AndCondition(ChangeListener* cl) : cl_m(cl), evaluatedCount_m(0), passCount_m(0), sideEffects_m(false)
 {}
 
 AndCondition::~AndCondition()
@@ -1621,11 +2249,37 @@ AndCondition::~AndCondition()
 
 bool AndCondition::evaluate()
 {
-    ConditionsList_t::iterator it;
-    for(it=conditionsList_m.begin(); it != conditionsList_m.end(); ++it)
-        if (!(*it)->evaluate())
-            return false;
-    return true;
+    if (!isStale())
+        return cachedValue_m;
+    // Reorder only between full passes, as the cached result depends on
+    // the conditions evaluated first
+    updateOrder();
+    cachedValue_m = true;
+    evaluatedCount_m = 0;
+    std::vector<Condition*>::iterator it;
+    for(it=evalOrder_m.begin(); it != evalOrder_m.end(); ++it)
+    {
+        evaluatedCount_m++;
+        if (!(*it)->evaluateWithStats())
+        {
+            cachedValue_m = false;
+            break;
+        }
+    }
+    cacheValid_m = true;
+    return cachedValue_m;
+}
+
+bool AndCondition::isStale()
+{
+    if (!cacheValid_m)
+        return true;
+    // Conditions skipped by the short-circuit didn't contribute to the result
+    std::vector<Condition*>::iterator it;
+    for(it=evalOrder_m.begin(); it != evalOrder_m.begin() + evaluatedCount_m; ++it)
+        if ((*it)->isStale())
+            return true;
+    return false;
 }
 
 void AndCondition::importXml(ticpp::Element* pConfig)
@@ -1635,9 +2289,45 @@ void AndCondition::importXml(ticpp::Element* pConfig)
     {
         Condition* condition = Condition::create(&(*child), cl_m);
         conditionsList_m.push_back(condition);
+        evalOrder_m.push_back(condition);
+        sideEffects_m = sideEffects_m || condition->hasSideEffects();
     }
 }
 
+bool AndCondition::updateOrder()
+{
+    if (++passCount_m % ShortCircuitOrder::ReorderInterval != 0)
+        return false;
+    std::vector<Condition*> previous(evalOrder_m);
+    ShortCircuitOrder(false).apply(evalOrder_m);
+    if (evalOrder_m == previous)
+        return false;
+    // evaluatedCount_m refers to the previous order
+    cacheValid_m = false;
+    return true;
+}
+
+void AndCondition::compile(ConditionProgram& program)
+{
+    if (evalOrder_m.empty())
+    {
+        program.emitConstant(true);
+        return;
+    }
+    program.emitUpdateOrder(this);
+    std::vector<int> jumps;
+    std::vector<Condition*>::iterator it;
+    for(it=evalOrder_m.begin(); it != evalOrder_m.end(); ++it)
+    {
+        if (it != evalOrder_m.begin())
+            jumps.push_back(program.emitJumpIf(false));
+        program.emitOperand(*it);
+    }
+    std::vector<int>::iterator jump;
+    for(jump=jumps.begin(); jump != jumps.end(); ++jump)
+        program.setJumpTarget(*jump);
+}
+
 void AndCondition::exportXml(ticpp::Element* pConfig)
 {
     pConfig->SetAttribute("type", "and");
@@ -1653,16 +2343,10 @@ void AndCondition::exportXml(ticpp::Element* pConfig)
 void AndCondition::statusXml(ticpp::Element* pStatus)
 {
     pStatus->SetAttribute("type", "and");
-    ConditionsList_t::iterator it;
-    for (it = conditionsList_m.begin(); it != conditionsList_m.end(); it++)
-    {
-        ticpp::Element pElem("condition");
-        (*it)->statusXml(&pElem);
-        pStatus->LinkEndChild(&pElem);
-    }
+    conditionsStatusXml(pStatus, conditionsList_m, evalOrder_m);
 }
 
-OrCondition::OrCondition(ChangeListener* cl) : cl_m(cl)
+OrCondition::OrCondition(ChangeListener* cl) : cl_m(cl), evaluatedCount_m(0), passCount_m(0), sideEffects_m(false)
 {}
 
 OrCondition::~OrCondition()
@@ -1674,9 +2358,35 @@ OrCondition::~OrCondition()
 
 bool OrCondition::evaluate()
 {
-    ConditionsList_t::iterator it;
-    for(it=conditionsList_m.begin(); it != conditionsList_m.end(); ++it)
-        if ((*it)->evaluate())
+    if (!isStale())
+        return cachedValue_m;
+    // Reorder only between full passes, as the cached result depends on
+    // the conditions evaluated first
+    updateOrder();
+    cachedValue_m = false;
+    evaluatedCount_m = 0;
+    std::vector<Condition*>::iterator it;
+    for(it=evalOrder_m.begin(); it != evalOrder_m.end(); ++it)
+    {
+        evaluatedCount_m++;
+        if ((*it)->evaluateWithStats())
+        {
+            cachedValue_m = true;
+            break;
+        }
+    }
+    cacheValid_m = true;
+    return cachedValue_m;
+}
+
+bool OrCondition::isStale()
+{
+    if (!cacheValid_m)
+        return true;
+    // Conditions skipped by the short-circuit didn't contribute to the result
+    std::vector<Condition*>::iterator it;
+    for(it=evalOrder_m.begin(); it != evalOrder_m.begin() + evaluatedCount_m; ++it)
+        if ((*it)->isStale())
             return true;
     return false;
 }
@@ -1688,9 +2398,45 @@ void OrCondition::importXml(ticpp::Element* pConfig)
     {
         Condition* condition = Condition::create(&(*child), cl_m);
         conditionsList_m.push_back(condition);
+        evalOrder_m.push_back(condition);
+        sideEffects_m = sideEffects_m || condition->hasSideEffects();
     }
 }
 
+bool OrCondition::updateOrder()
+{
+    if (++passCount_m % ShortCircuitOrder::ReorderInterval != 0)
+        return false;
+    std::vector<Condition*> previous(evalOrder_m);
+    ShortCircuitOrder(true).apply(evalOrder_m);
+    if (evalOrder_m == previous)
+        return false;
+    // evaluatedCount_m refers to the previous order
+    cacheValid_m = false;
+    return true;
+}
+
+void OrCondition::compile(ConditionProgram& program)
+{
+    if (evalOrder_m.empty())
+    {
+        program.emitConstant(false);
+        return;
+    }
+    program.emitUpdateOrder(this);
+    std::vector<int> jumps;
+    std::vector<Condition*>::iterator it;
+    for(it=evalOrder_m.begin(); it != evalOrder_m.end(); ++it)
+    {
+        if (it != evalOrder_m.begin())
+            jumps.push_back(program.emitJumpIf(true));
+        program.emitOperand(*it);
+    }
+    std::vector<int>::iterator jump;
+    for(jump=jumps.begin(); jump != jumps.end(); ++jump)
+        program.setJumpTarget(*jump);
+}
+
 void OrCondition::exportXml(ticpp::Element* pConfig)
 {
     pConfig->SetAttribute("type", "or");
@@ -1706,13 +2452,7 @@ void OrCondition::exportXml(ticpp::Element* pConfig)
 void OrCondition::statusXml(ticpp::Element* pStatus)
 {
     pStatus->SetAttribute("type", "or");
-    ConditionsList_t::iterator it;
-    for (it = conditionsList_m.begin(); it != conditionsList_m.end(); it++)
-    {
-        ticpp::Element pElem("condition");
-        (*it)->statusXml(&pElem);
-        pStatus->LinkEndChild(&pElem);
-    }
+    conditionsStatusXml(pStatus, conditionsList_m, evalOrder_m);
 }
 
 NotCondition::NotCondition(ChangeListener* cl) : condition_m(0), cl_m(cl)
@@ -1729,6 +2469,12 @@ bool NotCondition::evaluate()
     return !condition_m->evaluate();
 }
 
+void NotCondition::compile(ConditionProgram& program)
+{
+    condition_m->compile(program);
+    program.emitNot();
+}
+
 void NotCondition::importXml(ticpp::Element* pConfig)
 {
     condition_m = Condition::create(pConfig->FirstChildElement("condition"), cl_m);
@@ -1756,7 +2502,7 @@ void NotCondition::statusXml(ticpp::Element* pStatus)
     }
 }
 
-ObjectCondition::ObjectCondition(ChangeListener* cl) : object_m(0), value_m(0), cl_m(cl), trigger_m(false), op_m(eq)
+ObjectCondition::ObjectCondition(ChangeListener* cl) : object_m(0), value_m(0), cl_m(cl), trigger_m(false), op_m(eq), changeCount_m(0)
 {}
 
 ObjectCondition::~ObjectCondition()
@@ -1771,19 +2517,44 @@ ObjectCondition::~ObjectCondition()
 
 bool ObjectCondition::evaluate()
 {
+    if (!isStale())
+        return cachedValue_m;
     // if no value is defined, condition is always true
     bool val = (value_m == 0);
     if (!val)
     {
-        int res = object_m->get()->compare(value_m);
-        val = ((op_m & eq) && (res == 0)) || ((op_m & lt) && (res == -1)) || ((op_m & gt) && (res == 1));
+        int res;
+        const ValueRef& current = object_m->getCurrentValueRef();
+        if (object_m->isInitialized() && current.isComparable(value_m->getValueRef()))
+            res = current.compare(value_m->getValueRef());
+        else
+            res = object_m->get()->compare(value_m);
+        val = matches(op_m, res);
     }
     logger_m.infoStream() << "ObjectCondition (id='" << object_m->getID()
     << "') evaluated as '" << val
     << "'" << endlog;
+    // get() may have read the value from the bus, so take the count afterwards
+    changeCount_m = object_m->getChangeCount();
+    cachedValue_m = val;
+    cacheValid_m = true;
     return val;
 }
 
+bool ObjectCondition::isStale()
+{
+    return !cacheValid_m || object_m->getChangeCount() != changeCount_m;
+}
+
+void ObjectCondition::compile(ConditionProgram& program)
+{
+    // if no value is defined, condition is always true
+    if (value_m)
+        program.emitCompareValue(object_m, value_m, op_m);
+    else
+        program.emitConstant(true);
+}
+
 void ObjectCondition::importXml(ticpp::Element* pConfig)
 {
     std::string trigger;
@@ -1870,7 +2641,7 @@ void ObjectCondition::statusXml(ticpp::Element* pStatus)
         pStatus->SetAttribute("trigger", "true");
 }
 
-ObjectComparisonCondition::ObjectComparisonCondition(ChangeListener* cl) : ObjectCondition(cl), object2_m(0)
+ObjectComparisonCondition::ObjectComparisonCondition(ChangeListener* cl) : ObjectCondition(cl), object2_m(0), changeCount2_m(0)
 {}
 
 ObjectComparisonCondition::~ObjectComparisonCondition()
@@ -1883,13 +2654,36 @@ ObjectComparisonCondition::~ObjectComparisonCondition()
 
 bool ObjectComparisonCondition::evaluate()
 {
-    int res = object_m->get()->compare(object2_m->get());
-    bool val = ((op_m & eq) && (res == 0)) || ((op_m & lt) && (res == -1)) || ((op_m & gt) && (res == 1));
+    if (!isStale())
+        return cachedValue_m;
+    int res;
+    const ValueRef& value1 = object_m->getCurrentValueRef();
+    const ValueRef& value2 = object2_m->getCurrentValueRef();
+    if (object_m->isInitialized() && object2_m->isInitialized() && value1.isComparable(value2))
+        res = value1.compare(value2);
+    else
+        res = object_m->get()->compare(object2_m->get());
+    bool val = matches(op_m, res);
     logger_m.infoStream() << "ObjectComparisonCondition (id='" << object_m->getID() << "'; id2='" << object2_m->getID()
     << "')" << endlog;
+    changeCount_m = object_m->getChangeCount();
+    changeCount2_m = object2_m->getChangeCount();
+    cachedValue_m = val;
+    cacheValid_m = true;
     return val;
 }
 
+bool ObjectComparisonCondition::isStale()
+{
+    return !cacheValid_m || object_m->getChangeCount() != changeCount_m
+        || object2_m->getChangeCount() != changeCount2_m;
+}
+
+void ObjectComparisonCondition::compile(ConditionProgram& program)
+{
+    program.emitCompareObjects(object_m, object2_m, op_m);
+}
+
 void ObjectComparisonCondition::importXml(ticpp::Element* pConfig)
 {
     std::string trigger;
@@ -2127,6 +2921,54 @@ bool TimerCondition::evaluate()
     return value_m;
 }
 
+TimeMs_t TimerCondition::parseTimerDuration(const std::string& duration)
+{
+    if (duration == "")
+        return 0;
+    std::istringstream val(duration);
+    std::string unit;
+    double num;
+    val >> num;
+
+    if (val.fail() || num < 0)
+    {
+        std::stringstream msg;
+        msg << "TimerCondition: Bad duration: '" << duration << "'" << std::endl;
+        throw ticpp::Exception(msg.str());
+    }
+    val >> unit;
+    // Computed in milliseconds so that long periods do not overflow an int
+    double factor;
+    if (unit == "d")
+        factor = 3600 * 24 * 1000.0;
+    else if (unit == "h")
+        factor = 3600 * 1000.0;
+    else if (unit == "m")
+        factor = 60 * 1000.0;
+    else if (unit == "" || unit == "s")
+        factor = 1000.0;
+    else if (unit == "ms")
+        factor = 1.0;
+    else
+    {
+        std::stringstream msg;
+        msg << "TimerCondition: Bad unit: '" << unit << "'" << std::endl;
+        throw ticpp::Exception(msg.str());
+    }
+    return (TimeMs_t)(num * factor + 0.5);
+}
+
+std::string TimerCondition::formatTimerDuration(TimeMs_t duration)
+{
+    if (duration % 1000 != 0)
+    {
+        std::stringstream output;
+        output << duration << "ms";
+        return output.str();
+    }
+    return RuleServer::formatDuration(duration / 1000);
+}
+
 void TimerCondition::importXml(ticpp::Element* pConfig)
 {
     std::string trigger = pConfig->GetAttribute("trigger");
@@ -2152,7 +2994,7 @@ void TimerCondition::importXml(ticpp::Element* pConfig)
         at_m = TimeSpec::create(at, this);
     }
     else if (every)
-        after_m = RuleServer::parseDuration(every->GetText());
+        after_m = parseTimerDuration(every->GetText());
     else
         throw ticpp::Exception("Timer must define <at> or <every> elements");
 
@@ -2162,7 +3004,7 @@ void TimerCondition::importXml(ticpp::Element* pConfig)
         throw ticpp::Exception("Timer can't define <until> and <during> elements simultaneously");
     if (during)
     {
-        during_m = RuleServer::parseDuration(during->GetText());
+        during_m = parseTimerDuration(during->GetText());
         if (every && after_m > during_m)
             after_m -= during_m;
         else if (every)
@@ -2216,10 +3058,10 @@ void TimerCondition::exportXml(ticpp::Element* pConfig)
     else
     {
         ticpp::Element pEvery("every");
-        int every = after_m;
+        TimeMs_t every = after_m;
         if (during_m > 0)
             every += during_m;
-        pEvery.SetText(RuleServer::formatDuration(every));
+        pEvery.SetText(formatTimerDuration(every));
         pConfig->LinkEndChild(&pEvery);
     }
 
@@ -2232,7 +3074,7 @@ void TimerCondition::exportXml(ticpp::Element* pConfig)
     else if (during_m != 0)
     {
         ticpp::Element pDuring("during");
-        pDuring.SetText(RuleServer::formatDuration(during_m));
+        pDuring.SetText(formatTimerDuration(during_m));
         pConfig->LinkEndChild(&pDuring);
     }
 }
@@ -2269,7 +3111,7 @@ bool TimeCounterCondition::evaluate()
         lastVal_m = true;
         if (counter_m < threshold_m)
         {
-            execTime_m = now + (threshold_m - counter_m) + 1;
+            execTime_m = (now + (threshold_m - counter_m) + 1) * 1000LL;
             Services::instance()->getTimerManager()->removeTask(this);
             reschedule(0);
         }
@@ -2278,7 +3120,7 @@ bool TimeCounterCondition::evaluate()
     {
         lastTime_m = now;
         lastVal_m = false;
-        execTime_m = now + resetDelay_m + 1;
+        execTime_m = (now + resetDelay_m + 1) * 1000LL;
         Services::instance()->getTimerManager()->removeTask(this);
         reschedule(0);
     }
@@ -2375,6 +3217,13 @@ void ActionList::cancel()
 		(*it)->cancel();
 }
 
+void ActionList::clear()
+{
+	for(iterator it = this->begin(); it != this->end(); ++it)
+		(*it)->stop();
+	List<Action*, true>::clear();
+}
+
 std::string ActionList::getTriggerTypeToString(TriggerType trigger)
 {
 	switch (trigger)
@@ -21,6 +21,9 @@
 #define RULESERVER_H
 
 #include <list>
+#include <map>
+#include <vector>
+#include <set>
 #include <string>
 #include "config.h"
 #include "logger.h"
@@ -29,22 +32,126 @@
 #include "collections.h"
 #include "ticpp.h"
 
+class ConditionProgram;
+
 class Condition
 {
 public:
+    Condition() : cacheValid_m(false), cachedValue_m(false), evalCount_m(0), trueCount_m(0), timedCount_m(0), totalCost_m(0) {};
     virtual ~Condition() {};
 
     static Condition* create(const std::string& type, ChangeListener* cl);
     static Condition* create(ticpp::Element* pConfig, ChangeListener* cl);
 
     virtual bool evaluate() = 0;
+    // Returns false if evaluate() is known to return the same result as
+    // last time, i.e. none of the objects the condition depends on changed
+    // since then. Conditions that can't tell (timers, scripts, ...) are
+    // always stale.
+    virtual bool isStale() { return true; };
+    // Conditions changing some state when evaluated (counters, scripts, ...)
+    // are never moved by the reordering of and/or conditions
+    virtual bool hasSideEffects() { return false; };
+
+    // Appends instructions evaluating the condition to the program. By
+    // default, the program calls evaluate() on the condition itself.
+    virtual void compile(ConditionProgram& program);
+    // Called once per evaluation pass of and/or conditions, which
+    // periodically reorder their operands. Returns true if the order changed.
+    virtual bool updateOrder() { return false; };
+
+    // Same as evaluate(), also recording result statistics. The cost is
+    // only measured for one evaluation out of CostSampleInterval.
+    bool evaluateWithStats();
+    // Records the result of an evaluation done elsewhere
+    void recordResult(bool value);
+    unsigned long getEvalCount() { return evalCount_m; };
+    unsigned long getTrueCount() { return trueCount_m; };
+    // Average evaluation time in microseconds, over the sampled evaluations
+    double getAverageCost() { return timedCount_m ? totalCost_m / timedCount_m : 0; };
+    static const unsigned int CostSampleInterval = 16;
+    void statsXml(ticpp::Element* pStatus);
     virtual void importXml(ticpp::Element* pConfig) = 0;
     virtual void exportXml(ticpp::Element* pConfig) = 0;
     virtual void statusXml(ticpp::Element* pStatus) = 0;
 
     typedef std::list<Condition*> ConditionsList_t;
 protected:
+    bool cacheValid_m;
+    bool cachedValue_m;
     static Logger& logger_m;
+private:
+    unsigned long evalCount_m;
+    unsigned long trueCount_m;
+    unsigned long timedCount_m;
+    double totalCost_m;
+};
+
+// Condition tree flattened into an array of instructions over objects,
+// evaluated in a loop with a single result register. And/or conditions
+// become jumps over their remaining operands, and leaves that can't be
+// compiled are called through the tree. The program doesn't own anything,
+// the tree it was compiled from must outlive it.
+class ConditionProgram
+{
+public:
+    ConditionProgram() : root_m(0), outdated_m(false) {};
+
+    bool evaluate();
+    // Replaces the program by condition compiled. The program then compiles
+    // it again whenever an and/or condition reorders its operands.
+    void compile(Condition* condition);
+    void clear() { code_m.clear(); root_m = 0; outdated_m = false; };
+    int size() { return code_m.size(); };
+    // True if the evaluation order changed since the program was compiled
+    bool isOutdated() { return outdated_m; };
+
+    void emitConstant(bool value);
+    void emitCall(Condition* condition);
+    // Emits an operand of an and/or condition, recording its statistics
+    void emitOperand(Condition* condition);
+    // Lets condition reorder its operands, see Condition::updateOrder()
+    void emitUpdateOrder(Condition* condition);
+    void emitCompareValue(Object* object, ObjectValue* value, int op);
+    void emitCompareObjects(Object* object, Object* object2, int op);
+    void emitNot();
+    // Returns the position of the jump, see setJumpTarget()
+    int emitJumpIf(bool value);
+    // Makes the jump continue after the last instruction emitted so far
+    void setJumpTarget(int jump);
+
+private:
+    enum OpCode
+    {
+        Constant,
+        Call,
+        CallWithStats,
+        Record,
+        UpdateOrder,
+        CompareValue,
+        CompareObjects,
+        Not,
+        JumpIfTrue,
+        JumpIfFalse
+    };
+    struct Instruction
+    {
+        unsigned char opcode;
+        // Comparison operator for CompareValue and CompareObjects, value
+        // for Constant, destination for jumps
+        int arg;
+        Object* object;
+        union
+        {
+            ObjectValue* value;
+            Object* object2;
+            Condition* condition;
+        };
+    };
+    void emit(OpCode opcode, int arg);
+    std::vector<Instruction> code_m;
+    Condition* root_m;
+    bool outdated_m;
 };
 
 class AndCondition : public Condition
@@ -54,13 +161,25 @@ public:
     virtual ~AndCondition();
 
     virtual bool evaluate();
+    virtual bool isStale();
+    virtual bool hasSideEffects() { return sideEffects_m; };
+    virtual void compile(ConditionProgram& program);
+    virtual bool updateOrder();
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
 
 private:
+    // Conditions in configuration order
     ConditionsList_t conditionsList_m;
+    // Same conditions in evaluation order, see ShortCircuitOrder
+    std::vector<Condition*> evalOrder_m;
     ChangeListener* cl_m;
+    // Number of conditions evaluated by the last pass before it was
+    // short-circuited; only those can make the cached result stale
+    int evaluatedCount_m;
+    int passCount_m;
+    bool sideEffects_m;
 };
 
 class OrCondition : public Condition
@@ -70,13 +189,25 @@ public:
     virtual ~OrCondition();
 
     virtual bool evaluate();
+    virtual bool isStale();
+    virtual bool hasSideEffects() { return sideEffects_m; };
+    virtual void compile(ConditionProgram& program);
+    virtual bool updateOrder();
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
 
 private:
+    // Conditions in configuration order
     ConditionsList_t conditionsList_m;
+    // Same conditions in evaluation order, see ShortCircuitOrder
+    std::vector<Condition*> evalOrder_m;
     ChangeListener* cl_m;
+    // Number of conditions evaluated by the last pass before it was
+    // short-circuited; only those can make the cached result stale
+    int evaluatedCount_m;
+    int passCount_m;
+    bool sideEffects_m;
 };
 
 class NotCondition : public Condition
@@ -86,6 +217,9 @@ public:
     virtual ~NotCondition();
 
     virtual bool evaluate();
+    virtual bool isStale() { return condition_m->isStale(); };
+    virtual bool hasSideEffects() { return condition_m->hasSideEffects(); };
+    virtual void compile(ConditionProgram& program);
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
@@ -102,6 +236,14 @@ public:
     virtual ~ObjectCondition();
 
     virtual bool evaluate();
+    virtual bool isStale();
+    virtual void compile(ConditionProgram& program);
+
+    // Whether the result of ObjectValue::compare() matches the operator
+    static bool matches(int op, int res)
+    {
+        return ((op & eq) && (res == 0)) || ((op & lt) && (res == -1)) || ((op & gt) && (res == 1));
+    };
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
@@ -111,6 +253,7 @@ protected:
     ChangeListener* cl_m;
     bool trigger_m;
     int op_m;
+    unsigned long changeCount_m;
     enum Operation
     {
         eq = 0x01,
@@ -128,12 +271,15 @@ public:
     virtual ~ObjectComparisonCondition();
 
     virtual bool evaluate();
+    virtual bool isStale();
+    virtual void compile(ConditionProgram& program);
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
 
 protected:
     Object* object2_m;
+    unsigned long changeCount2_m;
 };
 
 class ObjectSourceCondition : public ObjectCondition
@@ -143,6 +289,8 @@ public:
     virtual ~ObjectSourceCondition();
 
     virtual bool evaluate();
+    virtual bool isStale() { return true; };
+    virtual void compile(ConditionProgram& program) { program.emitCall(this); };
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
@@ -158,6 +306,9 @@ public:
     virtual ~ObjectThresholdCondition();
 
     virtual bool evaluate();
+    virtual bool isStale() { return true; };
+    virtual void compile(ConditionProgram& program) { program.emitCall(this); };
+    virtual bool hasSideEffects() { return true; };
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
@@ -178,6 +329,12 @@ public:
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
+
+    /** Durations of <every> and <during> in milliseconds. Values may have
+     * a fractional part, e.g. "1.5s", rounded to the millisecond. */
+    static TimeMs_t parseTimerDuration(const std::string& duration);
+    static std::string formatTimerDuration(TimeMs_t duration);
+
 private:
     bool trigger_m;
     char initVal_m;
@@ -197,6 +354,7 @@ public:
 
     virtual void onTimer(time_t time);
     virtual bool evaluate();
+    virtual bool hasSideEffects() { return true; };
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
@@ -211,11 +369,16 @@ private:
     int resetDelay_m;
 };
 
-class Action : protected Thread
+class Action
 {
+    friend class ActionExecutor;
 public:
-    Action() : delay_m(0) {};
-    virtual ~Action() {};
+    Action() : delay_m(0), pending_m(0), running_m(0)
+    {
+        pth_mutex_init(&finishedMutex_m);
+        pth_cond_init(&finished_m);
+    };
+    virtual ~Action();
 
     static Action* create(ticpp::Element* pConfig);
     static Action* create(const std::string& type);
@@ -223,10 +386,16 @@ public:
     virtual void importXml(ticpp::Element* pConfig) = 0;
     virtual void exportXml(ticpp::Element* pConfig);
 
-    virtual void execute() { Start(true); };
-    virtual void cancel() { Stop(); };
-    virtual bool isFinished() { return Thread::isFinished(); };
+    // Runs the action after its delay. Each call schedules its own run,
+    // even while a previous one is still pending or running.
+    virtual void execute();
+    virtual void cancel();
+    virtual bool isFinished() { return pending_m == 0 && running_m == 0; };
+    // Cancels the action and waits until it returned from Run(). Owners
+    // must call it before deleting an action that may have been executed.
+    void stop();
 private:
+    // Called by the ActionExecutor once delay_m has elapsed
     virtual void Run (pth_sem_t * stop) = 0;
 protected:
     static bool sleep(int delay, pth_sem_t * stop);
@@ -234,6 +403,86 @@ protected:
     bool parseVarString(std::string &str, bool checkOnly = false);
     int delay_m;
     static Logger& logger_m;
+private:
+    // Stop semaphores of the runs in progress, one per run
+    std::list<pth_sem_t*> stops_m;
+    int pending_m;
+    int running_m;
+    // Signaled by the worker when running_m drops to 0
+    pth_mutex_t finishedMutex_m;
+    pth_cond_t finished_m;
+};
+
+// Runs actions on a pool of reusable threads. Threads are only created
+// when all existing ones are busy, and idle ones beyond MaxIdleWorkers
+// exit. Delayed actions wait in a timer wheel instead of each holding a
+// sleeping thread.
+class ActionExecutor : public Runable
+{
+public:
+    static ActionExecutor* instance();
+    static void reset()
+    {
+        if (instance_m)
+            delete instance_m;
+        instance_m = 0;
+    };
+
+    // Runs the action after its delay
+    void execute(Action* action);
+    // Drops pending executions of the action and notifies running ones
+    void cancel(Action* action);
+    // Cancels the action and deletes it once it returned from Run(),
+    // without waiting for it
+    void dispose(Action* action);
+
+    int getWorkerCount() { return workers_m.size(); };
+    int getIdleWorkerCount() { return idleWorkers_m; };
+
+    enum
+    {
+        // Tick of the timer wheel in milliseconds, delays are rounded up
+        TickLength = 10,
+        WheelSize = 256,
+        MaxIdleWorkers = 4
+    };
+
+private:
+    ActionExecutor();
+    ~ActionExecutor();
+
+    void enqueue(Action* action);
+    void spawnWorker();
+    void schedule(Action* action, int delay);
+    void advanceWheel();
+    void WheelRun(pth_sem_t * stop);
+    void WorkerRun(pth_sem_t * stop);
+
+    struct DelayedAction
+    {
+        Action* action;
+        int rounds;
+    };
+    typedef std::list<DelayedAction> WheelSlot_t;
+    WheelSlot_t wheel_m[WheelSize];
+    int wheelPos_m;
+    int wheelCount_m;
+    struct timeval nextTick_m;
+    pth_sem_t wheelChanged_m;
+    Thread wheelThread_m;
+
+    typedef std::list<Action*> RunQueue_t;
+    RunQueue_t runQueue_m;
+    pth_sem_t queued_m;
+    typedef std::list<Thread*> WorkerList_t;
+    WorkerList_t workers_m;
+    // Workers waiting for an action, including those not started yet
+    int idleWorkers_m;
+    // Actions to delete when their last run ends
+    std::set<Action*> disposed_m;
+
+    static ActionExecutor* instance_m;
+    static Logger& logger_m;
 };
 
 class DimUpAction : public Action
@@ -355,6 +604,7 @@ public:
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void onChange(Object* object);
+    virtual void execute();
 
 private:
     virtual void Run (pth_sem_t * stop);
@@ -537,6 +787,8 @@ public:
 	void exportXml(ticpp::Element *pConfig);
 	std::string getTriggerTypeToString() {return getTriggerTypeToString(triggerType_m);}
 	void cancel();
+	// Stops the actions before deleting them
+	virtual void clear();
 
 	static std::string getTriggerTypeToString(TriggerType trigger);
 	static TriggerType parseTriggerType(const std::string &trigger);
@@ -561,6 +813,11 @@ public:
 
     void evaluate();
     void setActive(bool active);
+    // If set, changes during a dispatch cycle evaluate the rule only once,
+    // at the end of the cycle. Otherwise, each change evaluates it.
+    void setCoalesce(bool coalesce);
+    // If set, the condition is evaluated through a ConditionProgram
+    void setCompile(bool compile);
     void cancel();
     void initialize();
 
@@ -577,6 +834,7 @@ public:
 	void addAction(Action *action, ActionList::TriggerType trigger);
 
 private:
+	bool evaluateCondition();
 	void executeActions(ActionList &actions);
 	ActionList &getActions(ActionList::TriggerType trigger);
 	static void exportActions(ActionList &actions, ticpp::Element *pRuleConfig);
@@ -585,6 +843,7 @@ private:
     std::string id_m;
     std::string descr_m;
     Condition* condition_m;
+    ConditionProgram program_m;
     ActionList actionsOnTrue_m;
     ActionList actionsIfTrue_m;
     ActionList actionsOnFalse_m;
@@ -594,6 +853,8 @@ private:
     {
         None = 0x00,
         Active = 0x01,
+        Coalesce = 0x02,
+        Compile = 0x04,
         InitEval = 0x10,
         InitTrue = 0x20,
     };
@@ -621,6 +882,18 @@ public:
     
     Rule *getRule(const char *id);
 
+    // Dispatch cycles can be nested, changes are collected until the
+    // outermost one ends. Cycles are tracked per thread, changes made by
+    // other threads are evaluated immediately. See RuleEvaluationCycle.
+    static void beginCycle();
+    static void endCycle();
+    // Same as endCycle() but never throws, for a cycle left by an exception
+    static void abortCycle();
+    // Returns true if the rule will be evaluated at the end of the
+    // current thread's cycle, false if it has no cycle in progress
+    static bool deferEvaluation(Rule* rule);
+    static void cancelEvaluation(Rule* rule);
+
     static int parseDuration(const std::string& duration, bool allowNegative = false, bool useMilliseconds = false);
     static std::string formatDuration(int duration, bool useMilliseconds = false);
 
@@ -631,6 +904,32 @@ private:
     typedef std::map<std::string ,Rule*> RuleIdMap_t;
     RuleIdMap_t rulesMap_m;
     static RuleServer* instance_m;
+    typedef std::list<Rule*> RuleList_t;
+    struct Cycle
+    {
+        Cycle() : depth(0) {};
+        int depth;
+        RuleList_t dirtyRules;
+    };
+    typedef std::map<pth_t, Cycle> CycleMap_t;
+    // Cycles in progress by thread
+    static CycleMap_t cycles_m;
+
+    static void evaluateDirtyRules(bool catchExceptions);
+};
+
+// Dispatch cycle of the current thread, e.g. the processing of a batch of
+// telegrams. It must be ended with end(), the rules are then evaluated.
+// If the scope is left by an exception, the destructor evaluates them
+// without letting any exception escape.
+class RuleEvaluationCycle
+{
+public:
+    RuleEvaluationCycle() : ended_m(false) { RuleServer::beginCycle(); };
+    ~RuleEvaluationCycle() { if (!ended_m) RuleServer::abortCycle(); };
+    void end() { ended_m = true; RuleServer::endCycle(); };
+private:
+    bool ended_m;
 };
 
 class RuleInitializer : public Thread
@@ -22,12 +22,19 @@
 
 Services* Services::instance_m;
 
-Services::Services() : xmlServer_m(0), persistentStorage_m(0)
+Services::Services() : xmlServer_m(0), persistentStorage_m(0), telegramListener_m(0), isRunning_m(false)
 {}
 
 Services::~Services()
 {
     stop();
+    KnxConnectionList_t::iterator it;
+    for (it = connections_m.begin(); it != connections_m.end(); it++)
+    {
+        unlisten(*it);
+        delete (*it);
+    }
+    unlisten(&knxConnection_m);
     if (xmlServer_m)
         delete xmlServer_m;
     if (persistentStorage_m)
@@ -46,6 +53,10 @@ void Services::start()
 {
     timers_m.startManager();
     knxConnection_m.startConnection();
+    KnxConnectionList_t::iterator it;
+    for (it = connections_m.begin(); it != connections_m.end(); it++)
+        (*it)->startConnection();
+    isRunning_m = true;
 }
 
 void Services::stop()
@@ -53,6 +64,103 @@ void Services::stop()
     infoStream("Services") << "Stopping services" << endlog;
     timers_m.stopManager();
     knxConnection_m.stopConnection();
+    KnxConnectionList_t::iterator it;
+    for (it = connections_m.begin(); it != connections_m.end(); it++)
+        (*it)->stopConnection();
+    isRunning_m = false;
+}
+
+void Services::statusXml(ticpp::Element* pStatus)
+{
+    knxConnection_m.statusXml(pStatus);
+    KnxConnectionList_t::iterator it;
+    for (it = connections_m.begin(); it != connections_m.end(); it++)
+    {
+        ticpp::Element pElem("connection");
+        (*it)->statusXml(&pElem);
+        pStatus->LinkEndChild(&pElem);
+    }
+}
+
+KnxConnection* Services::getKnxConnection(eibaddr_t gad)
+{
+    KnxConnectionList_t::iterator it;
+    for (it = connections_m.begin(); it != connections_m.end(); it++)
+    {
+        if ((*it)->routes(gad))
+            return (*it);
+    }
+    return &knxConnection_m;
+}
+
+KnxConnection* Services::getKnxConnection(const std::string& id)
+{
+    KnxConnectionList_t::iterator it;
+    for (it = connections_m.begin(); it != connections_m.end(); it++)
+    {
+        if ((*it)->getID() == id)
+            return (*it);
+    }
+    return 0;
+}
+
+void Services::addTelegramListener(TelegramListener *listener)
+{
+    if (telegramListener_m)
+        throw ticpp::Exception("Services: TelegramListener already registered");
+    telegramListener_m = listener;
+    listen(&knxConnection_m);
+    KnxConnectionList_t::iterator it;
+    for (it = connections_m.begin(); it != connections_m.end(); it++)
+        listen(*it);
+}
+
+void Services::listen(KnxConnection* connection)
+{
+    if (!telegramListener_m)
+        return;
+    LineListener* listener = new LineListener(connection, telegramListener_m);
+    connection->addTelegramListener(listener);
+    lineListeners_m[connection] = listener;
+}
+
+void Services::unlisten(KnxConnection* connection)
+{
+    LineListenerMap_t::iterator it = lineListeners_m.find(connection);
+    if (it == lineListeners_m.end())
+        return;
+    connection->removeTelegramListener(it->second);
+    delete it->second;
+    lineListeners_m.erase(it);
+}
+
+void Services::LineListener::onWrite(eibaddr_t src, eibaddr_t dest, const uint8_t* buf, int len)
+{
+    listener_m->onWrite(src, dest, buf, len);
+}
+
+void Services::LineListener::onRead(eibaddr_t src, eibaddr_t dest, const uint8_t* buf, int len)
+{
+    listener_m->onRead(src, dest, buf, len);
+}
+
+void Services::LineListener::onResponse(eibaddr_t src, eibaddr_t dest, const uint8_t* buf, int len)
+{
+    // Responses to reads sent on this line are always accepted, others
+    // only if the line routes their address (the same response is usually
+    // seen on every line sharing the group address)
+    if (!connection_m->isReadPending(dest) && Services::instance()->getKnxConnection(dest) != connection_m)
+    {
+        debugStream("Services") << "Ignoring response to " << Object::WriteGroupAddr(dest)
+            << " received on connection '" << connection_m->getID() << "'" << endlog;
+        return;
+    }
+    listener_m->onResponse(src, dest, buf, len);
+}
+
+bool Services::LineListener::canCoalesce(eibaddr_t dest)
+{
+    return listener_m->canCoalesce(dest);
 }
 
 void Services::createDefault()
@@ -79,7 +187,51 @@ void Services::importXml(ticpp::Element* pConfig)
     }
     ticpp::Element* pKnxConnection = pConfig->FirstChildElement("knxconnection", false);
     if (pKnxConnection)
+    {
         knxConnection_m.importXml(pKnxConnection);
+        ticpp::Iterator< ticpp::Element > child("connection");
+        for ( child = pKnxConnection->FirstChildElement("connection", false); child != child.end(); child++ )
+        {
+            std::string id = child->GetAttribute("id");
+            if (id == "")
+                throw ticpp::Exception("Missing or empty connection ID");
+            bool del = child->GetAttribute("delete") == "true";
+            KnxConnectionList_t::iterator it;
+            for (it = connections_m.begin(); it != connections_m.end(); it++)
+            {
+                if ((*it)->getID() == id)
+                    break;
+            }
+            if (it == connections_m.end())
+            {
+                if (del)
+                    throw ticpp::Exception("Connection not found");
+                KnxConnection* connection = new KnxConnection();
+                try
+                {
+                    connection->importXml(&(*child));
+                }
+                catch( ticpp::Exception& ex )
+                {
+                    delete connection;
+                    throw;
+                }
+                listen(connection);
+                connections_m.push_back(connection);
+                if (isRunning_m)
+                    connection->startConnection();
+            }
+            else if (del)
+            {
+                (*it)->stopConnection();
+                unlisten(*it);
+                delete (*it);
+                connections_m.erase(it);
+            }
+            else
+                (*it)->importXml(&(*child));
+        }
+    }
     ticpp::Element* pExceptionDays = pConfig->FirstChildElement("exceptiondays", false);
     if (pExceptionDays)
         exceptionDays_m.importXml(pExceptionDays);
@@ -117,6 +269,13 @@ void Services::exportXml(ticpp::Element* pConfig)
 
     ticpp::Element pKnxConnection("knxconnection");
     knxConnection_m.exportXml(&pKnxConnection);
+    KnxConnectionList_t::iterator it;
+    for (it = connections_m.begin(); it != connections_m.end(); it++)
+    {
+        ticpp::Element pElem("connection");
+        (*it)->exportXml(&pElem);
+        pKnxConnection.LinkEndChild(&pElem);
+    }
     pConfig->LinkEndChild(&pKnxConnection);
 
     ticpp::Element pExceptionDays("exceptiondays");
@@ -22,6 +22,8 @@
 
 #include "config.h"
 #include <string>
+#include <vector>
+#include <map>
 #include "ticpp.h"
 #include "timermanager.h"
 #include "xmlserver.h"
@@ -48,7 +50,15 @@ public:
 
     void start();
     void stop();
+    void statusXml(ticpp::Element* pStatus);
     KnxConnection* getKnxConnection() { return &knxConnection_m; };
+    // Returns the connection whose routes cover 'gad', or the main one
+    KnxConnection* getKnxConnection(eibaddr_t gad);
+    KnxConnection* getKnxConnection(const std::string& id);
+    // Registers 'listener' on all connections, including ones added later.
+    // Responses are only delivered from the connection that routes their
+    // group address or that a read request for it was sent on.
+    void addTelegramListener(TelegramListener *listener);
     SmsGateway* getSmsGateway() { return &smsGateway_m; };
     EmailGateway* getEmailGateway() { return &emailGateway_m; };
     TimerManager* getTimerManager() { return &timers_m; };
@@ -63,6 +73,26 @@ private:
     Services();
     ~Services();
 
+    // Forwards the telegrams received by one connection to the listener
+    // registered with addTelegramListener()
+    class LineListener : public TelegramListener
+    {
+    public:
+        LineListener(KnxConnection* connection, TelegramListener* listener)
+            : connection_m(connection), listener_m(listener) {};
+        virtual void onWrite(eibaddr_t src, eibaddr_t dest, const uint8_t* buf, int len);
+        virtual void onRead(eibaddr_t src, eibaddr_t dest, const uint8_t* buf, int len);
+        virtual void onResponse(eibaddr_t src, eibaddr_t dest, const uint8_t* buf, int len);
+        virtual bool canCoalesce(eibaddr_t dest);
+    private:
+        KnxConnection* connection_m;
+        TelegramListener* listener_m;
+    };
+    typedef std::map<KnxConnection*, LineListener*> LineListenerMap_t;
+
+    void listen(KnxConnection* connection);
+    void unlisten(KnxConnection* connection);
+
     static Services* instance_m;
 
     XmlServer *xmlServer_m;
@@ -71,6 +101,12 @@ private:
     SmsGateway smsGateway_m;
     EmailGateway emailGateway_m;
     KnxConnection knxConnection_m;
+    // Additional connections defined with <connection> inside <knxconnection>
+    typedef std::vector<KnxConnection*> KnxConnectionList_t;
+    KnxConnectionList_t connections_m;
+    TelegramListener *telegramListener_m;
+    LineListenerMap_t lineListeners_m;
+    bool isRunning_m;
     ExceptionDays exceptionDays_m;
     LocationInfo locationInfo_m;
     
@@ -502,13 +502,11 @@ void SolarTimeSpec::getTime(int mday, int mon, int year, int &min, int &hour) co
 	TimeSpec::getTime(mday, mon, year, min, hour);
 
     LocationInfo* params = Services::instance()->getLocationInfo();
-    double lon, lat;
-    params->getCoord(&lon, &lat);
 
 	// Get sunrise/sunset in GMT.
-    logger_m.infoStream() << "sun_rise_set date " << year+1900<< "-" << mon+1 << "-" << mday << endlog;
+    logger_m.debugStream() << "sun_rise_set date " << year+1900<< "-" << mon+1 << "-" << mday << endlog;
     double rise, set;
-    int rs = suncalc::sun_rise_set( year+1900, mon+1, mday, lon, lat, &rise, &set );
+    int rs = params->getSunRiseSet( year, mon, mday, &rise, &set );
 
     if (rs == 0)
     {
@@ -547,12 +545,10 @@ Logger& SolarInfo::logger_m(Logger::getInstance("SolarInfo"));
 SolarInfo::SolarInfo(struct tm * timeinfo) : rs_m(0), year_m(timeinfo->tm_year), mon_m(timeinfo->tm_mon), mday_m(timeinfo->tm_mday)
 {
     LocationInfo* params = Services::instance()->getLocationInfo();
-    double lon, lat;
-    params->getCoord(&lon, &lat);
     tz_offset_m = params->getGmtOffset();
 
     logger_m.infoStream() << "SolarInfo date " << year_m+1900<< "-" <<mon_m+1 << "-" << mday_m << endlog;
-    rs_m  = suncalc::sun_rise_set( year_m+1900, mon_m+1, mday_m, lon, lat, &rise_m, &set_m );
+    rs_m  = params->getSunRiseSet( year_m, mon_m, mday_m, &rise_m, &set_m );
 }
 
 SolarInfo::~SolarInfo() {};
@@ -611,6 +607,49 @@ void LocationInfo::importXml(ticpp::Element* pConfig)
 {
     pConfig->GetAttributeOrDefault("lon", &lon_m, 0);
     pConfig->GetAttributeOrDefault("lat", &lat_m, 0);
+    clearEphemeris();
+}
+
+void LocationInfo::setCoord(double lon, double lat)
+{
+    lon_m = lon;
+    lat_m = lat;
+    clearEphemeris();
+}
+
+void LocationInfo::clearEphemeris()
+{
+    ephemeris_m.clear();
+    PeriodicTask::clearOccurrenceCache();
+}
+
+int LocationInfo::getSunRiseSet(int year, int mon, int mday, double *rise, double *set)
+{
+    // Dates that are not normalized are not worth a table entry
+    if (mon < 0 || mon > 11 || mday < 1 || mday > 31)
+        return computeSunRiseSet( year, mon, mday, lon_m, lat_m, rise, set );
+
+    Ephemeris_t::iterator it = ephemeris_m.find(year);
+    if (it == ephemeris_m.end())
+    {
+        if (ephemeris_m.size() >= MaxEphemerisYears)
+            ephemeris_m.clear();
+        it = ephemeris_m.insert(Ephemeris_t::value_type(year, std::vector<SunTimes>(12*31))).first;
+    }
+    SunTimes& day = it->second[mon*31 + mday-1];
+    if (!day.computed)
+    {
+        day.rs = computeSunRiseSet( year, mon, mday, lon_m, lat_m, &day.rise, &day.set );
+        day.computed = true;
+    }
+    *rise = day.rise;
+    *set = day.set;
+    return day.rs;
+}
+
+int LocationInfo::computeSunRiseSet(int year, int mon, int mday, double lon, double lat, double *rise, double *set)
+{
+    return suncalc::sun_rise_set( year+1900, mon+1, mday, lon, lat, rise, set );
 }
 
 void LocationInfo::exportXml(ticpp::Element* pConfig)
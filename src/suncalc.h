@@ -21,6 +21,8 @@
 #define SUNCALC_H
 
 #include <list>
+#include <map>
+#include <vector>
 #include <string>
 #include "config.h"
 #include "logger.h"
@@ -102,13 +104,35 @@ public:
     void importXml(ticpp::Element* pConfig);
     void exportXml(ticpp::Element* pConfig);
     void getCoord(double *lon, double *lat) { *lon = lon_m; *lat = lat_m; };
-    void setCoord(double lon, double lat) { lon_m = lon; lat_m = lat; };
+    void setCoord(double lon, double lat);
     long getGmtOffset();
     bool isEmpty() { return lon_m==0 && lat_m==0; };
 
+    /** Sunrise and sunset in hours UT at this location for a date given
+     * with tm conventions. Returns 0 on success, +1 or -1 if the sun stays
+     * above or below the horizon, like suncalc's sun_rise_set. */
+    int getSunRiseSet(int year, int mon, int mday, double *rise, double *set);
+    /** Same as getSunRiseSet() for any location, without caching. */
+    static int computeSunRiseSet(int year, int mon, int mday, double lon, double lat, double *rise, double *set);
+
 protected:
+    void clearEphemeris();
+
     double lon_m, lat_m;
     long gmtOffset_m;
+
+    /** Sunrise and sunset of a day, computed on first use. */
+    struct SunTimes
+    {
+        SunTimes() : computed(false), rs(0), rise(0), set(0) {};
+        bool computed;
+        int rs;
+        double rise, set;
+    };
+    /** Per year tables indexed by mon*31 + mday-1. */
+    typedef std::map<int, std::vector<SunTimes> > Ephemeris_t;
+    Ephemeris_t ephemeris_m;
+    static const unsigned int MaxEphemerisYears = 4;
 };
 
 #endif
@@ -23,6 +23,8 @@
 #include <iostream>
 #include <ctime>
 #include <iomanip>
+#include <algorithm>
+#include <sys/time.h>
 
 Logger& TimerManager::logger_m(Logger::getInstance("TimerManager"));
 
@@ -278,38 +280,56 @@ void DateTime::resetFieldIfFree(FieldType field, bool recurses)
 	}
 }
 
-TimerManager::TimerManager()
-{}
+TimerManager::TimerManager() : nextSeq_m(0), running_m(0)
+{
+    pth_sem_init(&headChanged_m);
+}
 
 TimerManager::~TimerManager()
 {
     StopDelete ();
+    TaskHeap_t::iterator it;
+    for (it = taskHeap_m.begin(); it != taskHeap_m.end(); it++)
+        (*it).task->heapIndex_m = -1;
 }
 
-TimerManager::TimerCheck TimerManager::checkTaskList(time_t now)
+TimeMs_t TimerManager::currentTime()
 {
-    if (taskList_m.empty())
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+TimerManager::TimerCheck TimerManager::checkTaskListMs(TimeMs_t now)
+{
+    if (taskHeap_m.empty())
         return Long;
 
-    TimerTask* first = taskList_m.front();
-    time_t nextExec = first->getExecTime();
-    if (nextExec > now)
+    TaskEntry first = taskHeap_m.front();
+    if (first.execTime > now)
         return Short;
     
-    if (nextExec > now-60)
+    running_m = first.task;
+    if (first.execTime > now-60000)
     {
-        logger_m.infoStream() << "TimerTask execution. " << nextExec << endlog;
-        first->onTimer(now);
+        logger_m.infoStream() << "TimerTask execution. " << first.execTime << endlog;
+        first.task->onTimer(now / 1000);
     }
     else
-        logger_m.warnStream() << "TimerTask skipped due to clock skew or heavy load. " << nextExec << endlog;
+        logger_m.warnStream() << "TimerTask skipped due to clock skew or heavy load. " << first.execTime << endlog;
     
-    if (first == taskList_m.front())
+    // If onTimer removed or rescheduled the task, the entry we just ran
+    // is already gone and must not be removed again. running_m is cleared
+    // by removeTask so that a deleted task is never dereferenced here.
+    if (running_m)
     {
-        // If the taskList was modified, do not remove the first item
-        // because it's not the one we just called onTimer for.
-        taskList_m.pop_front();
-        first->reschedule(now);
+        int index = running_m->heapIndex_m;
+        running_m = 0;
+        if (index >= 0 && taskHeap_m[index].seq == first.seq)
+        {
+            removeAt(index);
+            first.task->rescheduleMs(now);
+        }
     }
     return Immediate;
 }
@@ -317,49 +337,139 @@ TimerManager::TimerCheck TimerManager::checkTaskList(time_t now)
 void TimerManager::Run (pth_sem_t * stop1)
 {
     pth_event_t stop = pth_event (PTH_EVENT_SEM, stop1);
+    pth_event_t changed = pth_event (PTH_EVENT_SEM|PTH_UNTIL_DECREMENT, &headChanged_m);
+    pth_event_concat (stop, changed, NULL);
     logger_m.debugStream() << "Starting TimerManager loop." << endlog;
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = 0;
     while (pth_event_status (stop) != PTH_STATUS_OCCURRED)
     {
-        TimerCheck interval = checkTaskList(time(0));
+        // The head is checked below, so wakeups posted by addTask since
+        // the last iteration are all handled at once
+        pth_sem_set_value(&headChanged_m, 0);
+        TimerCheck interval = checkTaskListMs(currentTime());
         if (interval == Immediate)
-            tv.tv_sec = 0;
-        else if (interval == Short)
-            tv.tv_sec = 1;
+            pth_yield(NULL);
+        else if (interval == Long)
+            pth_wait (stop);
         else
-            tv.tv_sec = 10;
-        pth_select_ev(0,0,0,0,&tv,stop);
+        {
+            // Sleep until the first task is due or until addTask puts
+            // another task in front of it
+            pth_event_t tmout = pth_event (PTH_EVENT_TIME, pth_time(taskHeap_m.front().execTime / 1000, (taskHeap_m.front().execTime % 1000) * 1000));
+            pth_event_concat (stop, tmout, NULL);
+            pth_wait (stop);
+            pth_event_isolate (tmout);
+            pth_event_free (tmout, PTH_FREE_THIS);
+        }
     }
     logger_m.debugStream() << "Out of TimerManager loop." << endlog;
+    pth_event_isolate (changed);
+    pth_event_free (changed, PTH_FREE_THIS);
     pth_event_free (stop, PTH_FREE_THIS);
 }
 
 void TimerManager::addTask(TimerTask* task)
 {
-    TaskList_t::iterator it;
-    time_t execTime = task->getExecTime();
-    for (it = taskList_m.begin(); it != taskList_m.end(); it++)
+    TaskEntry entry;
+    entry.execTime = task->getExecTimeMs();
+    entry.seq = nextSeq_m++;
+    entry.task = task;
+
+    int index = task->heapIndex_m;
+    if (index >= 0 && index < (int)taskHeap_m.size() && taskHeap_m[index].task == task)
     {
-        if (execTime < (*it)->getExecTime())
-            break;
+        // Already scheduled, move the existing entry to its new position
+        place(index, entry);
+        siftUp(index);
+        siftDown(task->heapIndex_m);
+    }
+    else
+    {
+        taskHeap_m.push_back(entry);
+        task->heapIndex_m = taskHeap_m.size() - 1;
+        siftUp(task->heapIndex_m);
     }
-    taskList_m.insert(it, task);
+    // Wake up the manager loop if it is waiting for a later deadline
+    if (task->heapIndex_m == 0)
+        pth_sem_inc(&headChanged_m, FALSE);
 }
 
 void TimerManager::removeTask(TimerTask* task)
 {
-    taskList_m.remove(task);
+    if (task == running_m)
+        running_m = 0;
+    int index = task->heapIndex_m;
+    if (index < 0 || index >= (int)taskHeap_m.size() || taskHeap_m[index].task != task)
+        return;
+    removeAt(index);
+}
+
+void TimerManager::place(int index, const TaskEntry& entry)
+{
+    taskHeap_m[index] = entry;
+    entry.task->heapIndex_m = index;
+}
+
+void TimerManager::siftUp(int index)
+{
+    TaskEntry entry = taskHeap_m[index];
+    while (index > 0)
+    {
+        int parent = (index - 1) / 2;
+        if (!(entry < taskHeap_m[parent]))
+            break;
+        place(index, taskHeap_m[parent]);
+        index = parent;
+    }
+    place(index, entry);
+}
+
+void TimerManager::siftDown(int index)
+{
+    int size = taskHeap_m.size();
+    TaskEntry entry = taskHeap_m[index];
+    while (true)
+    {
+        int child = 2 * index + 1;
+        if (child >= size)
+            break;
+        if (child + 1 < size && taskHeap_m[child + 1] < taskHeap_m[child])
+            child++;
+        if (!(taskHeap_m[child] < entry))
+            break;
+        place(index, taskHeap_m[child]);
+        index = child;
+    }
+    place(index, entry);
+}
+
+void TimerManager::removeAt(int index)
+{
+    TimerTask* task = taskHeap_m[index].task;
+    int last = taskHeap_m.size() - 1;
+    if (index != last)
+    {
+        // Fill the hole with the last entry and restore the heap order
+        TimerTask* moved = taskHeap_m[last].task;
+        place(index, taskHeap_m[last]);
+        taskHeap_m.pop_back();
+        siftUp(index);
+        siftDown(moved->heapIndex_m);
+    }
+    else
+        taskHeap_m.pop_back();
+    task->heapIndex_m = -1;
 }
 
 void TimerManager::statusXml(ticpp::Element* pStatus)
 {
-    TaskList_t::iterator it;
-    for (it = taskList_m.begin(); it != taskList_m.end(); it++)
+    // The heap is only partially ordered, report tasks by execution time
+    TaskHeap_t tasks(taskHeap_m);
+    std::sort(tasks.begin(), tasks.end());
+    TaskHeap_t::iterator it;
+    for (it = tasks.begin(); it != tasks.end(); it++)
     {
         ticpp::Element pElem("task");
-        (*it)->statusXml(&pElem);
+        (*it).task->statusXml(&pElem);
         pStatus->LinkEndChild(&pElem);
     }
 }
@@ -472,6 +582,11 @@ bool TimeSpec::isValid() const
 	return true;
 }
 
+TimeSpec::~TimeSpec()
+{
+    changed();
+}
+
 void TimeSpec::importXml(ticpp::Element* pConfig)
 {
     pConfig->GetAttributeOrDefault("year", &(year_m), -1);
@@ -513,6 +628,7 @@ void TimeSpec::importXml(ticpp::Element* pConfig)
     offset_m = RuleServer::parseDuration(pConfig->GetAttribute("offset"), true);
 
 	checkIsValid();
+    changed();
 
     infoStream("TimeSpec")
     << year_m+1900 << "-"
@@ -574,6 +690,11 @@ void TimeSpec::getDay(const tm &current, int &mday, int &mon, int &year, int &wd
 	wdays = wdays_m;
 }
 
+void TimeSpec::changed() const
+{
+    PeriodicTask::clearOccurrenceCache(this);
+}
+
 void TimeSpec::getTime(int mday, int mon, int year, int &min, int &hour) const
 {
 	min = min_m;
@@ -695,6 +816,7 @@ void VariableTimeSpec::getDataFromObject(int &min, int &hour, int &mday, int &mo
 }
 
 Logger& PeriodicTask::logger_m(Logger::getInstance("PeriodicTask"));
+PeriodicTask::OccurrenceCache_t PeriodicTask::occurrenceCache_m;
 
 PeriodicTask::PeriodicTask(ChangeListener* cl)
         : at_m(0), until_m(0), during_m(0), after_m(-1), nextExecTime_m(0), cl_m(cl), value_m(false)
@@ -729,27 +851,34 @@ void PeriodicTask::onChange(Object* object)
 }
 
 void PeriodicTask::reschedule(time_t now)
+{
+    rescheduleMs(now * 1000LL);
+}
+
+void PeriodicTask::rescheduleMs(TimeMs_t now)
 {
     if (now == 0)
-        now = time(0);
+        now = TimerManager::currentTime();
+    // TimeSpecs have a resolution of one second
+    time_t nowSec = now / 1000;
     if (nextExecTime_m == 0 && during_m != 0)
     {
         // first schedule. check if value must be on or off (except if timer is instantaneous)
-        time_t start, stop;
+        TimeMs_t start, stop;
         if (during_m != -1)
         {
             if (after_m == -1)
-                stop = findNext(now-during_m, at_m)+during_m;
+                stop = findNextCached((now-during_m) / 1000, at_m)*1000LL+during_m;
             else
                 stop = now + during_m;
         }
         else
-            stop = findNext(now, until_m);
+            stop = findNextCached(nowSec, until_m)*1000LL;
 
         if (after_m != -1)
             start = now + after_m;
         else
-            start = findNext(now, at_m);
+            start = findNextCached(nowSec, at_m)*1000LL;
 
         if (stop < start)
         {
@@ -767,20 +896,21 @@ void PeriodicTask::reschedule(time_t now)
         if (during_m != -1)
             nextExecTime_m = now + during_m;
         else
-            nextExecTime_m = findNext(now, until_m);
+            nextExecTime_m = findNextCached(nowSec, until_m)*1000LL;
     }
     else
     {
         if (after_m != -1)
             nextExecTime_m = now + after_m;
         else
-            nextExecTime_m = findNext(now, at_m);
+            nextExecTime_m = findNextCached(nowSec, at_m)*1000LL;
 
     }
     if (nextExecTime_m != 0)
     {
         struct tm timeinfo;
-        memcpy(&timeinfo, localtime(&nextExecTime_m), sizeof(struct tm));
+        time_t execTime = nextExecTime_m / 1000;
+        memcpy(&timeinfo, localtime(&execTime), sizeof(struct tm));
         logger_m.infoStream() << "Rescheduled at "
         << timeinfo.tm_year + 1900 << "-"
         << timeinfo.tm_mon + 1 << "-"
@@ -790,8 +920,10 @@ void PeriodicTask::reschedule(time_t now)
         << std::setfill('0') << std::setw(2)
         << timeinfo.tm_min << ":"
         << std::setfill('0') << std::setw(2)
-        << timeinfo.tm_sec << " ("
-        << nextExecTime_m << ")" << endlog;
+        << timeinfo.tm_sec << "."
+        << std::setfill('0') << std::setw(3)
+        << nextExecTime_m % 1000 << " ("
+        << execTime << ")" << endlog;
         Services::instance()->getTimerManager()->addTask(this);
     }
     else
@@ -824,6 +956,52 @@ time_t PeriodicTask::mktimeNoDst(struct tm * timeinfo)
     return ret;
 }
 
+time_t PeriodicTask::findNextCached(time_t start, TimeSpec* next)
+{
+    if (!next || !next->isValid() || !next->isCacheable())
+        return findNext(start, next);
+
+    // Specs remove their entry when modified or deleted, so the cache never
+    // holds more entries than there are live specs
+    Occurrences& cached = occurrenceCache_m[next];
+    if (!cached.next.empty() && start >= cached.from)
+    {
+        if (start < cached.next.back())
+            return *std::upper_bound(cached.next.begin(), cached.next.end(), start);
+        if (start == cached.next.back())
+        {
+            // Chained call from the last occurrence, as when the task is
+            // rescheduled: only that one is computed and appended
+            time_t occurrence = findNext(start, next);
+            if (occurrence == 0)
+                return 0;
+            cached.next.push_back(occurrence);
+            if (cached.next.size() > Lookahead)
+            {
+                cached.from = cached.next.front();
+                cached.next.erase(cached.next.begin());
+            }
+            return occurrence;
+        }
+    }
+
+    time_t first = findNext(start, next);
+    if (first != 0 && !cached.next.empty() && start < cached.from && first == cached.next.front())
+    {
+        // Nothing between start and the cached occurrences, extend them
+        cached.from = start;
+        return first;
+    }
+
+    // A miss costs a single computation, more occurrences are only added
+    // by the chained calls above
+    cached.from = start;
+    cached.next.clear();
+    if (first != 0)
+        cached.next.push_back(first);
+    return first;
+}
+
 time_t PeriodicTask::findNext(time_t start, TimeSpec* next)
 {
     struct tm timeinfostruct;
@@ -910,7 +1088,8 @@ time_t PeriodicTask::findNext(time_t start, TimeSpec* next)
     TimeSpec::ExceptionDays exception = next->getExceptions();
     if (exception != TimeSpec::DontCare)
     {
-        bool isException = Services::instance()->getExceptionDays()->isException(nextExecTime);
+        // timeinfo has been normalized by target.getTime()
+        bool isException = Services::instance()->getExceptionDays()->isException(timeinfo->tm_mday, timeinfo->tm_mon, timeinfo->tm_year);
         if (isException && exception == TimeSpec::No || !isException && exception == TimeSpec::Yes)
         {
             logger_m.debugStream() << "Calling findNext recursively! (" << nextExecTime << ")" << endlog;
@@ -950,7 +1129,8 @@ void PeriodicTask::statusXml(ticpp::Element* pStatus)
 {
     struct tm timeinfo;
     std::stringstream execTime;
-    memcpy(&timeinfo, localtime(&nextExecTime_m), sizeof(struct tm));
+    time_t nextExecTime = nextExecTime_m / 1000;
+    memcpy(&timeinfo, localtime(&nextExecTime), sizeof(struct tm));
     execTime << timeinfo.tm_year + 1900 << "-"
     << timeinfo.tm_mon + 1 << "-"
     << timeinfo.tm_mday << " "
@@ -976,13 +1156,19 @@ FixedTimeTask::~FixedTimeTask()
 }
 
 void FixedTimeTask::reschedule(time_t now)
+{
+    rescheduleMs(now * 1000LL);
+}
+
+void FixedTimeTask::rescheduleMs(TimeMs_t now)
 {
     if (now == 0)
-        now = time(0);
+        now = TimerManager::currentTime();
     if (execTime_m > now)
     {
         struct tm timeinfo;
-        memcpy(&timeinfo, localtime(&execTime_m), sizeof(struct tm));
+        time_t execTime = execTime_m / 1000;
+        memcpy(&timeinfo, localtime(&execTime), sizeof(struct tm));
         logger_m.infoStream() << "Rescheduled at "
         << timeinfo.tm_year + 1900 << "-"
         << timeinfo.tm_mon + 1 << "-"
@@ -992,8 +1178,10 @@ void FixedTimeTask::reschedule(time_t now)
         << std::setfill('0') << std::setw(2)
         << timeinfo.tm_min << ":"
         << std::setfill('0') << std::setw(2)
-        << timeinfo.tm_sec << " ("
-        << execTime_m << ")" << endlog;
+        << timeinfo.tm_sec << "."
+        << std::setfill('0') << std::setw(3)
+        << execTime_m % 1000 << " ("
+        << execTime << ")" << endlog;
         Services::instance()->getTimerManager()->addTask(this);
     }
     else
@@ -1004,7 +1192,8 @@ void FixedTimeTask::statusXml(ticpp::Element* pStatus)
 {
     struct tm timeinfo;
     std::stringstream execTime;
-    memcpy(&timeinfo, localtime(&execTime_m), sizeof(struct tm));
+    time_t nextExecTime = execTime_m / 1000;
+    memcpy(&timeinfo, localtime(&nextExecTime), sizeof(struct tm));
     execTime << timeinfo.tm_year + 1900 << "-"
     << timeinfo.tm_mon + 1 << "-"
     << timeinfo.tm_mday << " "
@@ -1045,7 +1234,9 @@ void DaySpec::exportXml(ticpp::Element* pConfig)
 
 
 ExceptionDays::ExceptionDays()
-{}
+{
+    rebuildIndex();
+}
 
 ExceptionDays::~ExceptionDays()
 {
@@ -1058,6 +1249,7 @@ void ExceptionDays::clear()
     for (it = daysList_m.begin(); it != daysList_m.end(); it++)
         delete (*it);
     daysList_m.clear();
+    rebuildIndex();
 }
 
 void ExceptionDays::importXml(ticpp::Element* pConfig)
@@ -1075,9 +1267,11 @@ void ExceptionDays::importXml(ticpp::Element* pConfig)
         }
         else
         {
+            rebuildIndex();
             throw ticpp::Exception("Invalid element inside 'exceptiondays' section");
         }
     }
+    rebuildIndex();
 }
 
 void ExceptionDays::exportXml(ticpp::Element* pConfig)
@@ -1096,32 +1290,76 @@ bool ExceptionDays::isException(time_t time)
     struct tm timeinfo;
     memcpy(&timeinfo, localtime(&time), sizeof(struct tm));
 
+    bool ret = isException(timeinfo.tm_mday, timeinfo.tm_mon, timeinfo.tm_year);
+    if (ret)
+    {
+        debugStream("ExceptionDays")
+        << timeinfo.tm_year+1900 << "-"
+        << timeinfo.tm_mon+1 << "-"
+        << timeinfo.tm_mday << " is an exception day!" << endlog;
+    }
+    return ret;
+}
+
+bool ExceptionDays::isException(int mday, int mon, int year) const
+{
+    unsigned int days = (1u << mday) | 1u;
+    if ((everyYear_m[mon + 1] | everyYear_m[0]) & days)
+        return true;
+    if (yearDates_m.empty())
+        return false;
+    return yearDates_m.count(dateKey(mday, mon, year)) ||
+           yearDates_m.count(dateKey(-1, mon, year)) ||
+           yearDates_m.count(dateKey(mday, -1, year)) ||
+           yearDates_m.count(dateKey(-1, -1, year));
+}
+
+void ExceptionDays::isException(time_t start, int count, std::vector<bool>& result) const
+{
+    struct tm timeinfo;
+    memcpy(&timeinfo, localtime(&start), sizeof(struct tm));
+    // Noon is never skipped or repeated by DST changes
+    timeinfo.tm_hour = 12;
+    timeinfo.tm_min = 0;
+    timeinfo.tm_sec = 0;
+    timeinfo.tm_isdst = -1;
+
+    result.resize(count);
+    for (int i = 0; i < count; i++)
+    {
+        result[i] = isException(timeinfo.tm_mday, timeinfo.tm_mon, timeinfo.tm_year);
+        timeinfo.tm_mday++;
+        timeinfo.tm_isdst = -1;
+        mktime(&timeinfo);
+    }
+}
+
+void ExceptionDays::rebuildIndex()
+{
+    memset(everyYear_m, 0, sizeof(everyYear_m));
+    yearDates_m.clear();
     DaysList_t::iterator it;
     for (it = daysList_m.begin(); it != daysList_m.end(); it++)
     {
-        if (((*it)->year_m == -1 || (*it)->year_m == timeinfo.tm_year) &&
-                ((*it)->mon_m == -1 || (*it)->mon_m == timeinfo.tm_mon) &&
-                ((*it)->mday_m == -1 || (*it)->mday_m == timeinfo.tm_mday))
-        {
-            infoStream("ExceptionDays")
-            << timeinfo.tm_year+1900 << "-"
-            << timeinfo.tm_mon+1 << "-"
-            << timeinfo.tm_mday << " is an exception day!" << endlog;
-            return true;
-        }
+        DaySpec* day = *it;
+        if (day->mday_m < -1 || day->mday_m == 0 || day->mday_m > 31 || day->mon_m < -1 || day->mon_m > 11)
+            continue;
+        if (day->year_m == -1)
+            everyYear_m[day->mon_m + 1] |= 1u << (day->mday_m < 0 ? 0 : day->mday_m);
+        else
+            yearDates_m.insert(dateKey(day->mday_m, day->mon_m, day->year_m));
     }
-    return false;
+    PeriodicTask::clearOccurrenceCache();
 }
 
 void ExceptionDays::addDay(DaySpec* day)
 {
-    DaysList_t::iterator it;
-    for (it = daysList_m.begin(); it != daysList_m.end(); it++)
-    {}
-    daysList_m.insert(it, day);
+    daysList_m.push_back(day);
+    rebuildIndex();
 }
 
 void ExceptionDays::removeDay(DaySpec* day)
 {
     daysList_m.remove(day);
+    rebuildIndex();
 }
@@ -21,8 +21,11 @@
 #define TIMERMANAGER_H
 
 #include <list>
+#include <vector>
 #include <string>
 #include <map>
+#include <set>
+#include <sys/time.h>
 #include "config.h"
 #include "logger.h"
 #include "threads.h"
@@ -111,14 +114,45 @@ private:
 	int weekdays_m;
 };
 
+/** Milliseconds since the epoch, resolution of the timer deadlines. */
+typedef long long TimeMs_t;
+
+/** Returns true if a is earlier than b. */
+inline bool isBefore(const struct timeval& a, const struct timeval& b)
+{
+    return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_usec < b.tv_usec);
+}
+
+inline void addMilliseconds(struct timeval& time, int ms)
+{
+    time.tv_sec += ms / 1000;
+    time.tv_usec += (ms % 1000) * 1000;
+    if (time.tv_usec >= 1000000)
+    {
+        time.tv_sec++;
+        time.tv_usec -= 1000000;
+    }
+}
+
 class TimerTask
 {
 public:
+    TimerTask() : heapIndex_m(-1) {};
     virtual ~TimerTask() {};
     virtual void onTimer(time_t time) = 0;
     virtual void reschedule(time_t from = 0) = 0;
     virtual time_t getExecTime() = 0;
     virtual void statusXml(ticpp::Element* pStatus) = 0;
+
+    /** Tasks needing sub-second deadlines override these, the defaults
+     * work on whole seconds through the time_t interface. */
+    virtual void rescheduleMs(TimeMs_t from) { reschedule(from / 1000); };
+    virtual TimeMs_t getExecTimeMs() { return getExecTime() * 1000LL; };
+
+private:
+    friend class TimerManager;
+    /** Position of the task in the TimerManager heap, -1 if not scheduled. */
+    int heapIndex_m;
 };
 
 class TimeSpec
@@ -146,7 +180,7 @@ public:
     TimeSpec();
     TimeSpec(int min, int hour, int mday, int mon, int year, int offset=0);
     TimeSpec(int min, int hour, int wdays=All, ExceptionDays exception=DontCare);
-    virtual ~TimeSpec() {};
+    virtual ~TimeSpec();
 
     static TimeSpec* create(ticpp::Element* pConfig, ChangeListener* cl);
     static TimeSpec* create(const std::string& type, ChangeListener* cl);
@@ -156,22 +190,29 @@ public:
 
 	bool isValid() const;
 	int getDayOfMonth() const {return mday_m;}
-	void setDayOfMonth(int value) {mday_m = value;}
+	void setDayOfMonth(int value) {mday_m = value; changed();}
 	int getMonth() const {return mon_m + 1;}
-	void setMonth(int value) {mon_m = value - 1;}
+	void setMonth(int value) {mon_m = value - 1; changed();}
 	int getYear() const {return year_m + 1900;}
-	void setYear(int value) {year_m = value - 1900;}
+	void setYear(int value) {year_m = value - 1900; changed();}
 	int getHour() const {return hour_m;}
-	void setHour(int value) {hour_m = value;}
+	void setHour(int value) {hour_m = value; changed();}
 	int getMinute() const {return min_m;}
-	void setMinute(int value) {min_m = value;}
+	void setMinute(int value) {min_m = value; changed();}
 
     virtual void getDay(const tm &current, int &mday, int &mon, int &year, int &wdays) const;
     virtual void getTime(int mday, int mon, int year, int &min, int &hour) const;
+    /** Returns false if occurrences depend on something else than the
+     * fields of the spec and can't be cached. */
+    virtual bool isCacheable() const { return true; };
 	int getOffsetInSeconds() const { return offset_m; }
     ExceptionDays getExceptions() const { return exception_m; }
 	void checkIsValid() const;
 
+protected:
+    /** Drops the cached occurrences, must be called when a field changes. */
+    void changed() const;
+
 private:
     int min_m;
     int hour_m;
@@ -197,6 +238,7 @@ public:
 
     virtual void getDay(const tm &current, int &mday, int &mon, int &year, int &wdays) const;
     virtual void getTime(int mday, int mon, int year, int &min, int &hour) const;
+    virtual bool isCacheable() const { return false; };
 
 private:
 	void getDataFromObject(int &min, int &hour, int &mday, int &mon, int &year, int &wdays) const;
@@ -214,27 +256,53 @@ public:
 
     virtual void onTimer(time_t time);
     virtual void reschedule(time_t from);
-    virtual time_t getExecTime() { return nextExecTime_m; };
+    virtual time_t getExecTime() { return nextExecTime_m / 1000; };
+    virtual void rescheduleMs(TimeMs_t from);
+    virtual TimeMs_t getExecTimeMs() { return nextExecTime_m; };
     virtual void statusXml(ticpp::Element* pStatus);
 
     void setAt(TimeSpec* at) { at_m = at; };
     void setUntil(TimeSpec* until) { until_m = until; };
-    void setDuring(int during) { during_m = during; };
+    /** Duration in milliseconds, -1 when the task runs until a TimeSpec. */
+    void setDuring(TimeMs_t during) { during_m = during; };
     virtual void onChange(Object* object);
 
 protected:
     TimeSpec *at_m, *until_m;
-    int during_m, after_m;
-    time_t nextExecTime_m;
+    /** Durations in milliseconds, -1 when replaced by a TimeSpec. */
+    TimeMs_t during_m, after_m;
+    TimeMs_t nextExecTime_m;
     ChangeListener* cl_m;
     bool value_m;
 
     time_t findNext(time_t start, TimeSpec* next);
+    time_t findNextCached(time_t start, TimeSpec* next);
     time_t mktimeNoDst(struct tm * timeinfo);
     static Logger& logger_m;
 
+public:
+    /** Must be called when something that findNext depends on, other
+     * than the TimeSpec itself, is modified. */
+    static void clearOccurrenceCache() { occurrenceCache_m.clear(); };
+    /** Drops the cached occurrences of one spec. */
+    static void clearOccurrenceCache(const TimeSpec* spec) { occurrenceCache_m.erase(spec); };
+
 private:
 	time_t goToNextDayAndFindNext(const DateTime &curent, TimeSpec *next);
+
+    /** Consecutive occurrences of a TimeSpec after a start time: there is
+     * no occurrence between from and next[0], nor between two items. */
+    struct Occurrences
+    {
+        time_t from;
+        std::vector<time_t> next;
+    };
+    /** Indexed by spec, entries are dropped when the spec changes or is
+     * deleted. */
+    typedef std::map<const TimeSpec*, Occurrences> OccurrenceCache_t;
+    static OccurrenceCache_t occurrenceCache_m;
+    /** Max number of occurrences kept per spec. */
+    static const unsigned int Lookahead = 8;
 };
 
 class FixedTimeTask : public TimerTask
@@ -245,11 +313,14 @@ public:
 
     virtual void onTimer(time_t time) = 0;
     virtual void reschedule(time_t from);
-    virtual time_t getExecTime() { return execTime_m; };
+    virtual time_t getExecTime() { return execTime_m / 1000; };
+    virtual void rescheduleMs(TimeMs_t from);
+    virtual TimeMs_t getExecTimeMs() { return execTime_m; };
     virtual void statusXml(ticpp::Element* pStatus);
 
 protected:
-    time_t execTime_m;
+    /** Execution time in milliseconds since the epoch. */
+    TimeMs_t execTime_m;
     static Logger& logger_m;
 };
 
@@ -266,7 +337,8 @@ public:
     TimerManager();
     virtual ~TimerManager();
 
-    TimerCheck checkTaskList(time_t now);
+    TimerCheck checkTaskList(time_t now) { return checkTaskListMs(now * 1000LL); };
+    TimerCheck checkTaskListMs(TimeMs_t now);
 
     void addTask(TimerTask* task);
     void removeTask(TimerTask* task);
@@ -276,11 +348,38 @@ public:
 
     virtual void statusXml(ticpp::Element* pStatus);
 
+    static TimeMs_t currentTime();
+
 private:
     void Run (pth_sem_t * stop);
 
-    typedef std::list<TimerTask*> TaskList_t;
-    TaskList_t taskList_m;
+    /** Heap entry. The execution time is copied when the task is added so
+     * that a task changing its own time before calling removeTask() cannot
+     * break the heap order. The sequence number keeps tasks with the same
+     * execution time in insertion order. */
+    struct TaskEntry
+    {
+        TimeMs_t execTime;
+        unsigned long seq;
+        TimerTask* task;
+
+        bool operator<(const TaskEntry& other) const
+        {
+            return execTime < other.execTime || (execTime == other.execTime && seq < other.seq);
+        };
+    };
+
+    void place(int index, const TaskEntry& entry);
+    void siftUp(int index);
+    void siftDown(int index);
+    void removeAt(int index);
+
+    typedef std::vector<TaskEntry> TaskHeap_t;
+    TaskHeap_t taskHeap_m;
+    unsigned long nextSeq_m;
+    TimerTask* running_m;
+    /** Signalled when a task becomes the first one to execute. */
+    pth_sem_t headChanged_m;
     static Logger& logger_m;
 };
 
@@ -311,10 +410,26 @@ public:
     void exportXml(ticpp::Element* pConfig);
 
     bool isException(time_t time);
+    /** Same as above for a broken-down date, with tm field conventions. */
+    bool isException(int mday, int mon, int year) const;
+    /** Checks count consecutive days starting with the day of start and
+     * sets result[i] to true if the i-th day is an exception day. */
+    void isException(time_t start, int count, std::vector<bool>& result) const;
 
 private:
+    void rebuildIndex();
+    static int dateKey(int mday, int mon, int year) { return (year * 13 + mon + 1) * 32 + (mday < 0 ? 0 : mday); };
+
     typedef std::list<DaySpec*> DaysList_t;
     DaysList_t daysList_m;
+    /** Index of daysList_m for specs without a year: bit d of
+     * everyYear_m[mon+1] is set if day d of month mon is an exception,
+     * bit 0 for every day of the month and row 0 for every month. */
+    unsigned int everyYear_m[13];
+    /** Index of daysList_m for specs with a year, see dateKey().
+     * Lookups are O(log n) in the number of such specs; there is no
+     * hashed set in C++98. */
+    std::set<int> yearDates_m;
     static ExceptionDays* instance_m;
 };
 
@@ -24,12 +24,37 @@
 #include "xmlserver.h"
 #include <sys/un.h>
 #include <netinet/in.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <iostream>
+#include <algorithm>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 #include "ruleserver.h"
 #include "objectcontroller.h"
 #include "timermanager.h"
 #include "services.h"
 
+const int XmlServer::DefaultNotifyHighWater;
+const int XmlServer::DefaultSlowClientTimeout;
+
+XmlServer::XmlServer (bool eventLoop) : eventLoop_m(eventLoop),
+    notifyHighWater_m(DefaultNotifyHighWater), slowClientTimeout_m(DefaultSlowClientTimeout), epollFd_m(-1)
+{
+    pth_sem_init(&notifySem_m);
+    if (eventLoop_m)
+    {
+#ifdef HAVE_SYS_EPOLL_H
+        epollFd_m = epoll_create (MaxEvents);
+        if (epollFd_m == -1)
+            throw ticpp::Exception("XmlServer: Unable to create epoll instance");
+#else
+        throw ticpp::Exception("XmlServer: event-loop mode is not supported on this system");
+#endif
+    }
+}
+
 XmlServer::~XmlServer ()
 {
     Stop ();
@@ -37,11 +62,16 @@ XmlServer::~XmlServer ()
     for (it = connections_m.begin(); it != connections_m.end(); it++)
     {
         (*it)->RemoveServer();
-        (*it)->StopDelete();
+        if (eventLoop_m)
+            delete (*it);
+        else
+            (*it)->StopDelete();
     }
-    if (!connections_m.empty())
+    if (!eventLoop_m && !connections_m.empty())
         pth_sleep (1); // Wait some time to let client connections close
 
+    if (epollFd_m != -1)
+        close (epollFd_m);
     close (fd_m);
 }
 
@@ -49,22 +79,53 @@ bool
 XmlServer::deregister (ClientConnection * con)
 {
     connections_m.remove(con);
+    executing_m.remove(con);
+    notifying_m.remove(con);
+    writing_m.remove(con);
     return 1;
 }
 
+void XmlServer::notifyPending (ClientConnection *con)
+{
+    if (notifying_m.empty())
+        pth_sem_inc(&notifySem_m, FALSE);
+    notifying_m.push_back(con);
+}
+
+void XmlServer::watchWrite (ClientConnection *con, bool enable)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event ev;
+    memset (&ev, 0, sizeof (ev));
+    ev.events = enable ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    ev.data.ptr = con;
+    if (epoll_ctl (epollFd_m, EPOLL_CTL_MOD, con->getFd(), &ev) == -1)
+        errorStream("XmlServer") << "Unable to update watched events of client connection" << endlog;
+#endif
+    if (enable)
+        writing_m.push_back(con);
+    else
+        writing_m.remove(con);
+}
+
 XmlServer* XmlServer::create(ticpp::Element* pConfig)
 {
     std::string type = pConfig->GetAttributeOrDefault("type", "inet");
+    bool eventLoop = pConfig->GetAttribute("event-loop") == "true";
+    int notifyHighWater, slowClientTimeout;
+    pConfig->GetAttributeOrDefault("notify-high-water", &notifyHighWater, DefaultNotifyHighWater);
+    pConfig->GetAttributeOrDefault("slow-client-timeout", &slowClientTimeout, DefaultSlowClientTimeout);
+    XmlServer* server;
     if (type == "inet")
     {
         int port = 0;
         pConfig->GetAttributeOrDefault("port", &port, 1028);
-        return new XmlInetServer(port);
+        server = new XmlInetServer(port, eventLoop);
     }
     else if (type == "unix")
     {
         std::string path = pConfig->GetAttributeOrDefault("path", "/tmp/xmlserver.sock");
-        return new XmlUnixServer(path.c_str());
+        server = new XmlUnixServer(path.c_str(), eventLoop);
     }
     else
     {
@@ -72,9 +133,22 @@ XmlServer* XmlServer::create(ticpp::Element* pConfig)
         msg << "XmlServer: server type not supported: '" << type << "'" << std::endl;
         throw ticpp::Exception(msg.str());
     }
+    server->notifyHighWater_m = notifyHighWater;
+    server->slowClientTimeout_m = slowClientTimeout;
+    return server;
 }
 
-XmlInetServer::XmlInetServer (int port)
+void XmlServer::exportOptions(ticpp::Element* pConfig)
+{
+    if (eventLoop_m)
+        pConfig->SetAttribute("event-loop", "true");
+    if (notifyHighWater_m != DefaultNotifyHighWater)
+        pConfig->SetAttribute("notify-high-water", notifyHighWater_m);
+    if (slowClientTimeout_m != DefaultSlowClientTimeout)
+        pConfig->SetAttribute("slow-client-timeout", slowClientTimeout_m);
+}
+
+XmlInetServer::XmlInetServer (int port, bool eventLoop) : XmlServer(eventLoop)
 {
     struct sockaddr_in addr;
     int reuse = 1;
@@ -110,9 +184,10 @@ void XmlInetServer::exportXml(ticpp::Element* pConfig)
 {
     pConfig->SetAttribute("type", "inet");
     pConfig->SetAttribute("port", port_m);
+    exportOptions(pConfig);
 }
 
-XmlUnixServer::XmlUnixServer (const char *path)
+XmlUnixServer::XmlUnixServer (const char *path, bool eventLoop) : XmlServer(eventLoop)
 {
     struct sockaddr_un addr;
     addr.sun_family = AF_LOCAL;
@@ -145,33 +220,208 @@ void XmlUnixServer::exportXml(ticpp::Element* pConfig)
 {
     pConfig->SetAttribute("type", "unix");
     pConfig->SetAttribute("path", path_m);
+    exportOptions(pConfig);
 }
 
 void XmlServer::Run (pth_sem_t *stop1)
 {
     pth_event_t stop = pth_event (PTH_EVENT_SEM, stop1);
-    while (pth_event_status (stop) != PTH_STATUS_OCCURRED)
+    if (eventLoop_m)
+        RunEventLoop (stop);
+    else
     {
-        int cfd;
-        cfd = pth_accept_ev (fd_m, 0, 0, stop);
-        if (cfd != -1)
+        while (pth_event_status (stop) != PTH_STATUS_OCCURRED)
         {
-            ClientConnection *c = new ClientConnection (this, cfd);
-            connections_m.push_back(c);
-            c->Start ();
+            int cfd;
+            cfd = pth_accept_ev (fd_m, 0, 0, stop);
+            if (cfd != -1)
+            {
+                ClientConnection *c = new ClientConnection (this, cfd);
+                connections_m.push_back(c);
+                c->Start ();
+            }
         }
     }
     pth_event_free (stop, PTH_FREE_THIS);
 }
 
-ClientConnection::ClientConnection (XmlServer *server, int fd)
+void XmlServer::RunEventLoop (pth_event_t stop)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event events[MaxEvents];
+    struct epoll_event ev;
+    memset (&ev, 0, sizeof (ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = 0; // The listening socket is the only one without connection
+    fcntl (fd_m, F_SETFL, fcntl (fd_m, F_GETFL) | O_NONBLOCK);
+    if (epoll_ctl (epollFd_m, EPOLL_CTL_ADD, fd_m, &ev) == -1)
+    {
+        errorStream("XmlServer") << "Unable to watch listening socket" << endlog;
+        return;
+    }
+
+    // The epoll descriptor becomes readable when one of the sockets is ready
+    pth_event_t input = pth_event (PTH_EVENT_FD|PTH_UNTIL_FD_READABLE, epollFd_m);
+    pth_event_t notify = pth_event (PTH_EVENT_SEM|PTH_UNTIL_DECREMENT, &notifySem_m);
+    pth_event_concat (stop, input, notify, NULL);
+    TimeMs_t nextPoll = 0;
+    while (pth_event_status (stop) != PTH_STATUS_OCCURRED)
+    {
+        // Pending executions and output are checked once per second
+        if (executing_m.empty() && writing_m.empty())
+        {
+            nextPoll = 0;
+            pth_wait (stop);
+        }
+        else
+        {
+            if (nextPoll == 0)
+                nextPoll = TimerManager::currentTime() + 1000;
+            pth_event_t tmout = pth_event (PTH_EVENT_TIME, pth_time(nextPoll / 1000, (nextPoll % 1000) * 1000));
+            pth_event_concat (stop, tmout, NULL);
+            pth_wait (stop);
+            pth_event_isolate (tmout);
+            pth_event_free (tmout, PTH_FREE_THIS);
+            if (TimerManager::currentTime() >= nextPoll)
+            {
+                pollExecutions ();
+                closeStalledClients ();
+                nextPoll += 1000;
+            }
+        }
+        sendNotifications ();
+
+        int n = epoll_wait (epollFd_m, events, MaxEvents, 0);
+        for (int i = 0; i < n; i++)
+        {
+            ClientConnection *con = static_cast<ClientConnection*>(events[i].data.ptr);
+            if (con == 0)
+            {
+                acceptClients ();
+                continue;
+            }
+            bool ok = true;
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                ok = con->onReadable ();
+            if (ok && (events[i].events & EPOLLOUT))
+                ok = con->onWritable ();
+            if (!ok || con->isClosed ())
+                closeClient (con);
+            else if (con->isExecuting () && std::find (executing_m.begin(), executing_m.end(), con) == executing_m.end())
+                executing_m.push_back (con);
+        }
+    }
+    pth_event_isolate (notify);
+    pth_event_free (notify, PTH_FREE_THIS);
+    pth_event_isolate (input);
+    pth_event_free (input, PTH_FREE_THIS);
+#endif
+}
+
+void XmlServer::acceptClients ()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    int cfd;
+    while ((cfd = accept (fd_m, 0, 0)) != -1)
+    {
+        fcntl (cfd, F_SETFL, fcntl (cfd, F_GETFL) | O_NONBLOCK);
+        ClientConnection *c = new ClientConnection (this, cfd, true);
+        struct epoll_event ev;
+        memset (&ev, 0, sizeof (ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl (epollFd_m, EPOLL_CTL_ADD, cfd, &ev) == -1)
+        {
+            errorStream("XmlServer") << "Unable to watch client connection" << endlog;
+            c->RemoveServer();
+            delete c;
+            continue;
+        }
+        connections_m.push_back(c);
+    }
+#endif
+}
+
+void XmlServer::pollExecutions ()
+{
+    std::list<ClientConnection*>::iterator it = executing_m.begin();
+    while (it != executing_m.end())
+    {
+        ClientConnection *con = *it;
+        con->processMessages ();
+        if (con->isClosed ())
+        {
+            it++;
+            closeClient (con);
+        }
+        else if (!con->isExecuting ())
+            it = executing_m.erase (it);
+        else
+            it++;
+    }
+}
+
+void XmlServer::closeStalledClients ()
+{
+    std::list<ClientConnection*>::iterator it = writing_m.begin();
+    while (it != writing_m.end())
+    {
+        ClientConnection *con = *(it++);
+        if (con->isStalled ())
+        {
+            warnStream("XmlServer") << "Disconnecting client not reading its output" << endlog;
+            closeClient (con);
+        }
+    }
+}
+
+void XmlServer::sendNotifications ()
+{
+    while (!notifying_m.empty())
+    {
+        ClientConnection *con = notifying_m.front();
+        notifying_m.pop_front();
+        if (con->flushNotifications (NULL) == -1 || con->isClosed ())
+            closeClient (con);
+    }
+}
+
+void XmlServer::closeClient (ClientConnection *con)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    epoll_ctl (epollFd_m, EPOLL_CTL_DEL, con->getFd(), 0);
+#endif
+    // Deregisters itself from the server
+    delete con;
+}
+
+ClientConnection::ClientConnection (XmlServer *server, int fd, bool eventLoop)
 {
     fd_m = fd;
     server_m = server;
+    eventLoop_m = eventLoop;
+    msg_m = 0;
+    inStart_m = 0;
+    inEnd_m = 0;
+    inScan_m = 0;
+    executing_m = false;
+    execTimeout_m = 0;
+    execCount_m = 0;
+    closed_m = false;
+    watchingWrite_m = false;
+    congestedSince_m = 0;
+    replyStart_m = std::string::npos;
+    pth_sem_init(&notifySem_m);
 }
 
 ClientConnection::~ClientConnection ()
 {
+    // Actions still running are deleted by the executor when they return
+    while (!pendingActions_m.empty())
+    {
+        ActionExecutor::instance()->dispose(pendingActions_m.front());
+        pendingActions_m.pop_front();
+    }
     NotifyList_t::iterator it;
     for (it = notifyList_m.begin(); it != notifyList_m.end(); it++)
     {
@@ -187,244 +437,427 @@ ClientConnection::~ClientConnection ()
 void ClientConnection::Run (pth_sem_t * stop1)
 {
     pth_event_t stop = pth_event (PTH_EVENT_SEM, stop1);
-    while (pth_event_status (stop) != PTH_STATUS_OCCURRED)
+    // Waiting for input is also interrupted by queued notifications, writes
+    // are only interrupted by stop
+    pth_event_t input = pth_event (PTH_EVENT_SEM, stop1);
+    pth_event_t notify = pth_event (PTH_EVENT_SEM|PTH_UNTIL_DECREMENT, &notifySem_m);
+    pth_event_concat (input, notify, NULL);
+    while (pth_event_status (input) != PTH_STATUS_OCCURRED)
     {
-        if (readmessage (stop) == -1)
+        int ret = readmessage (input);
+        if (ret == -1 || flushNotifications (stop) == -1)
+            break;
+        if (ret == 0)
+            continue;
+        processMessage (stop);
+        if (closed_m)
             break;
-        std::string msgType;
-        try
+        if (executing_m)
         {
-            // Load a document
-            ticpp::Document doc;
-            debugStream("ClientConnection") << "PROCESSING MESSAGE:" << endlog << msg_m << endlog << "END OF MESSAGE" << endlog;
-            doc.LoadFromString(msg_m);
-
-            ticpp::Element* pMsg = doc.FirstChildElement();
-            msgType = pMsg->Value();
-            if (msgType == "read")
+            pth_yield(NULL);
+            while (!pollExecution (stop))
             {
-                ticpp::Element* pRead = pMsg->FirstChildElement();
-                if (pRead->Value() == "object")
+                pth_sleep(1);
+                if (flushNotifications (stop) == -1)
+                    break;
+                pth_yield(NULL);
+            }
+            if (executing_m)
+                break;
+        }
+    }
+    pth_event_isolate (notify);
+    pth_event_free (notify, PTH_FREE_THIS);
+    pth_event_free (input, PTH_FREE_THIS);
+    pth_event_free (stop, PTH_FREE_THIS);
+    StopDelete ();
+}
+
+bool ClientConnection::onReadable ()
+{
+    int i;
+    do
+    {
+        reserveInput ();
+        i = read (fd_m, &inbuf_m[inEnd_m], inbuf_m.size() - inEnd_m);
+        if (i > 0)
+            inEnd_m += i;
+    } while (i > 0);
+    bool eof = (i == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR));
+
+    // Messages received with an execute request pending wait for its end
+    if (!executing_m)
+        processMessages ();
+    return !eof && !closed_m;
+}
+
+bool ClientConnection::onWritable ()
+{
+    if (!flush () || closed_m)
+        return false;
+    // Send the notifications held back while the client was catching up
+    if (!notifyQueue_m.empty() && outbuf_m.size() < (size_t)notifyHighWater())
+        return flushNotifications (NULL) != -1 && !closed_m;
+    return true;
+}
+
+void ClientConnection::processMessages ()
+{
+    while (!closed_m)
+    {
+        if (executing_m)
+        {
+            pth_yield(NULL);
+            if (!pollExecution (NULL))
+                return;
+        }
+        if (!nextMessage ())
+            return;
+        processMessage (NULL);
+    }
+}
+
+bool ClientConnection::nextMessage ()
+{
+    // Only the data received since the last call is searched
+    if (inScan_m == inEnd_m)
+        return false;
+    char *end = static_cast<char*>(memchr (&inbuf_m[inScan_m], '\004', inEnd_m - inScan_m));
+    if (end == 0)
+    {
+        inScan_m = inEnd_m;
+        return false;
+    }
+    // The message is handed over in place, the terminator becomes its end
+    *end = '\0';
+    msg_m = &inbuf_m[inStart_m];
+    inStart_m = inScan_m = end - &inbuf_m[0] + 1;
+    return true;
+}
+
+void ClientConnection::reserveInput ()
+{
+    if (inStart_m == inEnd_m)
+    {
+        inStart_m = inEnd_m = inScan_m = 0;
+        // Release the memory used by a large upload
+        if (inbuf_m.size() > MaxIdleBufferSize)
+            std::vector<char>().swap(inbuf_m);
+    }
+    if (inbuf_m.size() - inEnd_m >= ReadSize)
+        return;
+    if (inStart_m > 0)
+    {
+        // Move the incomplete message to the front
+        memmove (&inbuf_m[0], &inbuf_m[inStart_m], inEnd_m - inStart_m);
+        inEnd_m -= inStart_m;
+        inScan_m -= inStart_m;
+        inStart_m = 0;
+    }
+    if (inbuf_m.size() - inEnd_m < ReadSize)
+        inbuf_m.resize(std::max(inbuf_m.size() * 2, inEnd_m + ReadSize));
+}
+
+bool ClientConnection::pollExecution (pth_event_t stop)
+{
+    while (!pendingActions_m.empty() && (pendingActions_m.front()->isFinished() || execCount_m == execTimeout_m))
+    {
+        // A timed out action may still be running, it is cancelled without
+        // waiting for it so that the event loop is never blocked
+        ActionExecutor::instance()->dispose(pendingActions_m.front());
+        pendingActions_m.pop_front();
+    }
+    if (!pendingActions_m.empty())
+    {
+        if (execCount_m++ == 0)
+            sendmessage ("<execute status='ongoing'/>\n", stop);
+        return false;
+    }
+
+    executing_m = false;
+    if (execCount_m == execTimeout_m)
+        sendmessage ("<execute status='timeout'/>\n", stop);
+    else
+        sendmessage ("<execute status='success'/>\n", stop);
+    return true;
+}
+
+void ClientConnection::processMessage (pth_event_t stop)
+{
+    std::string msgType;
+    try
+    {
+        // Load a document
+        ticpp::Document doc;
+        debugStream("ClientConnection") << "PROCESSING MESSAGE:" << endlog << msg_m << endlog << "END OF MESSAGE" << endlog;
+        doc.LoadFromString(msg_m);
+
+        ticpp::Element* pMsg = doc.FirstChildElement();
+        msgType = pMsg->Value();
+        if (msgType == "read")
+        {
+            ticpp::Element* pRead = pMsg->FirstChildElement();
+            if (pRead->Value() == "object")
+            {
+                std::string id = pRead->GetAttribute("id");
+                Object* obj = ObjectController::instance()->getObject(id);
+                std::stringstream msg;
+                msg << "<read status='success'>" << objectValue(obj) << "</read>" << std::endl;
+                obj->decRefCount();
+                debugStream("ClientConnection") << "SENDING MESSAGE:" << endlog << msg.str() << endlog << "END OF MESSAGE" << endlog;
+                sendmessage (msg.str(), stop);
+            }
+            else if (pRead->Value() == "objects")
+            {
+                if (pRead->NoChildren())
                 {
-                    std::string id = pRead->GetAttribute("id");
-                    Object* obj = ObjectController::instance()->getObject(id);
-                    std::stringstream msg;
-                    msg << "<read status='success'>" << obj->getValue() << "</read>" << std::endl;
-                    obj->decRefCount();
-                    debugStream("ClientConnection") << "SENDING MESSAGE:" << endlog << msg.str() << endlog << "END OF MESSAGE" << endlog;
-                    sendmessage (msg.str(), stop);
+                    // Values are written as they are read, without a document
+                    pMsg->SetAttribute("status", "success");
+                    XmlWriter writer(beginReply());
+                    writer.startElement(pMsg).startElement(pRead);
+                    ObjectController::instance()->exportObjectValues(writer, !eventLoop_m);
+                    writer.endElement().endElement();
+                    endReply(stop);
                 }
-                else if (pRead->Value() == "objects")
+                else
                 {
-                    if (pRead->NoChildren())
+                    ticpp::Iterator< ticpp::Element > pObjects;
+                    for ( pObjects = pRead->FirstChildElement(); pObjects != pObjects.end(); pObjects++ )
                     {
-                        ObjectController::instance()->exportObjectValues(pRead);
-                    }
-                    else
-                    {
-                        ticpp::Iterator< ticpp::Element > pObjects;
-                        for ( pObjects = pRead->FirstChildElement(); pObjects != pObjects.end(); pObjects++ )
+                        if (pObjects->Value() == "object")
                         {
-                            if (pObjects->Value() == "object")
-                            {
-                                std::string id = pObjects->GetAttribute("id");
-                                Object* obj = ObjectController::instance()->getObject(id);
-                                pObjects->SetAttribute("value", obj->getValue());
-                                obj->decRefCount();
-                            }
-                            else
-                                throw "Unknown objects element";
+                            std::string id = pObjects->GetAttribute("id");
+                            Object* obj = ObjectController::instance()->getObject(id);
+                            pObjects->SetAttribute("value", objectValue(obj));
+                            obj->decRefCount();
                         }
+                        else
+                            throw "Unknown objects element";
                     }
                     pMsg->SetAttribute("status", "success");
-                    sendmessage (doc.GetAsString(), stop);
+                    sendreply (pMsg, stop);
                 }
-                else if (pRead->Value() == "config")
+            }
+            else if (pRead->Value() == "config")
+            {
+                ticpp::Element* pConfig = pRead->FirstChildElement(false);
+                if (pConfig == 0)
                 {
-                    ticpp::Element* pConfig = pRead->FirstChildElement(false);
-                    if (pConfig == 0)
+                    // Each part is written and released before the next one
+                    pMsg->SetAttribute("status", "success");
+                    XmlWriter writer(beginReply());
+                    writer.startElement(pMsg).startElement(pRead);
                     {
                         ticpp::Element objects("objects");
                         ObjectController::instance()->exportXml(&objects);
-                        pRead->LinkEndChild(&objects);
-
-                        ticpp::Element rules("rules");
-                        RuleServer::instance()->exportXml(&rules);
-                        pRead->LinkEndChild(&rules);
-
-                        ticpp::Element services("services");
-                        Services::instance()->exportXml(&services);
-                        pRead->LinkEndChild(&services);
-
-                        ticpp::Element logging("logging");
-                        Logging::instance()->exportXml(&logging);
-                        pRead->LinkEndChild(&logging);
+                        writer.element(&objects);
                     }
-                    else if (pConfig->Value() == "objects")
                     {
-                        ObjectController::instance()->exportXml(pConfig);
-                    }
-                    else if (pConfig->Value() == "rules")
-                    {
-                        RuleServer::instance()->exportXml(pConfig);
+                        ticpp::Element rules("rules");
+                        RuleServer::instance()->exportXml(&rules);
+                        writer.element(&rules);
                     }
-                    else if (pConfig->Value() == "services")
                     {
-                        Services::instance()->exportXml(pConfig);
+                        ticpp::Element services("services");
+                        Services::instance()->exportXml(&services);
+                        writer.element(&services);
                     }
-                    else if (pConfig->Value() == "logging")
                     {
-                        Logging::instance()->exportXml(pConfig);
+                        ticpp::Element logging("logging");
+                        Logging::instance()->exportXml(&logging);
+                        writer.element(&logging);
                     }
-                    pMsg->SetAttribute("status", "success");
-                    sendmessage (doc.GetAsString(), stop);
+                    writer.endElement().endElement();
+                    endReply(stop);
+                    return;
+                }
+                else if (pConfig->Value() == "objects")
+                {
+                    ObjectController::instance()->exportXml(pConfig);
+                }
+                else if (pConfig->Value() == "rules")
+                {
+                    RuleServer::instance()->exportXml(pConfig);
                 }
-                else if (pRead->Value() == "status")
+                else if (pConfig->Value() == "services")
                 {
-                    ticpp::Element* pConfig = pRead->FirstChildElement(false);
-                    if (pConfig == 0)
+                    Services::instance()->exportXml(pConfig);
+                }
+                else if (pConfig->Value() == "logging")
+                {
+                    Logging::instance()->exportXml(pConfig);
+                }
+                pMsg->SetAttribute("status", "success");
+                sendreply (pMsg, stop);
+            }
+            else if (pRead->Value() == "status")
+            {
+                ticpp::Element* pConfig = pRead->FirstChildElement(false);
+                if (pConfig == 0)
+                {
+                    // Each part is written and released before the next one
+                    pMsg->SetAttribute("status", "success");
+                    XmlWriter writer(beginReply());
+                    writer.startElement(pMsg).startElement(pRead);
                     {
                         ticpp::Element timers("timers");
                         Services::instance()->getTimerManager()->statusXml(&timers);
-                        pRead->LinkEndChild(&timers);
-
-                        ticpp::Element rules("rules");
-                        RuleServer::instance()->statusXml(&rules);
-                        pRead->LinkEndChild(&rules);
+                        writer.element(&timers);
                     }
-                    else if (pConfig->Value() == "timers")
                     {
-                        Services::instance()->getTimerManager()->statusXml(pConfig);
+                        ticpp::Element rules("rules");
+                        RuleServer::instance()->statusXml(&rules);
+                        writer.element(&rules);
                     }
-                    else if (pConfig->Value() == "rules")
                     {
-                        RuleServer::instance()->statusXml(pConfig);
+                        ticpp::Element knxConnection("knxconnection");
+                        Services::instance()->statusXml(&knxConnection);
+                        writer.element(&knxConnection);
                     }
-                    pMsg->SetAttribute("status", "success");
-                    sendmessage (doc.GetAsString(), stop);
+                    writer.endElement().endElement();
+                    endReply(stop);
+                    return;
                 }
-                else if (pRead->Value() == "calendar")
+                else if (pConfig->Value() == "timers")
                 {
-                    int year, month, day, h,m;
-                    time_t ts = time(0);
-                    struct tm * date = localtime(&ts);
-                    pRead->GetAttributeOrDefault("year", &year, 0);
-                    pRead->GetAttributeOrDefault("month", &month, 0);
-                    pRead->GetAttributeOrDefault("day", &day, 0);
-                    if (year != 0 || month != 0 || day != 0) {
-                        if (year == 0 && month == 0) {
-                            date->tm_mday += day;
-                        }
-                        else {
-                            if (year >= 1900)
-                                year -= 1900;
-                            if (month > 0)
-                                date->tm_mon = month-1;
-                            if (year > 0)
-                                date->tm_year = year;
-                            date->tm_mday = day;
-                        }
-                        ts = mktime(date);
-                        pRead->SetAttribute("year", date->tm_year+1900);
-                        pRead->SetAttribute("month", date->tm_mon+1);
-                        pRead->SetAttribute("day", date->tm_mday);
-                    }
-
-                    SolarInfo info(date);
-                    ticpp::Element* pConfig = pRead->FirstChildElement(false);
-                    if (pConfig == 0)
-                    {
-                        bool isException = Services::instance()->getExceptionDays()->isException(ts);
-                        ticpp::Element exceptionday("exception-day");
-                        exceptionday.SetText(isException ? "true" : "false");
-                        pRead->LinkEndChild(&exceptionday);
-
-                        if (info.getSunrise(&m, &h)) {
-                            ticpp::Element sunrise("sunrise");
-                            sunrise.SetAttribute("hour", h);
-                            sunrise.SetAttribute("min", m);
-                            pRead->LinkEndChild(&sunrise);
-                        }
-                        if (info.getSunset(&m, &h)) {
-                            ticpp::Element sunset("sunset");
-                            sunset.SetAttribute("hour", h);
-                            sunset.SetAttribute("min", m);
-                            pRead->LinkEndChild(&sunset);
-                        }
-                        if (info.getNoon(&m, &h)) {
-                            ticpp::Element noon("noon");
-                            noon.SetAttribute("hour", h);
-                            noon.SetAttribute("min", m);
-                            pRead->LinkEndChild(&noon);
-                        }
+                    Services::instance()->getTimerManager()->statusXml(pConfig);
+                }
+                else if (pConfig->Value() == "knxconnection")
+                {
+                    Services::instance()->statusXml(pConfig);
+                }
+                else if (pConfig->Value() == "rules")
+                {
+                    RuleServer::instance()->statusXml(pConfig);
+                }
+                pMsg->SetAttribute("status", "success");
+                sendreply (pMsg, stop);
+            }
+            else if (pRead->Value() == "calendar")
+            {
+                int year, month, day, h,m;
+                time_t ts = time(0);
+                struct tm * date = localtime(&ts);
+                pRead->GetAttributeOrDefault("year", &year, 0);
+                pRead->GetAttributeOrDefault("month", &month, 0);
+                pRead->GetAttributeOrDefault("day", &day, 0);
+                if (year != 0 || month != 0 || day != 0) {
+                    if (year == 0 && month == 0) {
+                        date->tm_mday += day;
                     }
-                    else if (pConfig->Value() == "exception-day")
-                    {
-                        bool isException = Services::instance()->getExceptionDays()->isException(ts);
-                        pConfig->SetText(isException ? "true" : "false");
+                    else {
+                        if (year >= 1900)
+                            year -= 1900;
+                        if (month > 0)
+                            date->tm_mon = month-1;
+                        if (year > 0)
+                            date->tm_year = year;
+                        date->tm_mday = day;
                     }
-                    else if (pConfig->Value() == "sunrise")
-                    {
-                        if (!info.getSunrise(&m, &h))
-                            throw "Error while calculating sunrise";
-                        pConfig->SetAttribute("hour", h);
-                        pConfig->SetAttribute("min", m);
+                    ts = mktime(date);
+                    pRead->SetAttribute("year", date->tm_year+1900);
+                    pRead->SetAttribute("month", date->tm_mon+1);
+                    pRead->SetAttribute("day", date->tm_mday);
+                }
+
+                SolarInfo info(date);
+                ticpp::Element* pConfig = pRead->FirstChildElement(false);
+                if (pConfig == 0)
+                {
+                    bool isException = Services::instance()->getExceptionDays()->isException(ts);
+                    ticpp::Element exceptionday("exception-day");
+                    exceptionday.SetText(isException ? "true" : "false");
+                    pRead->LinkEndChild(&exceptionday);
+
+                    if (info.getSunrise(&m, &h)) {
+                        ticpp::Element sunrise("sunrise");
+                        sunrise.SetAttribute("hour", h);
+                        sunrise.SetAttribute("min", m);
+                        pRead->LinkEndChild(&sunrise);
                     }
-                    else if (pConfig->Value() == "sunset")
-                    {
-                        if (!info.getSunset(&m, &h))
-                            throw "Error while calculating sunset";
-                        pConfig->SetAttribute("hour", h);
-                        pConfig->SetAttribute("min", m);
+                    if (info.getSunset(&m, &h)) {
+                        ticpp::Element sunset("sunset");
+                        sunset.SetAttribute("hour", h);
+                        sunset.SetAttribute("min", m);
+                        pRead->LinkEndChild(&sunset);
                     }
-                    else if (pConfig->Value() == "noon")
-                    {
-                        if (!info.getNoon(&m, &h))
-                            throw "Error while calculating solar noon";
-                        pConfig->SetAttribute("hour", h);
-                        pConfig->SetAttribute("min", m);
+                    if (info.getNoon(&m, &h)) {
+                        ticpp::Element noon("noon");
+                        noon.SetAttribute("hour", h);
+                        noon.SetAttribute("min", m);
+                        pRead->LinkEndChild(&noon);
                     }
-                    pMsg->SetAttribute("status", "success");
-                    sendmessage (doc.GetAsString(), stop);
                 }
-                else if (pRead->Value() == "version")
+                else if (pConfig->Value() == "exception-day")
                 {
-                    ticpp::Element value("value");
-                    value.SetText(VERSION);
-                    pRead->LinkEndChild(&value);
+                    bool isException = Services::instance()->getExceptionDays()->isException(ts);
+                    pConfig->SetText(isException ? "true" : "false");
+                }
+                else if (pConfig->Value() == "sunrise")
+                {
+                    if (!info.getSunrise(&m, &h))
+                        throw "Error while calculating sunrise";
+                    pConfig->SetAttribute("hour", h);
+                    pConfig->SetAttribute("min", m);
+                }
+                else if (pConfig->Value() == "sunset")
+                {
+                    if (!info.getSunset(&m, &h))
+                        throw "Error while calculating sunset";
+                    pConfig->SetAttribute("hour", h);
+                    pConfig->SetAttribute("min", m);
+                }
+                else if (pConfig->Value() == "noon")
+                {
+                    if (!info.getNoon(&m, &h))
+                        throw "Error while calculating solar noon";
+                    pConfig->SetAttribute("hour", h);
+                    pConfig->SetAttribute("min", m);
+                }
+                pMsg->SetAttribute("status", "success");
+                sendreply (pMsg, stop);
+            }
+            else if (pRead->Value() == "version")
+            {
+                ticpp::Element value("value");
+                value.SetText(VERSION);
+                pRead->LinkEndChild(&value);
 
-                    ticpp::Element features("features");
+                ticpp::Element features("features");
 #ifdef HAVE_LIBCURL
-                    ticpp::Element sms("sms");
-                    features.LinkEndChild(&sms);
+                ticpp::Element sms("sms");
+                features.LinkEndChild(&sms);
 #endif
 #ifdef HAVE_LIBESMTP
-                    ticpp::Element email("e-mail");
-                    features.LinkEndChild(&email);
+                ticpp::Element email("e-mail");
+                features.LinkEndChild(&email);
 #endif
 #ifdef HAVE_MYSQL
-                    ticpp::Element mysql("mysql");
-                    features.LinkEndChild(&mysql);
+                ticpp::Element mysql("mysql");
+                features.LinkEndChild(&mysql);
 #endif
 #ifdef HAVE_LUA
-                    ticpp::Element lua("lua");
-                    features.LinkEndChild(&lua);
+                ticpp::Element lua("lua");
+                features.LinkEndChild(&lua);
 #endif
 #ifdef HAVE_LOG4CPP
-                    ticpp::Element log4cpp("log4cpp");
-                    features.LinkEndChild(&log4cpp);
+                ticpp::Element log4cpp("log4cpp");
+                features.LinkEndChild(&log4cpp);
 #endif
 
-                    pRead->LinkEndChild(&features);
+                pRead->LinkEndChild(&features);
 
-                    pMsg->SetAttribute("status", "success");
-                    sendmessage (doc.GetAsString(), stop);
-                }
-                else
-                    throw "Unknown read element";
+                pMsg->SetAttribute("status", "success");
+                sendreply (pMsg, stop);
             }
-            else if (msgType == "write")
+            else
+                throw "Unknown read element";
+        }
+        else if (msgType == "write")
+        {
             {
+                // Rules fed by several written objects are evaluated once
+                RuleEvaluationCycle cycle;
                 ticpp::Iterator< ticpp::Element > pWrite;
                 for ( pWrite = pMsg->FirstChildElement(); pWrite != pWrite.end(); pWrite++ )
                 {
@@ -455,174 +888,214 @@ void ClientConnection::Run (pth_sem_t * stop1)
                     else
                         throw "Unknown write element";
                 }
-                sendmessage ("<write status='success'/>\n", stop);
+                cycle.end();
             }
-            else if (msgType == "execute")
+            sendmessage ("<write status='success'/>\n", stop);
+        }
+        else if (msgType == "execute")
+        {
+            std::list<Action*> al;
+            int timeout;
+            pMsg->GetAttributeOrDefault("timeout", &timeout, 60);
+            ticpp::Iterator< ticpp::Element > pExecute;
+            for ( pExecute = pMsg->FirstChildElement(); pExecute != pExecute.end(); pExecute++ )
             {
-                std::list<Action*> al;
-                int timeout;
-                int count = 0;
-                pMsg->GetAttributeOrDefault("timeout", &timeout, 60);
-                ticpp::Iterator< ticpp::Element > pExecute;
-                for ( pExecute = pMsg->FirstChildElement(); pExecute != pExecute.end(); pExecute++ )
+                if (pExecute->Value() == "action")
                 {
-                    if (pExecute->Value() == "action")
-                    {
-                        Action *action = Action::create(&(*pExecute));
-                        action->execute();
-                        al.push_back(action);
-                    }
-                    else if (pExecute->Value() == "rule-actions")
-                    {
-                        std::string id = pExecute->GetAttribute("id");
-                        std::string list = pExecute->GetAttribute("list");
-                        Rule* rule = RuleServer::instance()->getRule(id.c_str());
-                        if (rule == 0)
-                            throw "Unknown rule id";
-                        if (list == "true")
+                    Action *action = Action::create(&(*pExecute));
+                    action->execute();
+                    al.push_back(action);
+                }
+                else if (pExecute->Value() == "rule-actions")
+                {
+                    std::string id = pExecute->GetAttribute("id");
+                    std::string list = pExecute->GetAttribute("list");
+                    Rule* rule = RuleServer::instance()->getRule(id.c_str());
+                    if (rule == 0)
+                        throw "Unknown rule id";
+                    if (list == "true")
 						{
 							rule->executeActions(ActionList::OnTrue);
 							rule->executeActions(ActionList::IfTrue);
 						}
-                        else if (list == "false")
+                    else if (list == "false")
 						{
 							rule->executeActions(ActionList::OnFalse);
 							rule->executeActions(ActionList::IfFalse);
 						}
-                        else
-                            throw "Invalid list attribute. (Must be 'true' or 'false')";
-                    }
                     else
-                        throw "Unknown execute element";
-                }
-                while (!al.empty()) {
-                    pth_yield(NULL);
-                    if (al.front()->isFinished() || count == timeout) {
-                        delete al.front();
-                        al.pop_front();
-                    }
-                    else {
-                        if (count++ == 0)
-                            sendmessage ("<execute status='ongoing'/>\n", stop);
-                        pth_sleep(1);
-                    }
+                        throw "Invalid list attribute. (Must be 'true' or 'false')";
                 }
-
-                if (count == timeout)
-                    sendmessage ("<execute status='timeout'/>\n", stop);
                 else
-                    sendmessage ("<execute status='success'/>\n", stop);
+                    throw "Unknown execute element";
             }
-            else if (msgType == "admin")
+            // The caller waits for the actions through pollExecution()
+            pendingActions_m.swap(al);
+            execTimeout_m = timeout;
+            execCount_m = 0;
+            executing_m = true;
+        }
+        else if (msgType == "admin")
+        {
+            ticpp::Iterator< ticpp::Element > pAdmin;
+            for ( pAdmin = pMsg->FirstChildElement(); pAdmin != pAdmin.end(); pAdmin++ )
             {
-                ticpp::Iterator< ticpp::Element > pAdmin;
-                for ( pAdmin = pMsg->FirstChildElement(); pAdmin != pAdmin.end(); pAdmin++ )
+                if (pAdmin->Value() == "save")
+                {
+                    std::string filename = pAdmin->GetAttribute("file");
+                    if (filename == "")
+                        filename = Services::instance()->getConfigFile();
+                    if (filename == "")
+                        throw "No file to write config to";
+                    try
+                    {
+                        // Save a document
+                        ticpp::Document doc;
+                        ticpp::Declaration decl("1.0", "", "");
+                        doc.LinkEndChild(&decl);
+                
+                        ticpp::Element pConfig("config");
+                
+                        ticpp::Element pServices("services");
+                        Services::instance()->exportXml(&pServices);
+                        pConfig.LinkEndChild(&pServices);
+                        ticpp::Element pObjects("objects");
+                        ObjectController::instance()->exportXml(&pObjects);
+                        pConfig.LinkEndChild(&pObjects);
+                        ticpp::Element pRules("rules");
+                        RuleServer::instance()->exportXml(&pRules);
+                        pConfig.LinkEndChild(&pRules);
+                        ticpp::Element pLogging("logging");
+                        Logging::instance()->exportXml(&pLogging);
+                        pConfig.LinkEndChild(&pLogging);
+                
+                        doc.LinkEndChild(&pConfig);
+                        doc.SaveFile(filename);
+                    }
+                    catch( ticpp::Exception& ex )
+                    {
+                        // If any function has an error, execution will enter here.
+                        // Report the error
+                        errorStream("ClientConnection") << "Unable to write config to file: " << ex.m_details << endlog;
+                        throw "Error writing config to file";
+                    }
+                }
+                else if (pAdmin->Value() == "notification")
                 {
-                    if (pAdmin->Value() == "save")
+                    ticpp::Iterator< ticpp::Element > pObjects;
+                    for ( pObjects = pAdmin->FirstChildElement(); pObjects != pObjects.end(); pObjects++ )
                     {
-                        std::string filename = pAdmin->GetAttribute("file");
-                        if (filename == "")
-                            filename = Services::instance()->getConfigFile();
-                        if (filename == "")
-                            throw "No file to write config to";
-                        try
+                        if (pObjects->Value() == "register")
                         {
-                            // Save a document
-                            ticpp::Document doc;
-                            ticpp::Declaration decl("1.0", "", "");
-                            doc.LinkEndChild(&decl);
-                    
-                            ticpp::Element pConfig("config");
-                    
-                            ticpp::Element pServices("services");
-                            Services::instance()->exportXml(&pServices);
-                            pConfig.LinkEndChild(&pServices);
-                            ticpp::Element pObjects("objects");
-                            ObjectController::instance()->exportXml(&pObjects);
-                            pConfig.LinkEndChild(&pObjects);
-                            ticpp::Element pRules("rules");
-                            RuleServer::instance()->exportXml(&pRules);
-                            pConfig.LinkEndChild(&pRules);
-                            ticpp::Element pLogging("logging");
-                            Logging::instance()->exportXml(&pLogging);
-                            pConfig.LinkEndChild(&pLogging);
-                    
-                            doc.LinkEndChild(&pConfig);
-                            doc.SaveFile(filename);
+                            std::string id = pObjects->GetAttribute("id");
+                            Object* obj = ObjectController::instance()->getObject(id);
+                            notifyList_m.push_back(obj);
+                            obj->addChangeListener(this);
                         }
-                        catch( ticpp::Exception& ex )
+                        else if (pObjects->Value() == "unregister")
                         {
-                            // If any function has an error, execution will enter here.
-                            // Report the error
-                            errorStream("ClientConnection") << "Unable to write config to file: " << ex.m_details << endlog;
-                            throw "Error writing config to file";
+                            std::string id = pObjects->GetAttribute("id");
+                            Object* obj = ObjectController::instance()->getObject(id);
+                            notifyList_m.remove(obj);
+                            dropNotification(obj);
+                            obj->decRefCount();
+                            obj->removeChangeListener(this);
+                            obj->decRefCount();
                         }
-                    }
-                    else if (pAdmin->Value() == "notification")
-                    {
-                        ticpp::Iterator< ticpp::Element > pObjects;
-                        for ( pObjects = pAdmin->FirstChildElement(); pObjects != pObjects.end(); pObjects++ )
+                        else if (pObjects->Value() == "registerall" || pObjects->Value() == "unregisterall")
                         {
-                            if (pObjects->Value() == "register")
+                            NotifyList_t::iterator it;
+                            for (it=notifyList_m.begin(); it != notifyList_m.end(); it++)
                             {
-                                std::string id = pObjects->GetAttribute("id");
-                                Object* obj = ObjectController::instance()->getObject(id);
-                                notifyList_m.push_back(obj);
-                                obj->addChangeListener(this);
+                                (*it)->removeChangeListener(this);
+                                (*it)->decRefCount();
                             }
-                            else if (pObjects->Value() == "unregister")
-                            {
-                                std::string id = pObjects->GetAttribute("id");
-                                Object* obj = ObjectController::instance()->getObject(id);
-                                notifyList_m.remove(obj);
-                                obj->decRefCount();
-                                obj->removeChangeListener(this);
-                                obj->decRefCount();
-                            }
-                            else if (pObjects->Value() == "registerall" || pObjects->Value() == "unregisterall")
-                            {
-                                NotifyList_t::iterator it;
-                                for (it=notifyList_m.begin(); it != notifyList_m.end(); it++)
-                                {
-                                    (*it)->removeChangeListener(this);
-                                    (*it)->decRefCount();
-                                }
-                                notifyList_m.clear();
+                            notifyList_m.clear();
+                            notifyQueue_m.clear();
+                            queuedObjects_m.clear();
 
-                                if (pObjects->Value() == "registerall") 
+                            if (pObjects->Value() == "registerall") 
+                            {
+                                std::list<Object*> objList = ObjectController::instance()->getObjects();
+                                std::list<Object*>::iterator it;
+                                for (it=objList.begin(); it != objList.end(); it++)
                                 {
-                                    std::list<Object*> objList = ObjectController::instance()->getObjects();
-                                    std::list<Object*>::iterator it;
-                                    for (it=objList.begin(); it != objList.end(); it++)
-                                    {
-                                        notifyList_m.push_back((*it));
-                                        (*it)->addChangeListener(this);
-                                    }
+                                    notifyList_m.push_back((*it));
+                                    (*it)->addChangeListener(this);
                                 }
                             }
-                            else
-                                throw "Unknown objects element";
                         }
+                        else
+                            throw "Unknown objects element";
                     }
-                    else
-                        throw "Unknown admin element";
                 }
-                sendmessage ("<admin status='success'/>\n", stop);
+                else
+                    throw "Unknown admin element";
             }
-            else
-                throw "Unknown element";
-        }
-        catch( const char* ex )
-        {
-            sendreject (ex, msgType, stop);
-        }
-        catch( ticpp::Exception& ex )
-        {
-            sendreject (ex.m_details.c_str(), msgType, stop);
+            sendmessage ("<admin status='success'/>\n", stop);
         }
+        else
+            throw "Unknown element";
+    }
+    catch( const char* ex )
+    {
+        cancelReply ();
+        sendreject (ex, msgType, stop);
+    }
+    catch( ticpp::Exception& ex )
+    {
+        cancelReply ();
+        sendreject (ex.m_details.c_str(), msgType, stop);
     }
-    pth_event_free (stop, PTH_FREE_THIS);
-    StopDelete ();
+}
+
+std::string ClientConnection::objectValue (Object* obj)
+{
+    // Waiting for the bus would block all the clients of the event loop
+    return eventLoop_m ? obj->getValueNoWait() : obj->getValue();
+}
+
+std::string& ClientConnection::beginReply ()
+{
+    if (!eventLoop_m)
+        replyBuf_m.clear();
+    std::string& out = eventLoop_m ? outbuf_m : replyBuf_m;
+    replyStart_m = out.size();
+    return out;
+}
+
+int ClientConnection::endReply (pth_event_t stop)
+{
+    replyStart_m = std::string::npos;
+    if (eventLoop_m)
+    {
+        outbuf_m.append(1, '\004');
+        if (closed_m)
+            return -1;
+        return flush() ? 0 : -1;
+    }
+    replyBuf_m.append(1, '\004');
+    int ret = sendmessage(replyBuf_m.size(), replyBuf_m.data(), stop);
+    // Release the memory used by a large reply
+    if (replyBuf_m.capacity() > MaxIdleBufferSize)
+        std::string().swap(replyBuf_m);
+    return ret;
+}
+
+void ClientConnection::cancelReply ()
+{
+    if (replyStart_m == std::string::npos)
+        return;
+    std::string& out = eventLoop_m ? outbuf_m : replyBuf_m;
+    out.erase(replyStart_m);
+    replyStart_m = std::string::npos;
+}
+
+int ClientConnection::sendreply (ticpp::Element* pMsg, pth_event_t stop)
+{
+    XmlWriter writer(beginReply());
+    writer.element(pMsg);
+    return endReply(stop);
 }
 
 int ClientConnection::sendreject (const char* msgstr, const std::string& type, pth_event_t stop)
@@ -646,12 +1119,47 @@ int ClientConnection::sendmessage (int size, const char * msg, pth_event_t stop)
     int i;
     int start = 0;
 
+    if (eventLoop_m)
+    {
+        if (closed_m)
+            return -1;
+        outbuf_m.append(msg, size);
+        return flush() ? 0 : -1;
+    }
+
+    // A client not reading its replies or notifications is disconnected.
+    // The message is written in chunks and the timeout restarts after each
+    // of them, so a client slowly draining a large reply is kept.
+    int timeout = slowClientTimeout();
     start = 0;
     while (start < size)
     {
-        i = pth_write_ev (fd_m, msg + start, size - start, stop);
+        pth_event_t ev = stop;
+        pth_event_t tmout = 0;
+        if (timeout > 0)
+        {
+            tmout = pth_event (PTH_EVENT_TIME, pth_timeout (timeout, 0));
+            if (stop)
+                pth_event_concat (stop, tmout, NULL);
+            else
+                ev = tmout;
+        }
+        i = pth_write_ev (fd_m, msg + start, std::min (size - start, (int)WriteSize), ev);
+        bool timedOut = false;
+        if (tmout)
+        {
+            pth_event_isolate (tmout);
+            timedOut = pth_event_status (tmout) == PTH_STATUS_OCCURRED;
+            pth_event_free (tmout, PTH_FREE_THIS);
+        }
         if (i <= 0)
+        {
+            if (timedOut)
+                warnStream("ClientConnection") << "Disconnecting client not reading its output" << endlog;
+            // The stream can't be resynchronized after a partial write
+            closed_m = true;
             return -1;
+        }
         start += i;
     }
     return 0;
@@ -659,47 +1167,116 @@ int ClientConnection::sendmessage (int size, const char * msg, pth_event_t stop)
 
 int ClientConnection::readmessage (pth_event_t stop)
 {
-    char buf[256];
     int i;
-    std::stringstream msg;
 
-    if (msgbuf_m.size() > 0)
+    while (!nextMessage())
     {
-        // we have already some data in the message buffer
-        std::string::size_type len = msgbuf_m.find_first_of('\004');
-        if (std::string::npos != len)
+        reserveInput ();
+        i = pth_read_ev (fd_m, &inbuf_m[inEnd_m], inbuf_m.size() - inEnd_m, stop);
+        if (i <= 0)
         {
-            // Complete message in the buffer
-            msg_m = msgbuf_m.substr(0, len);
-            msgbuf_m.erase(0, len+1);
-            return 1;
+            if (i == -1 && errno == EINTR && pth_event_status (stop) != PTH_STATUS_OCCURRED)
+                return 0;
+            return -1;
         }
-        msg << msgbuf_m;
+        inEnd_m += i;
     }
+    return 1;
+}
 
-    while ((i = pth_read_ev (fd_m, &buf, 256, stop)) > 0)
+bool ClientConnection::flush ()
+{
+    size_t queued = outbuf_m.size();
+    // A reply being written is only sent once complete, so that it can
+    // still be cancelled
+    while (!outbuf_m.empty() && replyStart_m != 0)
     {
-        std::string tstr(buf, i);
-        std::string::size_type len = tstr.find_first_of('\004');
-        if (std::string::npos != len)
+        size_t size = replyStart_m == std::string::npos ? outbuf_m.size() : replyStart_m;
+        int i = write (fd_m, outbuf_m.data(), size);
+        if (i > 0)
         {
-            // Complete message in the buffer
-            msg << tstr.substr(0, len);
-            msg_m = msg.str();
-            msgbuf_m = tstr.substr(len+1);
-            return 1;
+            outbuf_m.erase(0, i);
+            if (replyStart_m != std::string::npos)
+                replyStart_m -= i;
         }
-        msg << tstr;
+        else if (i == -1 && errno == EINTR)
+            continue;
+        else if (i == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        else
+        {
+            closed_m = true;
+            return false;
+        }
+    }
+
+    // Wait for the socket to accept more data before sending the rest
+    bool pending = !outbuf_m.empty() && replyStart_m != 0;
+    if (pending != watchingWrite_m && server_m)
+    {
+        server_m->watchWrite (this, pending);
+        watchingWrite_m = pending;
     }
+    // The client is only considered stalled if it doesn't read anything
+    if (outbuf_m.size() < (size_t)notifyHighWater())
+        congestedSince_m = 0;
+    else if (congestedSince_m == 0 || outbuf_m.size() < queued)
+        congestedSince_m = time(0);
+    return true;
+}
 
-    return -1;
+bool ClientConnection::isStalled ()
+{
+    int timeout = slowClientTimeout();
+    return congestedSince_m != 0 && timeout > 0 && time(0) - congestedSince_m >= timeout;
 }
 
 void ClientConnection::onChange(Object* object)
 {
-//    sendmessage ("<notify id=status='success'/>\n", stop);
-    std::stringstream msg;
-    msg << "<notify id='" << object->getID() << "'>" << object->getValue() << "</notify>" << std::endl;
-    sendmessage (msg.str(), NULL);
+    // Only the latest value of an object is sent, when the client is ready
+    bool wasEmpty = notifyQueue_m.empty();
+    if (queuedObjects_m.insert(object).second)
+        notifyQueue_m.push_back(object);
+    if (eventLoop_m)
+    {
+        // A stalled client is reported again so that the server drops it
+        if ((wasEmpty || isStalled ()) && server_m)
+            server_m->notifyPending (this);
+    }
+    else if (wasEmpty)
+        pth_sem_inc(&notifySem_m, FALSE);
+}
+
+int ClientConnection::flushNotifications (pth_event_t stop)
+{
+    if (notifyQueue_m.empty())
+        return 0;
+    if (eventLoop_m)
+    {
+        if (isStalled ())
+        {
+            warnStream("ClientConnection") << "Disconnecting client not reading its notifications" << endlog;
+            closed_m = true;
+            return -1;
+        }
+        // Changes keep being coalesced until the client catches up
+        if (outbuf_m.size() >= (size_t)notifyHighWater())
+            return 0;
+    }
+
+    std::string batch;
+    NotifyList_t::iterator it;
+    for (it = notifyQueue_m.begin(); it != notifyQueue_m.end(); it++)
+        batch.append("<notify id='").append((*it)->getID()).append("'>").append((*it)->getValue()).append("</notify>\n\004");
+    notifyQueue_m.clear();
+    queuedObjects_m.clear();
+
+    return sendmessage (batch.size(), batch.data(), stop);
+}
+
+void ClientConnection::dropNotification (Object* object)
+{
+    if (queuedObjects_m.erase(object))
+        notifyQueue_m.remove(object);
 }
 
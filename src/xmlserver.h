@@ -27,11 +27,15 @@
 #include "threads.h"
 #include <list>
 #include <string>
+#include <vector>
+#include <set>
 #include "ticpp.h"
 #include "objectcontroller.h"
+#include "xmlwriter.h"
 
 
 class ClientConnection;
+class Action;
 
 class XmlServer : protected Thread
 {
@@ -43,18 +47,55 @@ public:
     virtual void exportXml(ticpp::Element* pConfig) = 0;
 
     bool deregister (ClientConnection *con);
+    /** Event loop mode: asks to be notified when con can be written to. */
+    void watchWrite (ClientConnection *con, bool enable);
+    /** Event loop mode: asks to send the notifications queued by con. */
+    void notifyPending (ClientConnection *con);
+
+    int getNotifyHighWater() { return notifyHighWater_m; };
+    int getSlowClientTimeout() { return slowClientTimeout_m; };
+
+    static const int DefaultNotifyHighWater = 65536;
+    static const int DefaultSlowClientTimeout = 30;
 protected:
+    XmlServer(bool eventLoop);
+    void exportOptions(ticpp::Element* pConfig);
+
     int fd_m;
+    /** If true, all clients are served by the server thread instead of
+     * one thread per client. */
+    bool eventLoop_m;
+    /** Output size (bytes) above which notifications are held back. */
+    int notifyHighWater_m;
+    /** Time (s) after which a client not reading its notifications is
+     * disconnected. 0 to never disconnect. */
+    int slowClientTimeout_m;
 private:
     std::list<ClientConnection*> connections_m;
 
     void Run (pth_sem_t * stop);
+    void RunEventLoop (pth_event_t stop);
+    void acceptClients ();
+    void pollExecutions ();
+    void closeClient (ClientConnection *con);
+    void closeStalledClients ();
+    void sendNotifications ();
+
+    int epollFd_m;
+    /** Clients of the event loop waiting for the end of an execute request. */
+    std::list<ClientConnection*> executing_m;
+    /** Clients of the event loop with notifications to send. */
+    std::list<ClientConnection*> notifying_m;
+    /** Clients of the event loop with output waiting for the socket. */
+    std::list<ClientConnection*> writing_m;
+    pth_sem_t notifySem_m;
+    static const int MaxEvents = 64;
 };
 
 class XmlInetServer : public XmlServer
 {
 public:
-    XmlInetServer(int port);
+    XmlInetServer(int port, bool eventLoop = false);
     virtual ~XmlInetServer() {};
 
     virtual void exportXml(ticpp::Element* pConfig);
@@ -65,7 +106,7 @@ private:
 class XmlUnixServer : public XmlServer
 {
 public:
-    XmlUnixServer(const char *path);
+    XmlUnixServer(const char *path, bool eventLoop = false);
     virtual ~XmlUnixServer() {};
 
     virtual void exportXml(ticpp::Element* pConfig);
@@ -76,28 +117,103 @@ private:
 class ClientConnection : public Thread, public ChangeListener
 {
 public:
-    ClientConnection (XmlServer *server, int fd);
+    ClientConnection (XmlServer *server, int fd, bool eventLoop = false);
     virtual ~ ClientConnection ();
 
     void RemoveServer() { server_m = 0; };
+    int getFd() { return fd_m; };
 
+    /** Returns 1 when a message was read, 0 if interrupted by another event
+     * than the first one of the stop ring, -1 on error or stop. */
     int readmessage (pth_event_t stop);
     int sendmessage (int size, const char * msg, pth_event_t stop);
     int sendmessage (std::string msg, pth_event_t stop);
     int sendreject (const char* msgstr, const std::string& type, pth_event_t stop);
-
+    /** Sends pMsg, written directly into the output buffer. */
+    int sendreply (ticpp::Element* pMsg, pth_event_t stop);
+
+    /** Event loop mode: reads what is available and processes complete
+     * messages. Returns false if the connection must be closed. */
+    bool onReadable ();
+    /** Event loop mode: sends pending output. Returns false on error. */
+    bool onWritable ();
+    /** Event loop mode: processes buffered messages. While an execute
+     * request is pending, checks its actions first; the server then calls
+     * this once per second. */
+    void processMessages ();
+    bool isExecuting() { return executing_m; };
+    bool isClosed() { return closed_m; };
+
+    /** Queues a notification, sent later by flushNotifications(). */
     virtual void onChange(Object* object);
-
-    std::string msg_m;
-    std::string msgbuf_m;
+    /** Sends the latest value of each object changed since the last call. */
+    int flushNotifications (pth_event_t stop);
+    /** Event loop mode: true if the output stayed above the high-water
+     * mark without the client reading any of it for longer than the slow
+     * client timeout. */
+    bool isStalled ();
+
+    /** Last message read, terminated by a null character. Points into the
+     * input buffer and stays valid until the next message is read. */
+    const char* msg_m;
 private:
     int fd_m;
     XmlServer *server_m;
+    bool eventLoop_m;
 
     typedef std::list<Object*> NotifyList_t;
     NotifyList_t notifyList_m;
+    /** Objects changed since the last notifications were sent. */
+    NotifyList_t notifyQueue_m;
+    std::set<Object*> queuedObjects_m;
+    pth_sem_t notifySem_m;
+
+    /** Actions of the current execute request. */
+    std::list<Action*> pendingActions_m;
+    bool executing_m;
+    int execTimeout_m;
+    int execCount_m;
+
+    /** Input buffer. Received data is in [inStart_m, inEnd_m[, the part
+     * before inScan_m is known not to contain any message terminator. */
+    std::vector<char> inbuf_m;
+    size_t inStart_m;
+    size_t inEnd_m;
+    size_t inScan_m;
+    static const size_t ReadSize = 4096;
+    static const size_t MaxIdleBufferSize = 65536;
+    /** Max size written at once in thread mode, the slow client timeout
+     * applies to each write. */
+    static const size_t WriteSize = 16384;
+
+    /** Set when the connection must be closed after a write error. */
+    bool closed_m;
+    /** Event loop mode state. */
+    std::string outbuf_m;
+    bool watchingWrite_m;
+    /** Time since which the output is above the high-water mark without
+     * the client reading from it, or 0. */
+    time_t congestedSince_m;
+
+    /** Replies are written in the output buffer in event loop mode, in
+     * replyBuf_m otherwise. replyStart_m is where the current one starts,
+     * flush() keeps it up to date and doesn't send past it. */
+    std::string replyBuf_m;
+    std::string::size_type replyStart_m;
 
     void Run (pth_sem_t * stop);
+    bool nextMessage ();
+    void reserveInput ();
+    void processMessage (pth_event_t stop);
+    bool pollExecution (pth_event_t stop);
+    bool flush ();
+    std::string& beginReply ();
+    int endReply (pth_event_t stop);
+    void cancelReply ();
+    void dropNotification (Object* object);
+    std::string objectValue (Object* obj);
+    int notifyHighWater() { return server_m ? server_m->getNotifyHighWater() : XmlServer::DefaultNotifyHighWater; };
+    int slowClientTimeout() { return server_m ? server_m->getSlowClientTimeout() : XmlServer::DefaultSlowClientTimeout; };
 };
 
 #endif
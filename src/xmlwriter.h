@@ -0,0 +1,152 @@
+/*
+   LinKNX KNX home automation platform
+   Copyright (C) 2007 Jean-François Meessen <linknx@ouaye.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+   */
+
+#ifndef XMLWRITER_H
+#define XMLWRITER_H
+
+#include <string>
+#include <vector>
+#include "ticpp.h"
+
+/** Appends XML to a string as it is produced, without building a document.
+ * Attributes must be written right after their element is started. The
+ * output is indented like ticpp::Document::GetAsString(): one element per
+ * line, except for elements containing only text. */
+class XmlWriter
+{
+public:
+    XmlWriter(std::string& out) : out_m(out), tagOpen_m(false), inlineText_m(false) {};
+
+    XmlWriter& startElement(const std::string& name)
+    {
+        if (tagOpen_m)
+        {
+            out_m.append(">\n");
+            tagOpen_m = false;
+        }
+        else if (inlineText_m)
+        {
+            out_m.append(1, '\n');
+            inlineText_m = false;
+        }
+        out_m.append(elements_m.size(), '\t').append(1, '<').append(name);
+        elements_m.push_back(name);
+        tagOpen_m = true;
+        return *this;
+    };
+
+    /** Starts an element with the name and attributes of pElem. */
+    XmlWriter& startElement(ticpp::Element* pElem)
+    {
+        startElement(pElem->Value());
+        for (ticpp::Attribute* pAttr = pElem->FirstAttribute(false); pAttr; pAttr = pAttr->Next(false))
+            attribute(pAttr->Name(), pAttr->Value());
+        return *this;
+    };
+
+    XmlWriter& attribute(const std::string& name, const std::string& value)
+    {
+        out_m.append(1, ' ').append(name).append("=\"");
+        escape(value);
+        out_m.append(1, '"');
+        return *this;
+    };
+
+    XmlWriter& text(const std::string& value)
+    {
+        if (tagOpen_m)
+        {
+            out_m.append(1, '>');
+            tagOpen_m = false;
+            inlineText_m = true;
+        }
+        escape(value);
+        return *this;
+    };
+
+    XmlWriter& endElement()
+    {
+        if (tagOpen_m)
+            out_m.append(" />\n");
+        else if (inlineText_m)
+            out_m.append("</").append(elements_m.back()).append(">\n");
+        else
+            out_m.append(elements_m.size() - 1, '\t').append("</").append(elements_m.back()).append(">\n");
+        tagOpen_m = false;
+        inlineText_m = false;
+        elements_m.pop_back();
+        return *this;
+    };
+
+    /** Writes pElem with its attributes, elements and text. */
+    void element(ticpp::Element* pElem)
+    {
+        startElement(pElem);
+        for (ticpp::Node* pChild = pElem->FirstChild(false); pChild; pChild = pChild->NextSibling(false))
+        {
+            if (pChild->Type() == TiXmlNode::ELEMENT)
+                element(pChild->ToElement());
+            else if (pChild->Type() == TiXmlNode::TEXT)
+                text(pChild->Value());
+        }
+        endElement();
+    };
+
+private:
+    std::string& out_m;
+    std::vector<std::string> elements_m;
+    bool tagOpen_m;
+    /** True while writing the text of an element without child elements. */
+    bool inlineText_m;
+
+    /** Control characters are written as character references, a raw
+     * 0x04 would end the message on the client side. */
+    void escape(const std::string& value)
+    {
+        static const char hex[] = "0123456789ABCDEF";
+        std::string::size_type start = 0, i;
+        for (i = 0; i < value.size(); i++)
+        {
+            unsigned char c = value[i];
+            const char* entity;
+            switch (c)
+            {
+            case '&': entity = "&amp;"; break;
+            case '<': entity = "&lt;"; break;
+            case '>': entity = "&gt;"; break;
+            case '"': entity = "&quot;"; break;
+            case '\'': entity = "&apos;"; break;
+            case '\t': case '\n': case '\r': continue;
+            default:
+                if (c >= 0x20)
+                    continue;
+                entity = 0;
+            }
+            out_m.append(value, start, i - start);
+            if (entity)
+                out_m.append(entity);
+            else
+                out_m.append("&#x").append(1, hex[c >> 4]).append(1, hex[c & 0xf]).append(1, ';');
+            start = i + 1;
+        }
+        out_m.append(value, start, std::string::npos);
+    };
+};
+
+#endif
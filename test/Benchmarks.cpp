@@ -0,0 +1,205 @@
+#include <cppunit/extensions/HelperMacros.h>
+#include <sys/time.h>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include "objectcontroller.h"
+#include "services.h"
+#include "ruleserver.h"
+
+// Benchmarks are not part of the unit tests run by 'make check', they are
+// only run by 'testmain --benchmark'.
+
+static double elapsedSince(const struct timeval& start)
+{
+    struct timeval end;
+    gettimeofday(&end, 0);
+    return (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+}
+
+class TelegramFrameBenchmark : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE( TelegramFrameBenchmark );
+    CPPUNIT_TEST( benchEncodeRate );
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void tearDown()
+    {
+        ObjectController::reset();
+        Services::reset();
+    }
+
+    // Reports how many telegrams per second each object type can encode.
+    // There is no bus connection, so KnxConnection::write() returns right
+    // away: this measures the encoding only, not the transmit queue nor the
+    // socket.
+    void benchEncodeRate()
+    {
+        const char* types[] = { "1.001", "2.001", "3.007", "5.001", "5.xxx", "6.xxx", "7.xxx",
+            "8.xxx", "9.001", "10.001", "11.001", "12.xxx", "13.xxx", "14.xxx",
+            "16.000", "16.001", "20.102", "28.001", "232.600", "251.600", 0 };
+        const int count = 20000;
+
+        std::cout << std::endl;
+        for (int i = 0; types[i]; i++)
+        {
+            ticpp::Element pConfig;
+            pConfig.SetAttribute("id", "bench");
+            pConfig.SetAttribute("type", types[i]);
+            pConfig.SetAttribute("gad", "1/2/3");
+            Object* obj = Object::create(&pConfig);
+            CPPUNIT_ASSERT(obj);
+
+            struct timeval start;
+            gettimeofday(&start, 0);
+            for (int j = 0; j < count; j++)
+                obj->doSend(true);
+            double elapsed = elapsedSince(start);
+
+            std::cout << "  " << std::setw(8) << types[i] << ": ";
+            if (elapsed > 0)
+                std::cout << static_cast<long>(count / elapsed) << " encodes/s" << std::endl;
+            else
+                std::cout << "> " << count * 1000000L << " encodes/s" << std::endl;
+            delete obj;
+        }
+    }
+};
+
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION( TelegramFrameBenchmark, "Benchmark" );
+
+class ConditionProgramBenchmark : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE( ConditionProgramBenchmark );
+    CPPUNIT_TEST( benchEvaluationRate );
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    Condition* parse(const std::string& xml)
+    {
+        ticpp::Document doc;
+        doc.LoadFromString(xml);
+        return Condition::create(doc.FirstChildElement(), 0);
+    }
+
+    Object* addObject(const std::string& id, const std::string& type, const std::string& value)
+    {
+        ticpp::Element pConfig;
+        pConfig.SetAttribute("id", id);
+        pConfig.SetAttribute("type", type);
+        pConfig.SetAttribute("init", value);
+        Object* obj = Object::create(&pConfig);
+        ObjectController::instance()->addObject(obj);
+        obj->onUpdate();
+        return obj;
+    }
+
+public:
+    void tearDown()
+    {
+        ObjectController::reset();
+    }
+
+    // Compares how many conditions per second are evaluated through the
+    // tree and through compiled programs, for synthetic rule sets where one
+    // object changes between two passes.
+    void benchEvaluationRate()
+    {
+        const int objectCount = 32;
+        const int ruleCount = 50;
+        const int passes = 100;
+        std::vector<Object*> objects;
+        for (int i = 0; i < objectCount; i++)
+        {
+            std::stringstream id;
+            id << "bench" << i;
+            objects.push_back(addObject(id.str(), "5.xxx", "0"));
+        }
+
+        const char* shapes[] = { "flat", "nested", "compare", 0 };
+        unsigned int seed = 12345;
+        std::cout << std::endl;
+        for (int shape = 0; shapes[shape]; shape++)
+        {
+            std::vector<Condition*> conditions;
+            std::vector<ConditionProgram> programs(ruleCount);
+            for (int r = 0; r < ruleCount; r++)
+            {
+                std::stringstream xml;
+                int ids[6];
+                for (int k = 0; k < 6; k++)
+                {
+                    seed = seed * 1103515245 + 12345;
+                    ids[k] = (seed >> 16) % objectCount;
+                }
+                if (shape == 0)
+                {
+                    xml << "<condition type='and'>";
+                    for (int k = 0; k < 4; k++)
+                        xml << "<condition type='object' id='bench" << ids[k] << "' value='" << 50 * k << "' op='gte'/>";
+                    xml << "</condition>";
+                }
+                else if (shape == 1)
+                {
+                    xml << "<condition type='or'>";
+                    for (int k = 0; k < 6; k += 2)
+                    {
+                        xml << "<condition type='and'>"
+                            << "<condition type='object' id='bench" << ids[k] << "' value='100' op='gt'/>"
+                            << "<condition type='not'><condition type='object' id='bench" << ids[k+1] << "' value='200' op='lt'/></condition>"
+                            << "</condition>";
+                    }
+                    xml << "</condition>";
+                }
+                else
+                {
+                    xml << "<condition type='and'>";
+                    for (int k = 0; k < 6; k += 2)
+                        xml << "<condition type='object-compare' id='bench" << ids[k] << "' id2='bench" << ids[k+1] << "' op='lte'/>";
+                    xml << "</condition>";
+                }
+                Condition* cond = parse(xml.str());
+                programs[r].compile(cond);
+                conditions.push_back(cond);
+            }
+
+            double elapsed[2];
+            for (int mode = 0; mode < 2; mode++)
+            {
+                struct timeval start;
+                gettimeofday(&start, 0);
+                for (int p = 0; p < passes; p++)
+                {
+                    std::stringstream value;
+                    value << (p * 37) % 256;
+                    objects[p % objectCount]->setValue(value.str());
+                    for (int r = 0; r < ruleCount; r++)
+                    {
+                        if (mode == 0)
+                            conditions[r]->evaluate();
+                        else
+                            programs[r].evaluate();
+                    }
+                }
+                elapsed[mode] = elapsedSince(start);
+            }
+
+            std::cout << "  " << shapes[shape] << ":";
+            for (int mode = 0; mode < 2; mode++)
+            {
+                std::cout << (mode == 0 ? " tree " : ", compiled ");
+                if (elapsed[mode] > 0)
+                    std::cout << static_cast<long>(ruleCount * passes / elapsed[mode]) << " evals/s";
+                else
+                    std::cout << "> " << ruleCount * passes * 1000000L << " evals/s";
+            }
+            std::cout << std::endl;
+
+            for (int r = 0; r < ruleCount; r++)
+                delete conditions[r];
+        }
+    }
+};
+
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION( ConditionProgramBenchmark, "Benchmark" );
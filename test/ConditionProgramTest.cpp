@@ -0,0 +1,148 @@
+#include <cppunit/extensions/HelperMacros.h>
+#include "ruleserver.h"
+#include "objectcontroller.h"
+
+class ConditionProgramTest : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE( ConditionProgramTest );
+    CPPUNIT_TEST( testEquivalence );
+    CPPUNIT_TEST( testEmptyAndOr );
+    CPPUNIT_TEST( testFallback );
+    CPPUNIT_TEST( testReorder );
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    Condition* parse(const std::string& xml)
+    {
+        ticpp::Document doc;
+        doc.LoadFromString(xml);
+        return Condition::create(doc.FirstChildElement(), 0);
+    }
+
+    Object* addObject(const std::string& id, const std::string& type, const std::string& value)
+    {
+        ticpp::Element pConfig;
+        pConfig.SetAttribute("id", id);
+        pConfig.SetAttribute("type", type);
+        pConfig.SetAttribute("init", value);
+        Object* obj = Object::create(&pConfig);
+        ObjectController::instance()->addObject(obj);
+        // init only sets the value, mark the object as initialized
+        obj->onUpdate();
+        return obj;
+    }
+
+public:
+    void setUp()
+    {
+    }
+
+    void tearDown()
+    {
+        ObjectController::reset();
+    }
+
+    void testEquivalence()
+    {
+        Object* sw1 = addObject("sw1", "1.001", "off");
+        Object* sw2 = addObject("sw2", "1.001", "off");
+        Object* v1 = addObject("v1", "5.xxx", "50");
+        Object* v2 = addObject("v2", "5.xxx", "100");
+
+        Condition* cond = parse(
+            "<condition type='or'>"
+            "  <condition type='and'>"
+            "    <condition type='object' id='sw1' value='on'/>"
+            "    <condition type='not'><condition type='object' id='sw2' value='on'/></condition>"
+            "  </condition>"
+            "  <condition type='and'>"
+            "    <condition type='object' id='v1' value='100' op='gt'/>"
+            "    <condition type='object-compare' id='v1' id2='v2' op='lte'/>"
+            "  </condition>"
+            "  <condition type='not'>"
+            "    <condition type='or'>"
+            "      <condition type='object' id='sw2' value='off'/>"
+            "      <condition type='object' id='v2' value='150' op='lt'/>"
+            "    </condition>"
+            "  </condition>"
+            "</condition>");
+        ConditionProgram program;
+        cond->compile(program);
+
+        for (int i = 0; i < 16; i++)
+        {
+            sw1->setValue(i & 1 ? "on" : "off");
+            sw2->setValue(i & 2 ? "on" : "off");
+            v1->setValue(i & 4 ? "150" : "50");
+            v2->setValue(i & 8 ? "200" : "100");
+            CPPUNIT_ASSERT_EQUAL(cond->evaluate(), program.evaluate());
+        }
+        delete cond;
+    }
+
+    void testEmptyAndOr()
+    {
+        Condition* cond = parse("<condition type='and'/>");
+        ConditionProgram program;
+        cond->compile(program);
+        CPPUNIT_ASSERT(program.evaluate());
+        delete cond;
+
+        cond = parse("<condition type='or'/>");
+        program.clear();
+        cond->compile(program);
+        CPPUNIT_ASSERT(!program.evaluate());
+        delete cond;
+    }
+
+    void testFallback()
+    {
+        addObject("sw1", "1.001", "on");
+        addObject("sw2", "1.001", "on");
+        Condition* cond = parse(
+            "<condition type='and'>"
+            "  <condition type='object' id='sw1' value='on'/>"
+            "  <condition type='object-src' id='sw2' value='on' src='1.1.1'/>"
+            "</condition>");
+        ConditionProgram program;
+        cond->compile(program);
+        // The source condition is called through the tree
+        CPPUNIT_ASSERT_EQUAL(cond->evaluate(), program.evaluate());
+        CPPUNIT_ASSERT(!program.evaluate());
+        delete cond;
+    }
+
+    void testReorder()
+    {
+        addObject("sw1", "1.001", "off");
+        addObject("v1", "5.xxx", "50");
+        Condition* cond = parse(
+            "<condition type='and'>"
+            "  <condition type='object' id='v1' value='50'/>"
+            "  <condition type='object' id='sw1' value='on'/>"
+            "</condition>");
+        ConditionProgram program;
+        program.compile(cond);
+        for (int i = 0; i < 100; i++)
+        {
+            CPPUNIT_ASSERT(!program.evaluate());
+            CPPUNIT_ASSERT(!program.isOutdated());
+        }
+
+        // The condition ending the evaluation was moved first, the other
+        // one stopped being evaluated once the program was recompiled
+        ticpp::Element status("condition");
+        cond->statusXml(&status);
+        ticpp::Element* pV1 = status.FirstChildElement("condition");
+        ticpp::Element* pSw1 = pV1->NextSiblingElement("condition");
+        CPPUNIT_ASSERT_EQUAL(std::string("1"), pV1->GetAttribute("order"));
+        CPPUNIT_ASSERT_EQUAL(std::string("0"), pSw1->GetAttribute("order"));
+        CPPUNIT_ASSERT_EQUAL(std::string("100"), pSw1->GetAttribute("evaluations"));
+        int v1Count;
+        pV1->GetAttribute("evaluations", &v1Count);
+        CPPUNIT_ASSERT(v1Count > 0 && v1Count < 100);
+        delete cond;
+    }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION( ConditionProgramTest );
@@ -1,4 +1,5 @@
 #include <cppunit/extensions/HelperMacros.h>
+#include <vector>
 #include "timermanager.h"
 
 class ExceptionDaysTest : public CppUnit::TestFixture
@@ -9,6 +10,8 @@ class ExceptionDaysTest : public CppUnit::TestFixture
     CPPUNIT_TEST( testIsException );
     CPPUNIT_TEST( testIsExceptionWildcard );
     CPPUNIT_TEST( testIsExceptionWildcard2 );
+    CPPUNIT_TEST( testIsExceptionIndex );
+    CPPUNIT_TEST( testIsExceptionRange );
     CPPUNIT_TEST_SUITE_END();
 
 private:
@@ -204,6 +207,72 @@ public:
         CPPUNIT_ASSERT(!exceptiondays_m->isException(time));
     }
 
+    void testIsExceptionIndex()
+    {
+        // Every 15th, all of August, all of 2009 and 2010-03-02
+        DaySpec* ds1 = new DaySpec();
+        ds1->mday_m = 15;
+        exceptiondays_m->addDay(ds1);
+        DaySpec* ds2 = new DaySpec();
+        ds2->mon_m = 7;
+        exceptiondays_m->addDay(ds2);
+        DaySpec* ds3 = new DaySpec();
+        ds3->year_m = 109;
+        exceptiondays_m->addDay(ds3);
+        DaySpec* ds4 = new DaySpec();
+        ds4->mday_m = 2;
+        ds4->mon_m = 2;
+        ds4->year_m = 110;
+        exceptiondays_m->addDay(ds4);
+
+        CPPUNIT_ASSERT(exceptiondays_m->isException(15, 0, 108));
+        CPPUNIT_ASSERT(!exceptiondays_m->isException(16, 0, 108));
+        CPPUNIT_ASSERT(exceptiondays_m->isException(31, 7, 108));
+        CPPUNIT_ASSERT(exceptiondays_m->isException(1, 0, 109));
+        CPPUNIT_ASSERT(exceptiondays_m->isException(2, 2, 110));
+        CPPUNIT_ASSERT(!exceptiondays_m->isException(2, 2, 111));
+        CPPUNIT_ASSERT(!exceptiondays_m->isException(3, 2, 110));
+
+        exceptiondays_m->removeDay(ds2);
+        delete ds2;
+        CPPUNIT_ASSERT(!exceptiondays_m->isException(31, 7, 108));
+        CPPUNIT_ASSERT(exceptiondays_m->isException(15, 7, 108));
+
+        exceptiondays_m->clear();
+        CPPUNIT_ASSERT(!exceptiondays_m->isException(15, 0, 108));
+        CPPUNIT_ASSERT(!exceptiondays_m->isException(1, 0, 109));
+    }
+
+    void testIsExceptionRange()
+    {
+        DaySpec* ds1 = new DaySpec();
+        ds1->mday_m = 1;
+        exceptiondays_m->addDay(ds1);
+        DaySpec* ds2 = new DaySpec();
+        ds2->mday_m = 30;
+        ds2->mon_m = 2;
+        ds2->year_m = 108;
+        exceptiondays_m->addDay(ds2);
+
+        // From 2008-03-28 to 2008-04-02, across the DST change
+        struct tm timeinfo;
+        timeinfo.tm_hour = 23;
+        timeinfo.tm_min = 30;
+        timeinfo.tm_sec = 0;
+        timeinfo.tm_mday = 28;
+        timeinfo.tm_mon = 2;
+        timeinfo.tm_year = 108;
+        timeinfo.tm_isdst = -1;
+        time_t start = mktime(&timeinfo);
+
+        std::vector<bool> result;
+        exceptiondays_m->isException(start, 6, result);
+        CPPUNIT_ASSERT_EQUAL(6, (int)result.size());
+        const bool expected[] = { false, false, true, false, true, false };
+        for (int i = 0; i < 6; i++)
+            CPPUNIT_ASSERT_EQUAL(expected[i], (bool)result[i]);
+    }
+
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION( ExceptionDaysTest );
@@ -0,0 +1,633 @@
+#include <cppunit/extensions/HelperMacros.h>
+#include <sys/time.h>
+#include <sstream>
+#include "knxconnection.h"
+#include "objectcontroller.h"
+#include "eibtypes.h"
+extern "C"
+{
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+}
+
+// Minimal eibd group socket server, run by the test thread
+class FakeEibd
+{
+public:
+    FakeEibd(const char* path) : path_m(path), fd_m(-1)
+    {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_LOCAL;
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+        unlink(path);
+        listenFd_m = socket(AF_LOCAL, SOCK_STREAM, 0);
+        CPPUNIT_ASSERT(listenFd_m != -1);
+        CPPUNIT_ASSERT_EQUAL(0, bind(listenFd_m, (struct sockaddr *) &addr, sizeof(addr)));
+        CPPUNIT_ASSERT_EQUAL(0, listen(listenFd_m, 1));
+    }
+
+    ~FakeEibd()
+    {
+        disconnect();
+        close(listenFd_m);
+        unlink(path_m.c_str());
+    }
+
+    // Accepts a client and opens its group socket
+    bool accept(int timeoutMs = 2000)
+    {
+        pth_event_t tmout = timeout(timeoutMs);
+        fd_m = pth_accept_ev(listenFd_m, 0, 0, tmout);
+        std::string packet;
+        bool ok = fd_m != -1 && readPacket(packet, tmout) && type(packet) == EIB_OPEN_GROUPCON;
+        pth_event_free(tmout, PTH_FREE_THIS);
+        if (ok)
+        {
+            uint8_t reply[4] = { 0, 2, EIB_OPEN_GROUPCON >> 8, EIB_OPEN_GROUPCON & 0xff };
+            ok = pth_write(fd_m, reply, 4) == 4;
+        }
+        return ok;
+    }
+
+    // Reads the next telegram sent by the client
+    bool receive(eibaddr_t& dest, std::string& apdu, int timeoutMs = 2000)
+    {
+        pth_event_t tmout = timeout(timeoutMs);
+        std::string packet;
+        bool ok = readPacket(packet, tmout) && type(packet) == EIB_GROUP_PACKET && packet.size() >= 6;
+        pth_event_free(tmout, PTH_FREE_THIS);
+        if (ok)
+        {
+            dest = ((uint8_t)packet[2] << 8) | (uint8_t)packet[3];
+            apdu = packet.substr(4);
+        }
+        return ok;
+    }
+
+    // Sends a telegram from the bus to the client
+    void send(eibaddr_t src, eibaddr_t dest, const TelegramFrame& frame)
+    {
+        queue(src, dest, frame);
+        flush();
+    }
+
+    // Same as send(), the telegrams queued are sent at once by flush()
+    void queue(eibaddr_t src, eibaddr_t dest, const TelegramFrame& frame)
+    {
+        std::string packet(2, '\0');
+        packet.append(1, EIB_GROUP_PACKET >> 8).append(1, EIB_GROUP_PACKET & 0xff);
+        packet.append(1, src >> 8).append(1, src & 0xff);
+        packet.append(1, dest >> 8).append(1, dest & 0xff);
+        packet.append(reinterpret_cast<const char*>(frame.getBuffer()), frame.getLength());
+        packet[0] = (packet.size() - 2) >> 8;
+        packet[1] = (packet.size() - 2) & 0xff;
+        pending_m.append(packet);
+    }
+
+    void flush()
+    {
+        CPPUNIT_ASSERT_EQUAL((ssize_t)pending_m.size(), write(fd_m, pending_m.data(), pending_m.size()));
+        pending_m.clear();
+    }
+
+    void disconnect()
+    {
+        if (fd_m != -1)
+            close(fd_m);
+        fd_m = -1;
+    }
+
+private:
+    std::string path_m;
+    int listenFd_m;
+    int fd_m;
+    std::string pending_m;
+
+    static pth_event_t timeout(int ms)
+    {
+        return pth_event(PTH_EVENT_TIME, pth_timeout(ms / 1000, (ms % 1000) * 1000));
+    }
+
+    static int type(const std::string& packet)
+    {
+        return packet.size() < 2 ? -1 : ((uint8_t)packet[0] << 8) | (uint8_t)packet[1];
+    }
+
+    bool readFully(char* buf, int len, pth_event_t tmout)
+    {
+        while (len > 0)
+        {
+            int i = pth_read_ev(fd_m, buf, len, tmout);
+            if (i <= 0)
+                return false;
+            buf += i;
+            len -= i;
+        }
+        return true;
+    }
+
+    bool readPacket(std::string& packet, pth_event_t tmout)
+    {
+        uint8_t head[2];
+        if (!readFully(reinterpret_cast<char*>(head), 2, tmout))
+            return false;
+        packet.resize((head[0] << 8) | head[1]);
+        return packet.empty() || readFully(&packet[0], packet.size(), tmout);
+    }
+};
+
+class CoalescingListener : public TelegramListener
+{
+public:
+    virtual void onWrite(eibaddr_t src, eibaddr_t dest, const uint8_t* buf, int len) {};
+    virtual void onRead(eibaddr_t src, eibaddr_t dest, const uint8_t* buf, int len) {};
+    virtual void onResponse(eibaddr_t src, eibaddr_t dest, const uint8_t* buf, int len) {};
+    virtual bool canCoalesce(eibaddr_t dest) { return true; };
+};
+
+// Records the telegrams dispatched, as "W 1/1/1 1 from 1.1.1" or "R 1/1/1"
+class RecordingTelegramListener : public TelegramListener
+{
+public:
+    virtual void onWrite(eibaddr_t src, eibaddr_t dest, const uint8_t* buf, int len)
+    {
+        std::stringstream event;
+        event << "W " << Object::WriteGroupAddr(dest) << " " << (buf[1] & 0x3F) << " from " << Object::WriteAddr(src);
+        events_m.push_back(event.str());
+    };
+    virtual void onRead(eibaddr_t src, eibaddr_t dest, const uint8_t* buf, int len)
+    {
+        events_m.push_back("R " + Object::WriteGroupAddr(dest));
+    };
+    virtual void onResponse(eibaddr_t src, eibaddr_t dest, const uint8_t* buf, int len) {};
+    virtual bool canCoalesce(eibaddr_t dest) { return true; };
+    std::vector<std::string> events_m;
+};
+
+class RecordingReadListener : public ReadRequestListener
+{
+public:
+    virtual void onReadCompleted(eibaddr_t gad, bool success)
+    {
+        results_m.push_back(std::make_pair(Object::WriteGroupAddr(gad), success));
+    };
+    std::vector<std::pair<std::string, bool> > results_m;
+};
+
+class KnxConnectionTest : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE( KnxConnectionTest );
+    CPPUNIT_TEST( testTxCoalescing );
+    CPPUNIT_TEST( testTxNoCoalescing );
+    CPPUNIT_TEST( testTxOverflow );
+    CPPUNIT_TEST( testTxRate );
+    CPPUNIT_TEST( testRxCoalescing );
+    CPPUNIT_TEST( testReadMatching );
+    CPPUNIT_TEST( testReadTimeout );
+    CPPUNIT_TEST( testReadAheadOfTxQueue );
+    CPPUNIT_TEST( testDuplicateRead );
+    CPPUNIT_TEST( testReadQueue );
+    CPPUNIT_TEST( testReadQueueDisconnect );
+    CPPUNIT_TEST( testReadQueuePromotion );
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    FakeEibd* eibd_m;
+    KnxConnection* con_m;
+    std::string path_m;
+
+    // Configures the connection to use the fake eibd
+    void configure(ticpp::Element& pConfig)
+    {
+        pConfig.SetAttribute("url", "local:" + path_m);
+        con_m->importXml(&pConfig);
+    }
+
+    void connect()
+    {
+        con_m->startConnection();
+        CPPUNIT_ASSERT(eibd_m->accept());
+        for (int i = 0; i < 200 && !con_m->isReady(); i++)
+            pth_usleep(10000);
+        CPPUNIT_ASSERT(con_m->isReady());
+    }
+
+    void write(const char* gad, uint8_t value, KnxConnection::Priority priority = KnxConnection::Normal)
+    {
+        con_m->write(Object::ReadGroupAddr(gad), TelegramFrame(true, value), priority);
+    }
+
+    void assertReceived(const char* gad, uint8_t value)
+    {
+        eibaddr_t dest;
+        std::string apdu;
+        CPPUNIT_ASSERT(eibd_m->receive(dest, apdu));
+        CPPUNIT_ASSERT_EQUAL(std::string(gad), Object::WriteGroupAddr(dest));
+        CPPUNIT_ASSERT_EQUAL((size_t)2, apdu.size());
+        CPPUNIT_ASSERT_EQUAL((int)(0x80 | value), (int)(uint8_t)apdu[1]);
+    }
+
+    void assertReadRequest(const char* gad)
+    {
+        eibaddr_t dest;
+        std::string apdu;
+        CPPUNIT_ASSERT(eibd_m->receive(dest, apdu));
+        CPPUNIT_ASSERT_EQUAL(std::string(gad), Object::WriteGroupAddr(dest));
+        CPPUNIT_ASSERT_EQUAL(0, (uint8_t)apdu[1] & 0xC0);
+    }
+
+    // Waits until listener got count results
+    void waitForResults(RecordingReadListener& listener, size_t count)
+    {
+        for (int i = 0; i < 200 && listener.results_m.size() < count; i++)
+            pth_usleep(10000);
+        CPPUNIT_ASSERT_EQUAL(count, listener.results_m.size());
+    }
+
+    // Sends a read request to 15/7/255 from the bus after the telegrams
+    // queued in the fake eibd, and lets the connection thread run until it
+    // was dispatched. Telegrams are dispatched in order, so all the others
+    // have been handled too.
+    void flushAndSync(RecordingTelegramListener& listener)
+    {
+        static const uint8_t readApdu[] = { 0, 0 };
+        TelegramFrame read;
+        read.assign(readApdu, sizeof(readApdu));
+        eibd_m->queue(Object::ReadAddr("1.1.1"), Object::ReadGroupAddr("15/7/255"), read);
+        eibd_m->flush();
+        for (int i = 0; i < 100000; i++)
+        {
+            if (!listener.events_m.empty() && listener.events_m.back() == "R 15/7/255")
+            {
+                listener.events_m.pop_back();
+                return;
+            }
+            pth_yield(NULL);
+        }
+        CPPUNIT_FAIL("Telegrams not dispatched");
+    }
+
+    void assertNothingReceived()
+    {
+        eibaddr_t dest;
+        std::string apdu;
+        CPPUNIT_ASSERT(!eibd_m->receive(dest, apdu, 200));
+    }
+
+    std::string status(const char* attr)
+    {
+        ticpp::Element pStatus("knxconnection");
+        con_m->statusXml(&pStatus);
+        return pStatus.GetAttribute(attr);
+    }
+
+public:
+    void setUp()
+    {
+        // One socket per test and process, so that concurrent runs don't collide
+        static int count = 0;
+        std::stringstream path;
+        path << "/tmp/linknx_unittest_eibd_" << getpid() << "_" << ++count;
+        path_m = path.str();
+        eibd_m = new FakeEibd(path_m.c_str());
+        con_m = new KnxConnection();
+    }
+
+    void tearDown()
+    {
+        con_m->stopConnection();
+        delete con_m;
+        delete eibd_m;
+    }
+
+    void testTxCoalescing()
+    {
+        CoalescingListener listener;
+        con_m->addTelegramListener(&listener);
+        ticpp::Element pConfig("knxconnection");
+        pConfig.SetAttribute("tx-coalesce", "true");
+        configure(pConfig);
+        connect();
+
+        // Queued before the sender thread gets to run
+        write("1/1/1", 1);
+        write("1/1/2", 1);
+        write("1/1/1", 2);
+        assertReceived("1/1/1", 2);
+        assertReceived("1/1/2", 1);
+        assertNothingReceived();
+        CPPUNIT_ASSERT_EQUAL(std::string("1"), status("tx-coalesced"));
+        con_m->removeTelegramListener(&listener);
+    }
+
+    void testTxNoCoalescing()
+    {
+        CoalescingListener listener;
+        con_m->addTelegramListener(&listener);
+        ticpp::Element pConfig("knxconnection");
+        configure(pConfig);
+        connect();
+
+        // Without tx-coalesce, every write is sent in order
+        write("1/1/1", 1);
+        write("1/1/1", 0);
+        write("1/1/1", 1);
+        assertReceived("1/1/1", 1);
+        assertReceived("1/1/1", 0);
+        assertReceived("1/1/1", 1);
+        CPPUNIT_ASSERT_EQUAL(std::string("0"), status("tx-coalesced"));
+
+        // Invalid telegrams are rejected instead of bypassing the queue
+        uint8_t buf[1] = { 0 };
+        con_m->write(Object::ReadGroupAddr("1/1/2"), buf, 1);
+        assertNothingReceived();
+        con_m->removeTelegramListener(&listener);
+    }
+
+    void testTxOverflow()
+    {
+        ticpp::Element pConfig("knxconnection");
+        pConfig.SetAttribute("tx-queue-size", 3);
+        configure(pConfig);
+        connect();
+
+        // The oldest telegrams are dropped
+        write("1/1/1", 1);
+        write("1/1/2", 1);
+        write("1/1/3", 1);
+        write("1/1/4", 1);
+        write("1/1/5", 1);
+        assertReceived("1/1/3", 1);
+        assertReceived("1/1/4", 1);
+        assertReceived("1/1/5", 1);
+        assertNothingReceived();
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), status("tx-dropped"));
+
+        // A lower priority telegram is dropped itself, a higher priority
+        // one replaces the oldest of the lowest priority
+        write("1/1/1", 1);
+        write("1/1/2", 1);
+        write("1/1/3", 1);
+        write("1/1/9", 1, KnxConnection::Low);
+        write("1/1/10", 1, KnxConnection::High);
+        assertReceived("1/1/10", 1);
+        assertReceived("1/1/2", 1);
+        assertReceived("1/1/3", 1);
+        assertNothingReceived();
+        CPPUNIT_ASSERT_EQUAL(std::string("4"), status("tx-dropped"));
+    }
+
+    void testTxRate()
+    {
+        ticpp::Element pConfig("knxconnection");
+        pConfig.SetAttribute("tx-rate", 20);
+        configure(pConfig);
+        connect();
+
+        struct timeval start, end;
+        gettimeofday(&start, 0);
+        write("1/1/1", 1);
+        write("1/1/2", 1);
+        write("1/1/3", 1);
+        write("1/1/4", 1);
+        assertReceived("1/1/1", 1);
+        assertReceived("1/1/2", 1);
+        assertReceived("1/1/3", 1);
+        assertReceived("1/1/4", 1);
+        gettimeofday(&end, 0);
+        // The first telegram is sent immediately, then one every 50ms
+        int elapsed = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
+        CPPUNIT_ASSERT(elapsed >= 140);
+        CPPUNIT_ASSERT(elapsed < 1000);
+    }
+
+    void testRxCoalescing()
+    {
+        RecordingTelegramListener listener;
+        con_m->addTelegramListener(&listener);
+        ticpp::Element pConfig("knxconnection");
+        pConfig.SetAttribute("batch-size", 8);
+        configure(pConfig);
+        connect();
+
+        // Received in a single batch: only the last write to each address
+        // is dispatched, in the order of the telegrams kept, with the
+        // source address of its own sender
+        eibaddr_t src = Object::ReadAddr("1.1.1");
+        eibaddr_t src2 = Object::ReadAddr("1.1.2");
+        eibd_m->queue(src, Object::ReadGroupAddr("1/1/1"), TelegramFrame(true, 1));
+        eibd_m->queue(src, Object::ReadGroupAddr("1/1/2"), TelegramFrame(true, 1));
+        eibd_m->queue(src2, Object::ReadGroupAddr("1/1/1"), TelegramFrame(true, 2));
+        eibd_m->queue(src, Object::ReadGroupAddr("1/1/3"), TelegramFrame(true, 1));
+        eibd_m->queue(src, Object::ReadGroupAddr("1/1/2"), TelegramFrame(true, 2));
+        flushAndSync(listener);
+        CPPUNIT_ASSERT_EQUAL((size_t)3, listener.events_m.size());
+        CPPUNIT_ASSERT_EQUAL(std::string("W 1/1/1 2 from 1.1.2"), listener.events_m[0]);
+        CPPUNIT_ASSERT_EQUAL(std::string("W 1/1/3 1 from 1.1.1"), listener.events_m[1]);
+        CPPUNIT_ASSERT_EQUAL(std::string("W 1/1/2 2 from 1.1.1"), listener.events_m[2]);
+
+        // A write before a read is kept
+        static const uint8_t readApdu[] = { 0, 0 };
+        TelegramFrame read;
+        read.assign(readApdu, sizeof(readApdu));
+        listener.events_m.clear();
+        eibd_m->queue(src, Object::ReadGroupAddr("1/1/1"), TelegramFrame(true, 3));
+        eibd_m->queue(src, Object::ReadGroupAddr("1/1/1"), read);
+        eibd_m->queue(src, Object::ReadGroupAddr("1/1/1"), TelegramFrame(true, 4));
+        flushAndSync(listener);
+        CPPUNIT_ASSERT_EQUAL((size_t)3, listener.events_m.size());
+        CPPUNIT_ASSERT_EQUAL(std::string("W 1/1/1 3 from 1.1.1"), listener.events_m[0]);
+        CPPUNIT_ASSERT_EQUAL(std::string("R 1/1/1"), listener.events_m[1]);
+        CPPUNIT_ASSERT_EQUAL(std::string("W 1/1/1 4 from 1.1.1"), listener.events_m[2]);
+        con_m->removeTelegramListener(&listener);
+    }
+
+    void testReadMatching()
+    {
+        RecordingReadListener listener;
+        ticpp::Element pConfig("knxconnection");
+        configure(pConfig);
+        connect();
+        con_m->requestRead(Object::ReadGroupAddr("1/1/1"), &listener);
+        con_m->requestRead(Object::ReadGroupAddr("1/1/2"), &listener);
+        assertReadRequest("1/1/1");
+        assertReadRequest("1/1/2");
+
+        // Only a response to the same address completes a request
+        eibd_m->send(Object::ReadAddr("1.1.1"), Object::ReadGroupAddr("1/1/2"), TelegramFrame(false, 1));
+        waitForResults(listener, 1);
+        CPPUNIT_ASSERT(listener.results_m[0] == std::make_pair(std::string("1/1/2"), true));
+        CPPUNIT_ASSERT(con_m->isReadPending(Object::ReadGroupAddr("1/1/1")));
+        CPPUNIT_ASSERT(!con_m->isReadPending(Object::ReadGroupAddr("1/1/2")));
+        eibd_m->send(Object::ReadAddr("1.1.1"), Object::ReadGroupAddr("1/1/1"), TelegramFrame(true, 1));
+        pth_usleep(100000);
+        CPPUNIT_ASSERT_EQUAL((size_t)1, listener.results_m.size());
+        eibd_m->send(Object::ReadAddr("1.1.1"), Object::ReadGroupAddr("1/1/1"), TelegramFrame(false, 1));
+        waitForResults(listener, 2);
+        CPPUNIT_ASSERT(listener.results_m[1] == std::make_pair(std::string("1/1/1"), true));
+        CPPUNIT_ASSERT_EQUAL(std::string("0"), status("pending-reads"));
+    }
+
+    void testReadTimeout()
+    {
+        RecordingReadListener listener;
+        ticpp::Element pConfig("knxconnection");
+        pConfig.SetAttribute("read-timeout", "100ms");
+        configure(pConfig);
+        connect();
+        struct timeval start, end;
+        gettimeofday(&start, 0);
+        con_m->requestRead(Object::ReadGroupAddr("1/1/1"), &listener);
+        assertReadRequest("1/1/1");
+        waitForResults(listener, 1);
+        gettimeofday(&end, 0);
+        CPPUNIT_ASSERT(listener.results_m[0] == std::make_pair(std::string("1/1/1"), false));
+        int elapsed = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
+        CPPUNIT_ASSERT(elapsed >= 90);
+        CPPUNIT_ASSERT(!con_m->isReadPending(Object::ReadGroupAddr("1/1/1")));
+
+        // A late response doesn't complete anything
+        eibd_m->send(Object::ReadAddr("1.1.1"), Object::ReadGroupAddr("1/1/1"), TelegramFrame(false, 1));
+        pth_usleep(100000);
+        CPPUNIT_ASSERT_EQUAL((size_t)1, listener.results_m.size());
+    }
+
+    void testReadAheadOfTxQueue()
+    {
+        RecordingReadListener listener;
+        ticpp::Element pConfig("knxconnection");
+        pConfig.SetAttribute("tx-rate", 10);
+        pConfig.SetAttribute("tx-queue-size", 4);
+        pConfig.SetAttribute("read-timeout", "300ms");
+        configure(pConfig);
+        connect();
+
+        // The queue is full and takes 400ms to drain, more than the timeout
+        struct timeval start, end;
+        gettimeofday(&start, 0);
+        write("1/1/1", 1);
+        write("1/1/2", 1);
+        write("1/1/3", 1);
+        write("1/1/4", 1);
+        write("1/1/5", 1);
+        con_m->requestRead(Object::ReadGroupAddr("1/2/1"), &listener);
+        CPPUNIT_ASSERT_EQUAL(std::string("1"), status("tx-dropped"));
+
+        // The request is neither delayed by the queue nor dropped
+        assertReadRequest("1/2/1");
+        eibd_m->send(Object::ReadAddr("1.1.1"), Object::ReadGroupAddr("1/2/1"), TelegramFrame(false, 1));
+        waitForResults(listener, 1);
+        CPPUNIT_ASSERT(listener.results_m[0] == std::make_pair(std::string("1/2/1"), true));
+
+        // The writes follow at the configured rate, after the slot used
+        // by the request
+        assertReceived("1/1/2", 1);
+        assertReceived("1/1/3", 1);
+        assertReceived("1/1/4", 1);
+        assertReceived("1/1/5", 1);
+        gettimeofday(&end, 0);
+        int elapsed = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
+        CPPUNIT_ASSERT(elapsed >= 350);
+    }
+
+    void testDuplicateRead()
+    {
+        RecordingReadListener listener1, listener2;
+        ticpp::Element pConfig("knxconnection");
+        configure(pConfig);
+        connect();
+
+        // A single request is sent, both listeners are notified
+        con_m->requestRead(Object::ReadGroupAddr("1/1/1"), &listener1);
+        con_m->requestRead(Object::ReadGroupAddr("1/1/1"), &listener2);
+        assertReadRequest("1/1/1");
+        assertNothingReceived();
+        CPPUNIT_ASSERT_EQUAL(std::string("1"), status("pending-reads"));
+        eibd_m->send(Object::ReadAddr("1.1.1"), Object::ReadGroupAddr("1/1/1"), TelegramFrame(false, 1));
+        waitForResults(listener1, 1);
+        waitForResults(listener2, 1);
+        CPPUNIT_ASSERT(listener1.results_m[0].second);
+        CPPUNIT_ASSERT(listener2.results_m[0].second);
+    }
+
+    void testReadQueue()
+    {
+        RecordingReadListener listener;
+        ticpp::Element pConfig("knxconnection");
+        pConfig.SetAttribute("read-rate", 0);
+        pConfig.SetAttribute("max-pending-reads", 1);
+        configure(pConfig);
+        // Queued before the connection is up, as done by the prefetch
+        con_m->queueRead(Object::ReadGroupAddr("1/1/1"), 0, &listener);
+        con_m->queueRead(Object::ReadGroupAddr("1/1/2"), 1, &listener);
+        con_m->queueRead(Object::ReadGroupAddr("1/1/3"), 0, &listener);
+        connect();
+
+        // Higher priority first, one outstanding request at a time
+        assertReadRequest("1/1/2");
+        assertNothingReceived();
+        eibd_m->send(Object::ReadAddr("1.1.1"), Object::ReadGroupAddr("1/1/2"), TelegramFrame(false, 1));
+        assertReadRequest("1/1/1");
+        eibd_m->send(Object::ReadAddr("1.1.1"), Object::ReadGroupAddr("1/1/1"), TelegramFrame(false, 1));
+        assertReadRequest("1/1/3");
+        eibd_m->send(Object::ReadAddr("1.1.1"), Object::ReadGroupAddr("1/1/3"), TelegramFrame(false, 1));
+        waitForResults(listener, 3);
+        CPPUNIT_ASSERT(listener.results_m[0] == std::make_pair(std::string("1/1/2"), true));
+        CPPUNIT_ASSERT(listener.results_m[1] == std::make_pair(std::string("1/1/1"), true));
+        CPPUNIT_ASSERT(listener.results_m[2] == std::make_pair(std::string("1/1/3"), true));
+        CPPUNIT_ASSERT_EQUAL(std::string("0"), status("queued-reads"));
+    }
+
+    void testReadQueueDisconnect()
+    {
+        RecordingReadListener listener;
+        ticpp::Element pConfig("knxconnection");
+        pConfig.SetAttribute("read-rate", 0);
+        pConfig.SetAttribute("max-pending-reads", 1);
+        configure(pConfig);
+        connect();
+        con_m->queueRead(Object::ReadGroupAddr("1/1/1"), 0, &listener);
+        con_m->queueRead(Object::ReadGroupAddr("1/1/2"), 0, &listener);
+        con_m->queueRead(Object::ReadGroupAddr("1/1/3"), 0, &listener);
+        assertReadRequest("1/1/1");
+
+        // Both the outstanding and the queued requests fail
+        eibd_m->disconnect();
+        waitForResults(listener, 3);
+        CPPUNIT_ASSERT(listener.results_m[0] == std::make_pair(std::string("1/1/1"), false));
+        CPPUNIT_ASSERT(listener.results_m[1] == std::make_pair(std::string("1/1/2"), false));
+        CPPUNIT_ASSERT(listener.results_m[2] == std::make_pair(std::string("1/1/3"), false));
+        CPPUNIT_ASSERT_EQUAL(std::string("0"), status("queued-reads"));
+        CPPUNIT_ASSERT_EQUAL(std::string("0"), status("pending-reads"));
+    }
+
+    void testReadQueuePromotion()
+    {
+        RecordingReadListener listener;
+        ticpp::Element pConfig("knxconnection");
+        pConfig.SetAttribute("read-rate", 0);
+        pConfig.SetAttribute("max-pending-reads", 1);
+        configure(pConfig);
+        con_m->queueRead(Object::ReadGroupAddr("1/1/1"), 0, &listener);
+        con_m->queueRead(Object::ReadGroupAddr("1/1/2"), 0, &listener);
+        connect();
+        assertReadRequest("1/1/1");
+
+        // Read directly, e.g. by a rule being initialized: sent at once
+        // and the queued request is completed by the same response
+        con_m->requestRead(Object::ReadGroupAddr("1/1/2"));
+        assertReadRequest("1/1/2");
+        CPPUNIT_ASSERT_EQUAL(std::string("0"), status("queued-reads"));
+        eibd_m->send(Object::ReadAddr("1.1.1"), Object::ReadGroupAddr("1/1/2"), TelegramFrame(false, 1));
+        waitForResults(listener, 1);
+        CPPUNIT_ASSERT(listener.results_m[0] == std::make_pair(std::string("1/1/2"), true));
+        eibd_m->send(Object::ReadAddr("1.1.1"), Object::ReadGroupAddr("1/1/1"), TelegramFrame(false, 1));
+        waitForResults(listener, 2);
+        assertNothingReceived();
+    }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION( KnxConnectionTest );
@@ -11,6 +11,8 @@ class ObjectControllerTest : public CppUnit::TestFixture
     CPPUNIT_TEST( testWrite );
     CPPUNIT_TEST( testExportImport );
     CPPUNIT_TEST( testWriteMultipleGad );
+    CPPUNIT_TEST( testWriteAfterRemove );
+    CPPUNIT_TEST( testConnectionRoutes );
 //    CPPUNIT_TEST(  );
 //    CPPUNIT_TEST(  );
     
@@ -226,6 +228,102 @@ public:
         CPPUNIT_ASSERT(obj3->getValue() == "off");
     }
 
+
+    void testWriteAfterRemove()
+    {
+        ticpp::Element pConfig;
+        ticpp::Element pGadConfig;
+        eibaddr_t src, dest;
+        uint8_t buf[2] = {0, 0x81};
+
+        pConfig.SetAttribute("id", "test_sw1");
+        pConfig.SetAttribute("gad", "1/1/207");
+        Object *obj1 = Object::create(&pConfig);
+        obj1->setValue("off");
+        oc_m->addObject(obj1);
+
+        pConfig.SetAttribute("id", "test_sw2");
+        pConfig.SetAttribute("gad", "1/1/208");
+        pGadConfig.SetValue("listener");
+        pGadConfig.SetAttribute("gad", "1/1/207");
+        pConfig.LinkEndChild(&pGadConfig);
+        Object *obj2 = Object::create(&pConfig);
+        obj2->setValue("off");
+        oc_m->addObject(obj2);
+
+        oc_m->removeObject(obj1);
+
+        src = Object::ReadAddr("0.2.10");
+        dest = Object::ReadGroupAddr("1/1/207");
+        buf[1] = 0x81;
+        oc_m->onWrite(src, dest, buf, 2);
+        CPPUNIT_ASSERT(obj2->getValue() == "on");
+
+        oc_m->removeObject(obj2);
+
+        // No object left on both addresses; must be silently ignored
+        buf[1] = 0x80;
+        oc_m->onWrite(src, dest, buf, 2);
+        dest = Object::ReadGroupAddr("1/1/208");
+        oc_m->onWrite(src, dest, buf, 2);
+        dest = Object::ReadGroupAddr("31/7/255");
+        oc_m->onWrite(src, dest, buf, 2);
+    }
+
+    void testConnectionRoutes()
+    {
+        ticpp::Element pConfig("connection");
+        ticpp::Element pRoute1("route");
+        ticpp::Element pRoute2("route");
+        pConfig.SetAttribute("id", "line2");
+        pRoute1.SetAttribute("from", "2/0/0");
+        pRoute1.SetAttribute("to", "2/7/255");
+        pConfig.LinkEndChild(&pRoute1);
+        pRoute2.SetAttribute("from", "3/1/5");
+        pConfig.LinkEndChild(&pRoute2);
+
+        KnxConnection con;
+        con.importXml(&pConfig);
+        CPPUNIT_ASSERT(con.getID() == "line2");
+        CPPUNIT_ASSERT(con.routes(Object::ReadGroupAddr("2/0/0")));
+        CPPUNIT_ASSERT(con.routes(Object::ReadGroupAddr("2/3/17")));
+        CPPUNIT_ASSERT(con.routes(Object::ReadGroupAddr("2/7/255")));
+        CPPUNIT_ASSERT(con.routes(Object::ReadGroupAddr("3/1/5")));
+        CPPUNIT_ASSERT(!con.routes(Object::ReadGroupAddr("1/7/255")));
+        CPPUNIT_ASSERT(!con.routes(Object::ReadGroupAddr("3/1/4")));
+        CPPUNIT_ASSERT(!con.routes(Object::ReadGroupAddr("3/1/6")));
+
+        ticpp::Element pExport("connection");
+        con.exportXml(&pExport);
+        KnxConnection con2;
+        con2.importXml(&pExport);
+        CPPUNIT_ASSERT(con2.getID() == "line2");
+        CPPUNIT_ASSERT(con2.routes(Object::ReadGroupAddr("2/5/0")));
+        CPPUNIT_ASSERT(con2.routes(Object::ReadGroupAddr("3/1/5")));
+        CPPUNIT_ASSERT(!con2.routes(Object::ReadGroupAddr("3/1/6")));
+
+        // Routes are replaced, not merged, when the connection is reconfigured
+        ticpp::Element pUpdate("connection");
+        ticpp::Element pRoute3("route");
+        pUpdate.SetAttribute("id", "line2");
+        pRoute3.SetAttribute("from", "4/0/0");
+        pUpdate.LinkEndChild(&pRoute3);
+        con2.importXml(&pUpdate);
+        CPPUNIT_ASSERT(con2.routes(Object::ReadGroupAddr("4/0/0")));
+        CPPUNIT_ASSERT(!con2.routes(Object::ReadGroupAddr("2/5/0")));
+        ticpp::Element pNoRoute("connection");
+        pNoRoute.SetAttribute("id", "line2");
+        con2.importXml(&pNoRoute);
+        CPPUNIT_ASSERT(!con2.routes(Object::ReadGroupAddr("4/0/0")));
+
+        pRoute1.SetAttribute("to", "1/0/0");
+        ticpp::Element pBadConfig("connection");
+        pBadConfig.SetAttribute("id", "line3");
+        pBadConfig.LinkEndChild(&pRoute1);
+        KnxConnection con3;
+        CPPUNIT_ASSERT_THROW(con3.importXml(&pBadConfig), ticpp::Exception);
+    }
+
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION( ObjectControllerTest );
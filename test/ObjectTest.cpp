@@ -105,6 +105,10 @@ class ObjectTest : public CppUnit::TestFixture, public ChangeListener
     CPPUNIT_TEST( testStringPersist );
     CPPUNIT_TEST( testRGBWObject );
     CPPUNIT_TEST( testRGBWObjectWrite );
+    CPPUNIT_TEST( testPriorityExportImport );
+    CPPUNIT_TEST( testTypeAliases );
+    CPPUNIT_TEST( testValueRef );
+    CPPUNIT_TEST( testRenderedValue );
 //    CPPUNIT_TEST(  );
 //    CPPUNIT_TEST(  );
 
@@ -3469,6 +3473,130 @@ public:
         CPPUNIT_ASSERT(isOnChangeCalled_m == true);
     }
 
+    void testPriorityExportImport()
+    {
+        ticpp::Element pConfig;
+        pConfig.SetAttribute("id", "test_alarm");
+        pConfig.SetAttribute("type", "1.005");
+        pConfig.SetAttribute("priority", "alarm");
+        Object *orig = Object::create(&pConfig);
+        CPPUNIT_ASSERT_EQUAL(KnxConnection::Alarm, orig->getPriority());
+
+        ticpp::Element pExport;
+        orig->exportXml(&pExport);
+        CPPUNIT_ASSERT(pExport.GetAttribute("priority") == "alarm");
+        Object *res = Object::create(&pExport);
+        CPPUNIT_ASSERT_EQUAL(KnxConnection::Alarm, res->getPriority());
+        delete res;
+        delete orig;
+
+        ticpp::Element pDefault;
+        pDefault.SetAttribute("id", "test_normal");
+        Object *obj = Object::create(&pDefault);
+        CPPUNIT_ASSERT_EQUAL(KnxConnection::Normal, obj->getPriority());
+        ticpp::Element pDefaultExport;
+        obj->exportXml(&pDefaultExport);
+        CPPUNIT_ASSERT(pDefaultExport.GetAttribute("priority") == "");
+        delete obj;
+
+        pDefault.SetAttribute("priority", "urgent");
+        CPPUNIT_ASSERT_THROW(Object::create(&pDefault), ticpp::Exception);
+    }
+
+    void testTypeAliases()
+    {
+        CPPUNIT_ASSERT(Object::getCanonicalType("") == "1.001");
+        CPPUNIT_ASSERT(Object::getCanonicalType("EIS1") == "1.001");
+        CPPUNIT_ASSERT(Object::getCanonicalType("1.003") == "1.003");
+        CPPUNIT_ASSERT(Object::getCanonicalType("EIS5") == "9.xxx");
+        CPPUNIT_ASSERT(Object::getCanonicalType("heat-mode") == "20.102");
+        CPPUNIT_ASSERT(Object::getCanonicalType("EIS15") == "16.000");
+        CPPUNIT_ASSERT(Object::getCanonicalType("1.015") == "");
+        CPPUNIT_ASSERT(Object::getCanonicalType("9.009") == "");
+        CPPUNIT_ASSERT(Object::create("1.015") == 0);
+
+        ticpp::Element pConfig;
+        pConfig.SetAttribute("id", "test_alias");
+        pConfig.SetAttribute("type", "EIS2");
+        Object *obj = Object::create(&pConfig);
+        CPPUNIT_ASSERT(dynamic_cast<DimmingObject*>(obj));
+        CPPUNIT_ASSERT(obj->getType() == "3.007");
+
+        // Alias of the current type is accepted on update
+        pConfig.SetAttribute("type", "3.007");
+        obj->importXml(&pConfig);
+        pConfig.SetAttribute("type", "EIS2");
+        obj->importXml(&pConfig);
+        // Other or unknown types are not
+        pConfig.SetAttribute("type", "3.008");
+        CPPUNIT_ASSERT_THROW(obj->importXml(&pConfig), ticpp::Exception);
+        pConfig.SetAttribute("type", "bogus");
+        CPPUNIT_ASSERT_THROW(obj->importXml(&pConfig), ticpp::Exception);
+        delete obj;
+    }
+
+    void testValueRef()
+    {
+        const char* types[] = { "1.001", "5.xxx", "6.xxx", "9.001", "12.xxx", "13.xxx", "16.000", "28.001", 0 };
+        const char* values[][3] = {
+            { "off", "on", "on" },
+            { "3", "200", "200" },
+            { "-5", "7", "7" },
+            { "-1.5", "20.25", "20.25" },
+            { "1", "70000", "70000" },
+            { "-70000", "12", "12" },
+            { "abc", "abd", "abd" },
+            { "", "z", "z" } };
+        for (int i = 0; types[i]; i++)
+        {
+            Object* obj = Object::create(types[i]);
+            CPPUNIT_ASSERT(obj);
+            obj->setValue(values[i][1]);
+            for (int j = 0; j < 3; j++)
+            {
+                ObjectValue* val = obj->createObjectValue(values[i][j]);
+                CPPUNIT_ASSERT(obj->getCurrentValueRef().isComparable(val->getValueRef()));
+                CPPUNIT_ASSERT_EQUAL(obj->get()->compare(val), obj->getCurrentValueRef().compare(val->getValueRef()));
+                delete val;
+            }
+            // The reference follows value changes
+            ObjectValue* low = obj->createObjectValue(values[i][0]);
+            obj->setValue(low);
+            CPPUNIT_ASSERT_EQUAL(0, obj->getCurrentValueRef().compare(low->getValueRef()));
+            delete low;
+            delete obj;
+        }
+
+        // Types without simple representation use ObjectValue::compare()
+        Object* time = Object::create("10.001");
+        CPPUNIT_ASSERT_EQUAL(ValueRef::None, time->getCurrentValueRef().getKind());
+        delete time;
+    }
+
+    void testRenderedValue()
+    {
+        ticpp::Element pConfig;
+        pConfig.SetAttribute("id", "test_render");
+        pConfig.SetAttribute("type", "9.001");
+        pConfig.SetAttribute("init", "21.5");
+        Object* obj = Object::create(&pConfig);
+        CPPUNIT_ASSERT_EQUAL(std::string("21.5"), obj->getValue());
+        CPPUNIT_ASSERT_EQUAL(std::string("21.5"), obj->getValue());
+
+        obj->setValue("-3");
+        CPPUNIT_ASSERT_EQUAL(std::string("-3"), obj->getValue());
+
+        uint8_t buf[4] = {0, 0x80, 0x0C, 0x1A};
+        obj->onWrite(buf, 4, 0);
+        CPPUNIT_ASSERT_EQUAL(std::string("21"), obj->getValue());
+
+        // Reconfiguring the init value doesn't go through onUpdate()
+        pConfig.SetAttribute("init", "18.25");
+        obj->importXml(&pConfig);
+        CPPUNIT_ASSERT_EQUAL(std::string("18.25"), obj->getValue());
+        delete obj;
+    }
+
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION( ObjectTest );
@@ -8,6 +8,8 @@ class TestablePeriodicTask : public PeriodicTask
 public:
     TestablePeriodicTask(ChangeListener* cl) : PeriodicTask(cl) {};
     time_t callFindNext(time_t start, TimeSpec* next) { return findNext(start, next); };
+    time_t callFindNextCached(time_t start, TimeSpec* next) { return findNextCached(start, next); };
+    void setAfter(TimeMs_t after) { after_m = after; };
 };
 
 class PeriodicTaskTest : public CppUnit::TestFixture, public ChangeListener
@@ -39,6 +41,10 @@ class PeriodicTaskTest : public CppUnit::TestFixture, public ChangeListener
     CPPUNIT_TEST( testFindNextHourDstSunrise );
     CPPUNIT_TEST( testNegativeMinutes );
     CPPUNIT_TEST( testSunriseSpecificDay );
+    CPPUNIT_TEST( testFindNextCached );
+    CPPUNIT_TEST( testFindNextCachedException );
+    CPPUNIT_TEST( testFindNextCachedChange );
+    CPPUNIT_TEST( testRescheduleMs );
 //    CPPUNIT_TEST(  );
     
     CPPUNIT_TEST_SUITE_END();
@@ -895,6 +901,87 @@ public:
         CPPUNIT_ASSERT_EQUAL(7, timeinfo->tm_mon);
         CPPUNIT_ASSERT_EQUAL(112, timeinfo->tm_year);
     }
+
+    void testFindNextCached()
+    {
+        TimeSpec ts1(30, 16, TimeSpec::Wed | TimeSpec::Sat);
+        TimeSpec ts2(1, -1, -1, -1, -1, -180);
+        TimeSpec* specs[] = { &ts1, &ts2, 0 };
+
+        for (int i = 0; specs[i]; i++)
+        {
+            // Move forward by irregular steps, then jump back in time
+            time_t start = timeref1_m;
+            for (int step = 0; step < 200; step++)
+            {
+                start += (step % 7) * 1013 + 59;
+                CPPUNIT_ASSERT_EQUAL(task_m->callFindNext(start, specs[i]), task_m->callFindNextCached(start, specs[i]));
+            }
+            start = timeref1_m + 3600;
+            CPPUNIT_ASSERT_EQUAL(task_m->callFindNext(start, specs[i]), task_m->callFindNextCached(start, specs[i]));
+            // Chained calls as done when a task is rescheduled
+            time_t next = start;
+            for (int step = 0; step < 20; step++)
+            {
+                time_t expected = task_m->callFindNext(next, specs[i]);
+                next = task_m->callFindNextCached(next, specs[i]);
+                CPPUNIT_ASSERT_EQUAL(expected, next);
+            }
+        }
+    }
+
+    void testFindNextCachedException()
+    {
+        TimeSpec ts1(30, 16, TimeSpec::Wed, TimeSpec::No);
+        time_t next = task_m->callFindNextCached(timeref1_m, &ts1);
+        CPPUNIT_ASSERT_EQUAL(3, localtime(&next)->tm_mday);
+
+        // Adding an exception day must invalidate the cached occurrences
+        DaySpec* ds = new DaySpec();
+        ds->mday_m = 3;
+        ds->mon_m = 0;
+        ds->year_m = 107;
+        Services::instance()->getExceptionDays()->addDay(ds);
+
+        next = task_m->callFindNextCached(timeref1_m, &ts1);
+        CPPUNIT_ASSERT_EQUAL(10, localtime(&next)->tm_mday);
+    }
+
+    void testRescheduleMs()
+    {
+        // every 1750ms during 250ms, started in the middle of a second
+        TimeMs_t now = timeref1_m * 1000LL + 123;
+        task_m->setAfter(1500);
+        task_m->setDuring(250);
+        task_m->rescheduleMs(now);
+        CPPUNIT_ASSERT_EQUAL(now + 250, task_m->getExecTimeMs());
+        CPPUNIT_ASSERT_EQUAL(timeref1_m, task_m->getExecTime());
+
+        task_m->onTimer(timeref1_m);
+        task_m->rescheduleMs(now + 250);
+        CPPUNIT_ASSERT_EQUAL(now + 1750, task_m->getExecTimeMs());
+        CPPUNIT_ASSERT_EQUAL(timeref1_m + 1, task_m->getExecTime());
+
+        task_m->onTimer(timeref1_m + 1);
+        task_m->rescheduleMs(now + 1750);
+        CPPUNIT_ASSERT_EQUAL(now + 2000, task_m->getExecTimeMs());
+        CPPUNIT_ASSERT_EQUAL(timeref1_m + 2, task_m->getExecTime());
+        Services::instance()->getTimerManager()->removeTask(task_m);
+    }
+
+    void testFindNextCachedChange()
+    {
+        TimeSpec ts1(30, 16);
+        time_t next = task_m->callFindNextCached(timeref1_m, &ts1);
+        CPPUNIT_ASSERT_EQUAL(2, localtime(&next)->tm_mday);
+        CPPUNIT_ASSERT_EQUAL(16, localtime(&next)->tm_hour);
+
+        // Modifying the spec must invalidate its cached occurrences
+        ts1.setHour(20);
+        next = task_m->callFindNextCached(timeref1_m, &ts1);
+        CPPUNIT_ASSERT_EQUAL(1, localtime(&next)->tm_mday);
+        CPPUNIT_ASSERT_EQUAL(20, localtime(&next)->tm_hour);
+    }
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION( PeriodicTaskTest );
@@ -1,6 +1,8 @@
 #include <cppunit/extensions/HelperMacros.h>
 #include "timermanager.h"
 #include "services.h"
+#include "objectcontroller.h"
+#include <sys/time.h>
 #include <iostream>
 
 class ConstantCondition : public Condition
@@ -25,7 +27,7 @@ private:
 class CounterAction : public Action
 {
 public:
-	CounterAction(int increment) : counter_m(0), increment_m(increment) {}
+	CounterAction(int increment, int delay = 0) : counter_m(0), increment_m(increment) { delay_m = delay; }
 	
     virtual void importXml(ticpp::Element* pConfig) {}
 	virtual void Run (pth_sem_t * stop)
@@ -34,13 +36,16 @@ public:
 	}
 
 	int getCounter() const {return counter_m;}
-	void waitForCompletion()
+	// Returns false if the action is still not finished after timeout ms
+	bool waitForCompletion(int timeout = 10000)
 	{
-		int i = 0;
-		while (!isFinished())
+		for (int i = 0; !isFinished(); i += 10)
 		{
+			if (i >= timeout)
+				return false;
 			pth_usleep(10000);
 		}
+		return true;
 	}
 
 private:
@@ -48,6 +53,42 @@ private:
 	int increment_m;
 };
 
+// Runs until stopped, then records that Run() returned
+class BlockingAction : public Action
+{
+public:
+	BlockingAction() : started_m(false), returned_m(false) {}
+
+    virtual void importXml(ticpp::Element* pConfig) {}
+	virtual void Run (pth_sem_t * stop)
+	{
+		started_m = true;
+		pth_event_t stop_ev = pth_event (PTH_EVENT_SEM, stop);
+		pth_wait (stop_ev);
+		pth_event_free (stop_ev, PTH_FREE_THIS);
+		// Give the thread calling stop() a chance to return too early
+		pth_yield (NULL);
+		returned_m = true;
+	}
+
+	bool started_m;
+	bool returned_m;
+};
+
+// Holds a dispatch cycle open in its own thread until stopped
+class CycleHolder : public Runable
+{
+public:
+	void Run (pth_sem_t * stop)
+	{
+		RuleServer::beginCycle();
+		pth_event_t stop_ev = pth_event (PTH_EVENT_SEM, stop);
+		pth_wait (stop_ev);
+		pth_event_free (stop_ev, PTH_FREE_THIS);
+		RuleServer::endCycle();
+	}
+};
+
 class TestableRule : public Rule
 {
 public:
@@ -71,6 +112,15 @@ class RuleTest : public CppUnit::TestFixture/*, public ChangeListener*/
     CPPUNIT_TEST( testIfFalseActionList );
     CPPUNIT_TEST( testOnFalseActionList );
     CPPUNIT_TEST( testIfTrueAndOnTrueActionLists );
+    CPPUNIT_TEST( testConditionCache );
+    CPPUNIT_TEST( testConditionOrdering );
+    CPPUNIT_TEST( testExecutorPool );
+    CPPUNIT_TEST( testDelayedAction );
+    CPPUNIT_TEST( testStopWaitsForRun );
+    CPPUNIT_TEST( testCoalescedEvaluation );
+    CPPUNIT_TEST( testCyclePerThread );
+    CPPUNIT_TEST( testTimerDuration );
+    CPPUNIT_TEST( testTimerConditionMs );
     
     CPPUNIT_TEST_SUITE_END();
 
@@ -90,6 +140,7 @@ public:
     void tearDown()
     {
         delete rule_m; rule_m = NULL;
+        ObjectController::reset();
     }
 
     /*void onChange(Object* obj)
@@ -154,6 +205,282 @@ public:
         CPPUNIT_ASSERT_EQUAL(20, action2->getCounter());
     }
 
+    void testConditionCache()
+    {
+        ObjectController* oc = ObjectController::instance();
+        Object* obj1 = new SwitchingSwitchObject();
+        obj1->setID("cache_sw1");
+        oc->addObject(obj1);
+        Object* obj2 = new SwitchingSwitchObject();
+        obj2->setID("cache_sw2");
+        oc->addObject(obj2);
+        obj1->setValue("on");
+        obj2->setValue("on");
+        obj2->setValue("off");
+
+        ticpp::Element pConfig("condition");
+        pConfig.SetAttribute("type", "and");
+        ticpp::Element pCond1("condition");
+        pCond1.SetAttribute("type", "object");
+        pCond1.SetAttribute("id", "cache_sw1");
+        pCond1.SetAttribute("value", "on");
+        pConfig.LinkEndChild(&pCond1);
+        ticpp::Element pCond2("condition");
+        pCond2.SetAttribute("type", "object");
+        pCond2.SetAttribute("id", "cache_sw2");
+        pCond2.SetAttribute("value", "on");
+        pConfig.LinkEndChild(&pCond2);
+        Condition* cond = Condition::create(&pConfig, 0);
+
+        CPPUNIT_ASSERT(cond->isStale());
+        CPPUNIT_ASSERT(!cond->evaluate());
+        CPPUNIT_ASSERT(!cond->isStale());
+
+        // Writing the same value is not an update
+        obj2->setValue("off");
+        CPPUNIT_ASSERT(!cond->isStale());
+
+        obj2->setValue("on");
+        CPPUNIT_ASSERT(cond->isStale());
+        CPPUNIT_ASSERT(cond->evaluate());
+        CPPUNIT_ASSERT(!cond->isStale());
+
+        // Once short-circuited by the first object, the second one is not
+        // a dependency anymore
+        obj1->setValue("off");
+        CPPUNIT_ASSERT(!cond->evaluate());
+        obj2->setValue("off");
+        CPPUNIT_ASSERT(!cond->isStale());
+        CPPUNIT_ASSERT(!cond->evaluate());
+        obj1->setValue("on");
+        CPPUNIT_ASSERT(cond->isStale());
+        CPPUNIT_ASSERT(!cond->evaluate());
+        obj2->setValue("on");
+        CPPUNIT_ASSERT(cond->evaluate());
+
+        delete cond;
+    }
+
+    void testConditionOrdering()
+    {
+        ObjectController* oc = ObjectController::instance();
+        Object* obj1 = new SwitchingSwitchObject();
+        obj1->setID("order_sw1");
+        oc->addObject(obj1);
+        Object* obj2 = new SwitchingSwitchObject();
+        obj2->setID("order_sw2");
+        oc->addObject(obj2);
+        obj2->setValue("on");
+        obj2->setValue("off");
+
+        ticpp::Element pConfig("condition");
+        pConfig.SetAttribute("type", "and");
+        ticpp::Element pCond1("condition");
+        pCond1.SetAttribute("type", "object");
+        pCond1.SetAttribute("id", "order_sw1");
+        pCond1.SetAttribute("value", "on");
+        pConfig.LinkEndChild(&pCond1);
+        ticpp::Element pCond2("condition");
+        pCond2.SetAttribute("type", "object");
+        pCond2.SetAttribute("id", "order_sw2");
+        pCond2.SetAttribute("value", "on");
+        pConfig.LinkEndChild(&pCond2);
+        Condition* cond = Condition::create(&pConfig, 0);
+
+        // The first condition is always true, the second always false
+        for (int i = 0; i < 64; i++)
+        {
+            obj1->setValue("off");
+            obj1->setValue("on");
+            CPPUNIT_ASSERT(!cond->evaluate());
+        }
+
+        ticpp::Element pStatus("condition");
+        cond->statusXml(&pStatus);
+        ticpp::Element* pChild1 = pStatus.FirstChildElement("condition");
+        ticpp::Element* pChild2 = pChild1->NextSiblingElement("condition");
+        CPPUNIT_ASSERT_EQUAL(std::string("1"), pChild1->GetAttribute("order"));
+        CPPUNIT_ASSERT_EQUAL(std::string("0"), pChild2->GetAttribute("order"));
+        CPPUNIT_ASSERT_EQUAL(std::string("1"), pChild1->GetAttribute("true-ratio"));
+        CPPUNIT_ASSERT_EQUAL(std::string("0"), pChild2->GetAttribute("true-ratio"));
+
+        // The false condition now short-circuits the first one, which is
+        // not a dependency anymore
+        obj1->setValue("off");
+        CPPUNIT_ASSERT(!cond->isStale());
+
+        delete cond;
+    }
+
+    void testExecutorPool()
+    {
+        std::vector<CounterAction*> actions;
+        for (int i = 0; i < 40; i++)
+        {
+            actions.push_back(new CounterAction(1));
+            rule_m->addAction(actions.back(), ActionList::IfTrue);
+        }
+        rule_m->evaluate();
+        for (int i = 0; i < 40; i++)
+        {
+            CPPUNIT_ASSERT(actions[i]->waitForCompletion());
+            CPPUNIT_ASSERT_EQUAL(1, actions[i]->getCounter());
+        }
+
+        // Actions that don't block share a few workers
+        ActionExecutor* executor = ActionExecutor::instance();
+        CPPUNIT_ASSERT(executor->getWorkerCount() < 10);
+        CPPUNIT_ASSERT(executor->getIdleWorkerCount() <= ActionExecutor::MaxIdleWorkers);
+    }
+
+    void testDelayedAction()
+    {
+        CounterAction* action = new CounterAction(1, 200);
+        rule_m->addAction(action, ActionList::IfTrue);
+
+        struct timeval start, end;
+        gettimeofday(&start, 0);
+        rule_m->evaluate();
+        CPPUNIT_ASSERT(!action->isFinished());
+        CPPUNIT_ASSERT(action->waitForCompletion());
+        gettimeofday(&end, 0);
+        CPPUNIT_ASSERT_EQUAL(1, action->getCounter());
+        // A delay is never shorter than requested, a loaded system only
+        // makes it longer
+        long elapsed = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
+        CPPUNIT_ASSERT(elapsed >= 200);
+
+        // Triggered again during its delay: each trigger runs it once
+        rule_m->evaluate();
+        rule_m->evaluate();
+        CPPUNIT_ASSERT(action->waitForCompletion());
+        CPPUNIT_ASSERT_EQUAL(3, action->getCounter());
+
+        // Canceled before the delay elapsed: nothing is left to run it
+        rule_m->evaluate();
+        rule_m->evaluate();
+        CPPUNIT_ASSERT(!action->isFinished());
+        action->cancel();
+        CPPUNIT_ASSERT(action->isFinished());
+        CPPUNIT_ASSERT_EQUAL(3, action->getCounter());
+    }
+
+    void testStopWaitsForRun()
+    {
+        BlockingAction* action = new BlockingAction();
+        action->execute();
+        for (int i = 0; !action->started_m && i < 1000; i++)
+            pth_usleep(10000);
+        CPPUNIT_ASSERT(action->started_m);
+
+        action->stop();
+        CPPUNIT_ASSERT(action->returned_m);
+        CPPUNIT_ASSERT(action->isFinished());
+        delete action;
+    }
+
+    void testCoalescedEvaluation()
+    {
+        CounterAction *action = new CounterAction(1);
+        rule_m->addAction(action, ActionList::IfTrue);
+
+        RuleServer::beginCycle();
+        rule_m->onChange(0);
+        rule_m->onChange(0);
+        CPPUNIT_ASSERT(action->isFinished());
+        RuleServer::endCycle();
+        action->waitForCompletion();
+        CPPUNIT_ASSERT_EQUAL(1, action->getCounter());
+
+        // Legacy behavior, each change evaluates the rule
+        rule_m->setCoalesce(false);
+        {
+            RuleEvaluationCycle cycle;
+            rule_m->onChange(0);
+            action->waitForCompletion();
+            rule_m->onChange(0);
+            action->waitForCompletion();
+            cycle.end();
+        }
+        CPPUNIT_ASSERT_EQUAL(3, action->getCounter());
+    }
+
+    void testCyclePerThread()
+    {
+        CounterAction *action = new CounterAction(1);
+        rule_m->addAction(action, ActionList::IfTrue);
+
+        // A cycle held open by another thread doesn't defer our changes
+        CycleHolder holder;
+        Thread thread(PTH_PRIO_STD, &holder, static_cast<THREADENTRY>(&CycleHolder::Run));
+        thread.Start();
+        pth_yield(NULL);
+        rule_m->onChange(0);
+        CPPUNIT_ASSERT(action->waitForCompletion());
+        CPPUNIT_ASSERT_EQUAL(1, action->getCounter());
+        thread.Stop();
+
+        // A cycle left by an exception still evaluates the changed rules
+        try
+        {
+            RuleEvaluationCycle cycle;
+            rule_m->onChange(0);
+            CPPUNIT_ASSERT(action->isFinished());
+            throw "error";
+        }
+        catch (const char*)
+        {
+        }
+        CPPUNIT_ASSERT(action->waitForCompletion());
+        CPPUNIT_ASSERT_EQUAL(2, action->getCounter());
+    }
+
+    void testTimerDuration()
+    {
+        CPPUNIT_ASSERT_EQUAL(500LL, TimerCondition::parseTimerDuration("500ms"));
+        CPPUNIT_ASSERT_EQUAL(1500LL, TimerCondition::parseTimerDuration("1.5s"));
+        CPPUNIT_ASSERT_EQUAL(120000LL, TimerCondition::parseTimerDuration("2m"));
+        CPPUNIT_ASSERT_EQUAL(30000LL, TimerCondition::parseTimerDuration("30"));
+        CPPUNIT_ASSERT_EQUAL(5400000LL, TimerCondition::parseTimerDuration("1.5h"));
+        CPPUNIT_ASSERT_EQUAL(3456000000LL, TimerCondition::parseTimerDuration("40d"));
+        CPPUNIT_ASSERT_EQUAL(0LL, TimerCondition::parseTimerDuration(""));
+        CPPUNIT_ASSERT_THROW(TimerCondition::parseTimerDuration("-1s"), ticpp::Exception);
+        CPPUNIT_ASSERT_THROW(TimerCondition::parseTimerDuration("1x"), ticpp::Exception);
+        CPPUNIT_ASSERT_THROW(TimerCondition::parseTimerDuration("ms"), ticpp::Exception);
+
+        CPPUNIT_ASSERT_EQUAL(std::string("500ms"), TimerCondition::formatTimerDuration(500));
+        CPPUNIT_ASSERT_EQUAL(std::string("1500ms"), TimerCondition::formatTimerDuration(1500));
+        CPPUNIT_ASSERT_EQUAL(std::string("2m"), TimerCondition::formatTimerDuration(120000));
+        CPPUNIT_ASSERT_EQUAL(std::string("40d"), TimerCondition::formatTimerDuration(3456000000LL));
+        CPPUNIT_ASSERT_EQUAL(std::string("3456000001ms"), TimerCondition::formatTimerDuration(3456000001LL));
+
+        const char* durations[] = { "500ms", "1.5s", "2m", "90s", "1.5h", "40d", "3456000001ms", 0 };
+        for (int i = 0; durations[i]; i++)
+        {
+            TimeMs_t duration = TimerCondition::parseTimerDuration(durations[i]);
+            CPPUNIT_ASSERT_EQUAL(duration, TimerCondition::parseTimerDuration(TimerCondition::formatTimerDuration(duration)));
+        }
+    }
+
+    void testTimerConditionMs()
+    {
+        ticpp::Element pConfig("condition");
+        pConfig.SetAttribute("type", "timer");
+        ticpp::Element pEvery("every");
+        pEvery.SetText("1.5s");
+        pConfig.LinkEndChild(&pEvery);
+        ticpp::Element pDuring("during");
+        pDuring.SetText("250ms");
+        pConfig.LinkEndChild(&pDuring);
+        Condition* cond = Condition::create(&pConfig, 0);
+
+        ticpp::Element pExport("condition");
+        cond->exportXml(&pExport);
+        CPPUNIT_ASSERT_EQUAL(std::string("1500ms"), pExport.FirstChildElement("every")->GetText());
+        CPPUNIT_ASSERT_EQUAL(std::string("250ms"), pExport.FirstChildElement("during")->GetText());
+        delete cond;
+    }
+
 private:
     void testOneActionList(bool condition, ActionList::TriggerType type, int expectedFinalCount)
     {
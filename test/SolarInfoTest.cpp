@@ -0,0 +1,161 @@
+#include <cppunit/extensions/HelperMacros.h>
+#include "suncalc.h"
+#include "services.h"
+#include <stdlib.h>
+
+class SolarInfoTest : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE( SolarInfoTest );
+    CPPUNIT_TEST( testKnownTimes );
+    CPPUNIT_TEST( testYearRollover );
+    CPPUNIT_TEST( testEviction );
+    CPPUNIT_TEST( testEphemerisMatches );
+    CPPUNIT_TEST( testLocationChange );
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    // Gives access to the per-year table
+    class TestLocationInfo : public LocationInfo
+    {
+    public:
+        unsigned int cachedYears() { return ephemeris_m.size(); };
+        bool isCached(int year) { return ephemeris_m.find(year) != ephemeris_m.end(); };
+        static unsigned int maxYears() { return MaxEphemerisYears; };
+    };
+
+    // Minute of the day, as used by SolarTimeSpec
+    static int toMinutes(double hours) { return (int)(hours * 60); }
+
+    // Compares with published times (UT), allowing a few minutes for
+    // the approximations of the algorithm
+    void checkKnown(LocationInfo& location, int year, int mon, int mday, int riseMin, int setMin)
+    {
+        double rise, set;
+        CPPUNIT_ASSERT_EQUAL(0, location.getSunRiseSet(year, mon, mday, &rise, &set));
+        CPPUNIT_ASSERT(abs(toMinutes(rise) - riseMin) <= 3);
+        CPPUNIT_ASSERT(abs(toMinutes(set) - setMin) <= 3);
+    }
+
+    void checkYear(LocationInfo& location, int year)
+    {
+        double lon, lat;
+        location.getCoord(&lon, &lat);
+        static const int monthDays[] = { 31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+        for (int mon = 0; mon < 12; mon++)
+        {
+            for (int mday = 1; mday <= monthDays[mon]; mday++)
+            {
+                double rise, set, expectedRise, expectedSet;
+                int expectedRs = LocationInfo::computeSunRiseSet( year, mon, mday, lon, lat, &expectedRise, &expectedSet );
+                // Twice, to check both the computation and the lookup
+                for (int i = 0; i < 2; i++)
+                {
+                    int rs = location.getSunRiseSet(year, mon, mday, &rise, &set);
+                    CPPUNIT_ASSERT_EQUAL(expectedRs, rs);
+                    if (rs == 0)
+                    {
+                        CPPUNIT_ASSERT_EQUAL(toMinutes(expectedRise), toMinutes(rise));
+                        CPPUNIT_ASSERT_EQUAL(toMinutes(expectedSet), toMinutes(set));
+                    }
+                }
+            }
+        }
+    }
+
+public:
+    void setUp()
+    {
+    }
+
+    void tearDown()
+    {
+        Services::reset();
+    }
+
+    void testKnownTimes()
+    {
+        LocationInfo location;
+        location.setCoord(4.35, 50.85); // Brussels
+        checkKnown(location, 112, 5, 21, 3*60+29, 20*60+0);
+        checkKnown(location, 112, 11, 21, 7*60+44, 15*60+39);
+        location.setCoord(151.2, -33.87); // Sydney, sunrise on the previous day in UT
+        checkKnown(location, 112, 11, 21, -(5*60+19), 9*60+5);
+
+        double rise, set;
+        location.setCoord(18.95, 69.65); // Tromso
+        CPPUNIT_ASSERT_EQUAL(1, location.getSunRiseSet(112, 5, 21, &rise, &set));
+        CPPUNIT_ASSERT_EQUAL(-1, location.getSunRiseSet(112, 11, 21, &rise, &set));
+    }
+
+    void testYearRollover()
+    {
+        TestLocationInfo location;
+        location.setCoord(4.35, 50.85);
+        checkKnown(location, 112, 11, 31, 7*60+44, 15*60+46);
+        checkKnown(location, 113, 0, 1, 7*60+44, 15*60+47);
+        CPPUNIT_ASSERT_EQUAL(2u, location.cachedYears());
+        // The first year is still served from its own table
+        checkKnown(location, 112, 11, 31, 7*60+44, 15*60+46);
+        CPPUNIT_ASSERT(location.isCached(112));
+        CPPUNIT_ASSERT(location.isCached(113));
+    }
+
+    void testEviction()
+    {
+        TestLocationInfo location;
+        location.setCoord(4.35, 50.85);
+        double rise, set;
+        unsigned int years = TestLocationInfo::maxYears();
+        checkKnown(location, 112, 5, 21, 3*60+29, 20*60+0);
+        for (unsigned int i = 1; i < years; i++)
+            location.getSunRiseSet(112+i, 5, 21, &rise, &set);
+        CPPUNIT_ASSERT_EQUAL(years, location.cachedYears());
+        CPPUNIT_ASSERT(location.isCached(112));
+
+        // One year too many: the table never grows past the limit
+        location.getSunRiseSet(112+years, 5, 21, &rise, &set);
+        CPPUNIT_ASSERT(location.cachedYears() <= years);
+        CPPUNIT_ASSERT(location.isCached(112+years));
+        checkYear(location, 112+years);
+
+        // An evicted year is computed again with the right values
+        checkKnown(location, 112, 5, 21, 3*60+29, 20*60+0);
+        CPPUNIT_ASSERT(location.isCached(112));
+        CPPUNIT_ASSERT(location.cachedYears() <= years);
+        checkYear(location, 112);
+    }
+
+    void testEphemerisMatches()
+    {
+        // Brussels, Tromso (polar day and night) and Sydney
+        const double coords[][2] = { { 4.35, 50.85 }, { 18.95, 69.65 }, { 151.2, -33.87 } };
+        for (int i = 0; i < 3; i++)
+        {
+            LocationInfo location;
+            location.setCoord(coords[i][0], coords[i][1]);
+            checkYear(location, 112);
+            checkYear(location, 113);
+        }
+    }
+
+    void testLocationChange()
+    {
+        LocationInfo location;
+        double rise1, set1, rise2, set2;
+        location.setCoord(4.35, 50.85);
+        CPPUNIT_ASSERT_EQUAL(0, location.getSunRiseSet(112, 5, 21, &rise1, &set1));
+        location.setCoord(-73.98, 40.75);
+        CPPUNIT_ASSERT_EQUAL(0, location.getSunRiseSet(112, 5, 21, &rise2, &set2));
+        CPPUNIT_ASSERT(toMinutes(rise1) != toMinutes(rise2));
+        checkYear(location, 112);
+
+        ticpp::Element pConfig;
+        pConfig.SetAttribute("lon", "18.95");
+        pConfig.SetAttribute("lat", "69.65");
+        location.importXml(&pConfig);
+        CPPUNIT_ASSERT_EQUAL(1, location.getSunRiseSet(112, 5, 21, &rise2, &set2));
+        checkYear(location, 112);
+    }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION( SolarInfoTest );
@@ -0,0 +1,58 @@
+#include <cppunit/extensions/HelperMacros.h>
+#include "knxconnection.h"
+
+class TelegramFrameTest : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE( TelegramFrameTest );
+    CPPUNIT_TEST( testShortData );
+    CPPUNIT_TEST( testAppend );
+    CPPUNIT_TEST( testPadAndOverflow );
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void testShortData()
+    {
+        TelegramFrame frame(true, 1);
+        CPPUNIT_ASSERT_EQUAL(2, frame.getLength());
+        CPPUNIT_ASSERT_EQUAL((uint8_t)0x00, frame.getBuffer()[0]);
+        CPPUNIT_ASSERT_EQUAL((uint8_t)0x81, frame.getBuffer()[1]);
+        CPPUNIT_ASSERT(frame.isWrite());
+        CPPUNIT_ASSERT(!frame.isResponse());
+
+        TelegramFrame response(false, 0xFB);
+        CPPUNIT_ASSERT_EQUAL((uint8_t)0x7B, response.getBuffer()[1]);
+        CPPUNIT_ASSERT(response.isResponse());
+    }
+
+    void testAppend()
+    {
+        TelegramFrame frame(true);
+        frame.append(-2, 2).append(0x12345678, 4) << 0xAB;
+        CPPUNIT_ASSERT_EQUAL(9, frame.getLength());
+        const uint8_t expected[] = { 0x00, 0x80, 0xFF, 0xFE, 0x12, 0x34, 0x56, 0x78, 0xAB };
+        for (int i = 0; i < 9; i++)
+            CPPUNIT_ASSERT_EQUAL(expected[i], frame.getBuffer()[i]);
+
+        TelegramFrame frame64(false);
+        frame64.append(0x0102030405060708LL, 8);
+        CPPUNIT_ASSERT_EQUAL(10, frame64.getLength());
+        CPPUNIT_ASSERT_EQUAL((uint8_t)0x01, frame64.getBuffer()[2]);
+        CPPUNIT_ASSERT_EQUAL((uint8_t)0x08, frame64.getBuffer()[9]);
+    }
+
+    void testPadAndOverflow()
+    {
+        TelegramFrame frame(true);
+        frame << 'a' << 'b';
+        frame.pad(16);
+        CPPUNIT_ASSERT_EQUAL(16, frame.getLength());
+        CPPUNIT_ASSERT_EQUAL((uint8_t)'b', frame.getBuffer()[3]);
+        CPPUNIT_ASSERT_EQUAL((uint8_t)0, frame.getBuffer()[15]);
+
+        for (int i = 0; i < TelegramFrame::MaxLength + 10; i++)
+            frame << 0x55;
+        CPPUNIT_ASSERT_EQUAL((int)TelegramFrame::MaxLength, frame.getLength());
+    }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION( TelegramFrameTest );
@@ -1,4 +1,5 @@
 #include <cppunit/extensions/HelperMacros.h>
+#include <vector>
 #include "timermanager.h"
 
 class StubTimerTask : public TimerTask
@@ -6,13 +7,23 @@ class StubTimerTask : public TimerTask
 public:
     time_t execTime_m;
     bool isOnTimerCalled_m;
-    StubTimerTask() : execTime_m(0), isOnTimerCalled_m(false) {};
-    virtual void onTimer(time_t time) { isOnTimerCalled_m = true; };
+    std::vector<StubTimerTask*>* trace_m;
+    StubTimerTask() : execTime_m(0), isOnTimerCalled_m(false), trace_m(0) {};
+    virtual void onTimer(time_t time) { isOnTimerCalled_m = true; if (trace_m) trace_m->push_back(this); };
     virtual void reschedule(time_t from = 0) {};
     virtual time_t getExecTime() { return execTime_m; };
     virtual void statusXml(ticpp::Element* pStatus) {};
 };
 
+class StubMsTimerTask : public StubTimerTask
+{
+public:
+    TimeMs_t execTimeMs_m;
+    StubMsTimerTask() : execTimeMs_m(0) {};
+    virtual time_t getExecTime() { return execTimeMs_m / 1000; };
+    virtual TimeMs_t getExecTimeMs() { return execTimeMs_m; };
+};
+
 class TimerManagerTest : public CppUnit::TestFixture
 {
     CPPUNIT_TEST_SUITE( TimerManagerTest );
@@ -23,6 +34,10 @@ class TimerManagerTest : public CppUnit::TestFixture
     CPPUNIT_TEST( testTwoTasksOrdered );
     CPPUNIT_TEST( testTwoTasksReversed );
     CPPUNIT_TEST( testAddRemove );
+    CPPUNIT_TEST( testAddTwice );
+    CPPUNIT_TEST( testManyTasks );
+    CPPUNIT_TEST( testMilliseconds );
+    CPPUNIT_TEST( testWakeupOnEarlierTask );
     CPPUNIT_TEST_SUITE_END();
 
 private:
@@ -176,6 +191,110 @@ public:
         CPPUNIT_ASSERT(timermanager_m->checkTaskList(timeref3_m) == TimerManager::Long);
     }
 
+    void testAddTwice()
+    {
+        task1_m.execTime_m = timeref1_m + 5;
+        task2_m.execTime_m = timeref1_m + 10;
+        timermanager_m->addTask(&task1_m);
+        timermanager_m->addTask(&task2_m);
+        // Adding a scheduled task again only moves it
+        task1_m.execTime_m = timeref1_m + 15;
+        timermanager_m->addTask(&task1_m);
+
+        CPPUNIT_ASSERT(timermanager_m->checkTaskList(timeref1_m + 10) == TimerManager::Immediate);
+        CPPUNIT_ASSERT(task1_m.isOnTimerCalled_m == false);
+        CPPUNIT_ASSERT(task2_m.isOnTimerCalled_m == true);
+        CPPUNIT_ASSERT(timermanager_m->checkTaskList(timeref1_m + 10) == TimerManager::Short);
+
+        CPPUNIT_ASSERT(timermanager_m->checkTaskList(timeref1_m + 15) == TimerManager::Immediate);
+        CPPUNIT_ASSERT(task1_m.isOnTimerCalled_m == true);
+        CPPUNIT_ASSERT(timermanager_m->checkTaskList(timeref1_m + 15) == TimerManager::Long);
+    }
+
+    void testManyTasks()
+    {
+        const int count = 1000;
+        std::vector<StubTimerTask*> trace;
+        std::vector<StubTimerTask> tasks(count);
+        unsigned int seed = 4321;
+        for (int i = 0; i < count; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            tasks[i].execTime_m = timeref1_m + (seed >> 16) % 50;
+            tasks[i].trace_m = &trace;
+            timermanager_m->addTask(&tasks[i]);
+        }
+        // Remove one task out of three and reschedule some of the others
+        for (int i = 0; i < count; i += 3)
+            timermanager_m->removeTask(&tasks[i]);
+        for (int i = 1; i < count; i += 6)
+        {
+            tasks[i].execTime_m = timeref1_m + (i * 7) % 50;
+            timermanager_m->addTask(&tasks[i]);
+        }
+
+        while (timermanager_m->checkTaskList(timeref1_m + 50) == TimerManager::Immediate);
+
+        int expected = 0;
+        for (int i = 0; i < count; i++)
+        {
+            if (i % 3 != 0)
+                expected++;
+            else
+                CPPUNIT_ASSERT(tasks[i].isOnTimerCalled_m == false);
+        }
+        CPPUNIT_ASSERT_EQUAL(expected, (int)trace.size());
+        for (int i = 1; i < expected; i++)
+            CPPUNIT_ASSERT(trace[i-1]->execTime_m <= trace[i]->execTime_m);
+    }
+
+    void testMilliseconds()
+    {
+        StubMsTimerTask task1, task2;
+        TimeMs_t ref = timeref1_m * 1000LL;
+        task1.execTimeMs_m = ref + 500;
+        task2.execTimeMs_m = ref + 200;
+        timermanager_m->addTask(&task1);
+        timermanager_m->addTask(&task2);
+
+        CPPUNIT_ASSERT(timermanager_m->checkTaskListMs(ref + 100) == TimerManager::Short);
+        CPPUNIT_ASSERT(timermanager_m->checkTaskListMs(ref + 300) == TimerManager::Immediate);
+        CPPUNIT_ASSERT(task1.isOnTimerCalled_m == false);
+        CPPUNIT_ASSERT(task2.isOnTimerCalled_m == true);
+        CPPUNIT_ASSERT(timermanager_m->checkTaskListMs(ref + 499) == TimerManager::Short);
+        CPPUNIT_ASSERT(timermanager_m->checkTaskListMs(ref + 500) == TimerManager::Immediate);
+        CPPUNIT_ASSERT(task1.isOnTimerCalled_m == true);
+        CPPUNIT_ASSERT(timermanager_m->checkTaskListMs(ref + 500) == TimerManager::Long);
+    }
+
+    void testWakeupOnEarlierTask()
+    {
+        pth_init();
+        StubMsTimerTask late, early1, early2;
+        late.execTimeMs_m = TimerManager::currentTime() + 10000;
+        timermanager_m->addTask(&late);
+        timermanager_m->startManager();
+        // Let the manager wait for the deadline of the late task
+        pth_usleep(50000);
+
+        // Each one becomes the head and posts a wakeup
+        early2.execTimeMs_m = TimerManager::currentTime() + 300;
+        timermanager_m->addTask(&early2);
+        early1.execTimeMs_m = TimerManager::currentTime() + 100;
+        timermanager_m->addTask(&early1);
+        for (int i = 0; i < 100 && !early1.isOnTimerCalled_m; i++)
+            pth_usleep(10000);
+        CPPUNIT_ASSERT(early1.isOnTimerCalled_m);
+        CPPUNIT_ASSERT(!early2.isOnTimerCalled_m);
+        for (int i = 0; i < 100 && !early2.isOnTimerCalled_m; i++)
+            pth_usleep(10000);
+        CPPUNIT_ASSERT(early2.isOnTimerCalled_m);
+        CPPUNIT_ASSERT(!late.isOnTimerCalled_m);
+
+        timermanager_m->stopManager();
+        timermanager_m->removeTask(&late);
+    }
+
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION( TimerManagerTest );
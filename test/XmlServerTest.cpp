@@ -1,11 +1,16 @@
 #include <cppunit/extensions/HelperMacros.h>
+#include <sstream>
 #include "xmlserver.h"
+#include "services.h"
 extern "C"
 {
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 }
 
 class XmlServerTest : public CppUnit::TestFixture
@@ -16,6 +21,13 @@ class XmlServerTest : public CppUnit::TestFixture
     CPPUNIT_TEST( testReadUnterminatedMessage );
     CPPUNIT_TEST( testReadMultipleMessage );
     CPPUNIT_TEST( testReadLongMessage );
+    CPPUNIT_TEST( testReadHugeMessage );
+    CPPUNIT_TEST( testNotificationCoalescing );
+    CPPUNIT_TEST( testXmlWriter );
+    CPPUNIT_TEST( testXmlWriterControlChars );
+    CPPUNIT_TEST( testEventLoopConnection );
+    CPPUNIT_TEST( testEventLoopInitRead );
+    CPPUNIT_TEST( testEventLoopServer );
 //    CPPUNIT_TEST(  );
     
     CPPUNIT_TEST_SUITE_END();
@@ -36,6 +48,65 @@ public:
     {
         if (cc_m)
             delete(cc_m);
+        ObjectController::reset();
+        Services::reset();
+    }
+
+    Object* addObject(const std::string& id, const std::string& type, const std::string& value)
+    {
+        ticpp::Element pConfig;
+        pConfig.SetAttribute("id", id);
+        pConfig.SetAttribute("type", type);
+        pConfig.SetAttribute("init", value);
+        Object* obj = Object::create(&pConfig);
+        ObjectController::instance()->addObject(obj);
+        return obj;
+    }
+
+    // Returns what can be read from fd without waiting
+    std::string readAvailable(int fd)
+    {
+        std::string data;
+        char buf[256];
+        int len;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        while ((len = read(fd, buf, sizeof(buf))) > 0)
+            data.append(buf, len);
+        return data;
+    }
+
+    // Reads from fd until a complete message was received, or 2s elapsed
+    std::string readReply(int fd)
+    {
+        std::string data;
+        char buf[256];
+        pth_event_t tmout = pth_event(PTH_EVENT_TIME, pth_timeout(2,0));
+        while (data.find('\004') == std::string::npos)
+        {
+            int len = pth_read_ev(fd, buf, sizeof(buf), tmout);
+            if (len <= 0)
+                break;
+            data.append(buf, len);
+        }
+        pth_event_free(tmout, PTH_FREE_THIS);
+        return data;
+    }
+
+    int connectUnix(const char* path)
+    {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_LOCAL;
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+        int fd = socket(AF_LOCAL, SOCK_STREAM, 0);
+        CPPUNIT_ASSERT(fd != -1);
+        CPPUNIT_ASSERT_EQUAL(0, connect(fd, (struct sockaddr *) &addr, sizeof(addr)));
+        return fd;
+    }
+
+    void sendMsg(int fd, const std::string& msg)
+    {
+        CPPUNIT_ASSERT_EQUAL((ssize_t)msg.size(), write(fd, msg.data(), msg.size()));
     }
 
     int createMsgFd(const char *msg)
@@ -59,7 +130,7 @@ public:
         pth_event_t stop = pth_event(PTH_EVENT_TIME, pth_timeout(1,0));
         cc_m = new ClientConnection(NULL, createMsgFd("test\004"));
         CPPUNIT_ASSERT_EQUAL(1, cc_m->readmessage(stop));
-        CPPUNIT_ASSERT(cc_m->msg_m == "test");
+        CPPUNIT_ASSERT_EQUAL(std::string("test"), std::string(cc_m->msg_m));
         CPPUNIT_ASSERT_EQUAL(-1, cc_m->readmessage(stop));
     }
 
@@ -75,9 +146,9 @@ public:
         pth_event_t stop = pth_event(PTH_EVENT_TIME, pth_timeout(1,0));
         cc_m = new ClientConnection(NULL, createMsgFd("test\004second message\004"));
         CPPUNIT_ASSERT_EQUAL(1, cc_m->readmessage(stop));
-        CPPUNIT_ASSERT(cc_m->msg_m == "test");
+        CPPUNIT_ASSERT_EQUAL(std::string("test"), std::string(cc_m->msg_m));
         CPPUNIT_ASSERT_EQUAL(1, cc_m->readmessage(stop));
-        CPPUNIT_ASSERT(cc_m->msg_m == "second message");
+        CPPUNIT_ASSERT_EQUAL(std::string("second message"), std::string(cc_m->msg_m));
         CPPUNIT_ASSERT_EQUAL(-1, cc_m->readmessage(stop));
     }
 
@@ -87,11 +158,185 @@ public:
         pth_event_t stop = pth_event(PTH_EVENT_TIME, pth_timeout(1,0));
         cc_m = new ClientConnection(NULL, createMsgFd(msg));
         CPPUNIT_ASSERT_EQUAL(1, cc_m->readmessage(stop));
-        cc_m->msg_m.push_back('\004');
-        CPPUNIT_ASSERT(cc_m->msg_m == msg);
+        CPPUNIT_ASSERT_EQUAL(std::string(msg, strlen(msg) - 1), std::string(cc_m->msg_m));
         CPPUNIT_ASSERT_EQUAL(-1, cc_m->readmessage(stop));
     }
 
+    void testReadHugeMessage()
+    {
+        std::string huge(200000, 'x');
+        std::string msg = "short\004" + huge + "\004end\004";
+        pth_event_t stop = pth_event(PTH_EVENT_TIME, pth_timeout(1,0));
+        cc_m = new ClientConnection(NULL, createMsgFd(msg.c_str()));
+        CPPUNIT_ASSERT_EQUAL(1, cc_m->readmessage(stop));
+        CPPUNIT_ASSERT_EQUAL(std::string("short"), std::string(cc_m->msg_m));
+        CPPUNIT_ASSERT_EQUAL(1, cc_m->readmessage(stop));
+        CPPUNIT_ASSERT(huge == cc_m->msg_m);
+        CPPUNIT_ASSERT_EQUAL(1, cc_m->readmessage(stop));
+        CPPUNIT_ASSERT_EQUAL(std::string("end"), std::string(cc_m->msg_m));
+        CPPUNIT_ASSERT_EQUAL(-1, cc_m->readmessage(stop));
+    }
+
+    void testNotificationCoalescing()
+    {
+        int fds[2];
+        CPPUNIT_ASSERT_EQUAL(0, pipe(fds));
+        ticpp::Element pConfig;
+        pConfig.SetAttribute("id", "notified");
+        pConfig.SetAttribute("type", "5.xxx");
+        Object* obj = Object::create(&pConfig);
+        pConfig.SetAttribute("id", "other");
+        pConfig.SetAttribute("type", "1.001");
+        Object* other = Object::create(&pConfig);
+
+        pth_event_t stop = pth_event(PTH_EVENT_TIME, pth_timeout(1,0));
+        cc_m = new ClientConnection(NULL, fds[1]);
+        obj->setValue("1");
+        cc_m->onChange(obj);
+        other->setValue("on");
+        cc_m->onChange(other);
+        obj->setValue("2");
+        cc_m->onChange(obj);
+        CPPUNIT_ASSERT_EQUAL(0, cc_m->flushNotifications(stop));
+
+        char buf[256];
+        int len = read(fds[0], buf, sizeof(buf));
+        CPPUNIT_ASSERT(len > 0);
+        CPPUNIT_ASSERT_EQUAL(std::string("<notify id='notified'>2</notify>\n\004<notify id='other'>on</notify>\n\004"), std::string(buf, len));
+        // Nothing left to send
+        CPPUNIT_ASSERT_EQUAL(0, cc_m->flushNotifications(stop));
+
+        close(fds[0]);
+        delete obj;
+        delete other;
+    }
+
+    void testXmlWriter()
+    {
+        std::string out;
+        XmlWriter writer(out);
+        writer.startElement("read").attribute("status", "success");
+        writer.startElement("objects");
+        writer.startElement("object").attribute("id", "a<b").attribute("value", "\"on\" & 'off'").endElement();
+        writer.startElement("text").text("1 < 2 > 0").endElement();
+        ticpp::Element section("rules");
+        ticpp::Element rule("rule");
+        rule.SetAttribute("id", "r1");
+        section.LinkEndChild(&rule);
+        writer.element(&section);
+        writer.endElement().endElement();
+        CPPUNIT_ASSERT_EQUAL(std::string("<read status=\"success\">\n"
+            "\t<objects>\n"
+            "\t\t<object id=\"a&lt;b\" value=\"&quot;on&quot; &amp; &apos;off&apos;\" />\n"
+            "\t\t<text>1 &lt; 2 &gt; 0</text>\n"
+            "\t\t<rules>\n"
+            "\t\t\t<rule id=\"r1\" />\n"
+            "\t\t</rules>\n"
+            "\t</objects>\n"
+            "</read>\n"), out);
+
+        ticpp::Document doc;
+        doc.LoadFromString(out);
+        ticpp::Element* pObject = doc.FirstChildElement()->FirstChildElement()->FirstChildElement();
+        CPPUNIT_ASSERT_EQUAL(std::string("a<b"), pObject->GetAttribute("id"));
+        CPPUNIT_ASSERT_EQUAL(std::string("\"on\" & 'off'"), pObject->GetAttribute("value"));
+    }
+
+    void testXmlWriterControlChars()
+    {
+        std::string out;
+        XmlWriter writer(out);
+        writer.startElement("notify").attribute("id", std::string("a\004b\001")).text("tab\tline\r\nend\037").endElement();
+        CPPUNIT_ASSERT_EQUAL(std::string("<notify id=\"a&#x04;b&#x01;\">tab\tline\r\nend&#x1F;</notify>\n"), out);
+        // Nothing in the output may end the message early
+        CPPUNIT_ASSERT(out.find('\004') == std::string::npos);
+    }
+
+    void testEventLoopConnection()
+    {
+        int fds[2];
+        CPPUNIT_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+        fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+        Object* obj = addObject("lamp", "1.001", "on");
+        obj->onUpdate();
+        cc_m = new ClientConnection(NULL, fds[1], true);
+
+        // A message received in two parts is only processed once complete
+        sendMsg(fds[0], "<read><object id='la");
+        CPPUNIT_ASSERT(cc_m->onReadable());
+        CPPUNIT_ASSERT_EQUAL(std::string(""), readAvailable(fds[0]));
+        sendMsg(fds[0], std::string("mp'/></read>\004<write><object id='lamp' value='off'/></write>\004"));
+        CPPUNIT_ASSERT(cc_m->onReadable());
+        CPPUNIT_ASSERT_EQUAL(std::string("<read status='success'>on</read>\n\004<write status='success'/>\n\004"), readAvailable(fds[0]));
+        CPPUNIT_ASSERT_EQUAL(std::string("off"), obj->getValue());
+        CPPUNIT_ASSERT(cc_m->onWritable());
+
+        // The client closing the connection is reported
+        close(fds[0]);
+        CPPUNIT_ASSERT(!cc_m->onReadable());
+    }
+
+    void testEventLoopInitRead()
+    {
+        int fds[2];
+        CPPUNIT_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+        fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+        ticpp::Element pConfig;
+        pConfig.SetAttribute("id", "remote");
+        pConfig.SetAttribute("type", "5.xxx");
+        pConfig.SetAttribute("gad", "1/2/3");
+        pConfig.SetAttribute("init", "request");
+        Object* obj = Object::create(&pConfig);
+        ObjectController::instance()->addObject(obj);
+        CPPUNIT_ASSERT(obj->needsInitRead());
+        cc_m = new ClientConnection(NULL, fds[1], true);
+
+        // The object not read yet is answered without waiting for the bus
+        struct timeval start, end;
+        gettimeofday(&start, 0);
+        sendMsg(fds[0], std::string("<read><objects/></read>\004"));
+        CPPUNIT_ASSERT(cc_m->onReadable());
+        gettimeofday(&end, 0);
+        CPPUNIT_ASSERT((end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000 < 500);
+        std::string reply = readAvailable(fds[0]);
+        CPPUNIT_ASSERT(reply.find("<object id=\"remote\" value=\"0\" />") != std::string::npos);
+        CPPUNIT_ASSERT_EQUAL('\004', reply[reply.size() - 1]);
+        close(fds[0]);
+    }
+
+    void testEventLoopServer()
+    {
+#ifdef HAVE_SYS_EPOLL_H
+        addObject("lamp", "1.001", "on")->onUpdate();
+        // Unique to the process, so that concurrent runs don't collide
+        std::stringstream sockPath;
+        sockPath << "/tmp/linknx_unittest_sock_" << getpid();
+        const std::string path = sockPath.str();
+        XmlServer* server = new XmlUnixServer(path.c_str(), true);
+        int c1 = connectUnix(path.c_str());
+        int c2 = connectUnix(path.c_str());
+        const std::string request("<read><object id='lamp'/></read>\004");
+        const std::string reply("<read status='success'>on</read>\n\004");
+
+        // Both clients are served by the server thread
+        sendMsg(c1, request);
+        sendMsg(c2, request);
+        CPPUNIT_ASSERT_EQUAL(reply, readReply(c2));
+        CPPUNIT_ASSERT_EQUAL(reply, readReply(c1));
+
+        // The other client is still served after one disconnected
+        close(c1);
+        sendMsg(c2, "<write><object id='lamp' value='off'/></write>\004");
+        CPPUNIT_ASSERT_EQUAL(std::string("<write status='success'/>\n\004"), readReply(c2));
+        sendMsg(c2, request);
+        CPPUNIT_ASSERT_EQUAL(std::string("<read status='success'>off</read>\n\004"), readReply(c2));
+
+        close(c2);
+        delete server;
+        unlink(path.c_str());
+#endif
+    }
+
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION( XmlServerTest );
@@ -2,12 +2,16 @@
 #include <cppunit/ui/text/TestRunner.h>
 #include <cppunit/CompilerOutputter.h>
 #include <logger.h>
+#include <string>
 
 int main( int argc, char **argv)
 {
   Logging::instance()->defaultConfig();
   CppUnit::TextUi::TestRunner runner;
-  CppUnit::TestFactoryRegistry &registry = CppUnit::TestFactoryRegistry::getRegistry();
+  // Benchmarks are only run on request
+  bool benchmark = argc > 1 && std::string(argv[1]) == "--benchmark";
+  CppUnit::TestFactoryRegistry &registry = benchmark ?
+      CppUnit::TestFactoryRegistry::getRegistry("Benchmark") : CppUnit::TestFactoryRegistry::getRegistry();
   runner.addTest( registry.makeTest() );
   runner.setOutputter( new CppUnit::CompilerOutputter( &runner.result(), std::cerr ) );
   bool wasSuccessful = runner.run( "", false );